@@ -0,0 +1,407 @@
+#define STB_IMAGE_IMPLEMENTATION	// DO THIS ONLY IN ONE .cpp FILE
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <glm/glm.hpp>
+
+#include <model.h>
+#include <shader_variants.h>
+#include <render_pipeline.h>
+#include <uniform_blocks.h>
+#include <intrinsics.h>
+#include <renderer.h>
+#include <asset_cache.h>
+#include <job_spec.h>
+#include <stage_timers.h>
+
+#include "conf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Headless throughput benchmark of the generation pipeline. Each scenario (a model, a resolution, a set of outputs) is
+// imported and uploaded, then rendered from the same orbit of cameras with the outputs saved as in a batch job (the
+// snapshots go to conf::benchmark_out_folder). Reported as JSON, per scenario: the time of every stage (see StageTimers),
+// the frames per second from the first render to the last file written, the writer's throughput and the peak memory of
+// the process, for comparing versions.
+//
+//     benchmark [--out results.json] [--scenario name]... [--all] [--frames n] [--list]
+//
+// Besides the bundled models, procedural scenes (see procedural_scene.h) sweep the triangle count from a thousand to a
+// hundred million. The largest ones take tens of GB and only run when named, or with --all. The peak memory is the
+// process's so far: run a single scenario per process (--scenario) for the peak of each one. The times depend on conf.h
+// (the depth mode, the G-buffer pass, the mesh batching, the writer, the asset cache): its relevant settings are in the
+// report.
+
+struct Scenario {
+    const char* name;
+    const char* model;
+    unsigned int width, height;
+    unsigned int outputs;
+    float radius;       // of the orbit of the cameras, around target
+    glm::vec3 target;
+    bool large{ false };    // only run when asked for
+};
+
+const glm::vec3 bunnyCenter{ -0.017f, 0.110f, -0.002f };
+const glm::vec3 buddhaCenter{ -0.009f, 0.148f, -0.002f };
+
+const Scenario scenarios[] = {
+    { "bunny_res4_depth_600",       "../data/models/stanford_bunny/reconstruction/bun_zipper_res4.ply", 600, 600, OUTPUT_DEPTH, 0.35f, bunnyCenter },
+    { "bunny_res3_all_600",         "../data/models/stanford_bunny/reconstruction/bun_zipper_res3.ply", 600, 600, OUTPUT_ALL, 0.35f, bunnyCenter },
+    { "bunny_res2_all_600",         "../data/models/stanford_bunny/reconstruction/bun_zipper_res2.ply", 600, 600, OUTPUT_ALL, 0.35f, bunnyCenter },
+    { "bunny_all_600",              "../data/models/stanford_bunny/reconstruction/bun_zipper.ply", 600, 600, OUTPUT_ALL, 0.35f, bunnyCenter },
+    { "buddha_res4_depth_600",      "../data/models/buddha/happy_vrip_res4.ply", 600, 600, OUTPUT_DEPTH, 0.45f, buddhaCenter },
+    { "buddha_res3_all_600",        "../data/models/buddha/happy_vrip_res3.ply", 600, 600, OUTPUT_ALL, 0.45f, buddhaCenter },
+    { "buddha_res3_depth_1920",     "../data/models/buddha/happy_vrip_res3.ply", 1920, 1080, OUTPUT_DEPTH, 0.45f, buddhaCenter },
+    { "buddha_res3_all_1920",       "../data/models/buddha/happy_vrip_res3.ply", 1920, 1080, OUTPUT_ALL, 0.45f, buddhaCenter },
+    { "backpack_depth_600",         "../data/models/backpack/backpack.obj", 600, 600, OUTPUT_DEPTH, 4.0f, glm::vec3(0.0f) },
+    { "backpack_HDR_normals_600",   "../data/models/backpack/backpack.obj", 600, 600, OUTPUT_HDR | OUTPUT_NORMALS, 4.0f, glm::vec3(0.0f) },
+    { "backpack_all_600",           "../data/models/backpack/backpack.obj", 600, 600, OUTPUT_ALL, 4.0f, glm::vec3(0.0f) },
+    { "backpack_all_1920",          "../data/models/backpack/backpack.obj", 1920, 1080, OUTPUT_ALL, 4.0f, glm::vec3(0.0f) },
+    { "sphere_1K_all_600",          "procedural:sphere?triangles=1K", 600, 600, OUTPUT_ALL, 4.0f, glm::vec3(0.0f) },
+    { "sphere_100K_all_600",        "procedural:sphere?triangles=100K", 600, 600, OUTPUT_ALL, 4.0f, glm::vec3(0.0f) },
+    { "sphere_10M_all_600",         "procedural:sphere?triangles=10M", 600, 600, OUTPUT_ALL, 4.0f, glm::vec3(0.0f) },
+    { "grid_1M_layers4_all_600",    "procedural:grid?triangles=1M&layers=4&textures=4", 600, 600, OUTPUT_ALL, 4.0f, glm::vec3(0.0f) },
+    { "clutter_1M_layers8_all_600", "procedural:clutter?triangles=1M&layers=8&textures=16", 600, 600, OUTPUT_ALL, 4.0f, glm::vec3(0.0f) },
+    { "clutter_10M_layers32_depth_1920", "procedural:clutter?triangles=10M&layers=32&textures=16", 1920, 1080, OUTPUT_DEPTH, 4.0f, glm::vec3(0.0f) },
+    { "sphere_100M_depth_600",      "procedural:sphere?triangles=100M&meshes=16", 600, 600, OUTPUT_DEPTH, 4.0f, glm::vec3(0.0f), true },
+    { "clutter_100M_layers8_depth_600", "procedural:clutter?triangles=100M&layers=8&meshes=64", 600, 600, OUTPUT_DEPTH, 4.0f, glm::vec3(0.0f), true },
+};
+
+struct ScenarioResult {
+    const Scenario* scenario{ nullptr };
+    bool valid{ false };
+    uint64_t triangles{ 0 }, meshes{ 0 }, textures{ 0 };
+    StageTimers::Totals load;       // import, decoding, upload
+    StageTimers::Totals frames;     // the timed frames
+    unsigned int frameCount{ 0 };
+    double seconds{ 0.0 };
+    FileWriter::Stats writer;       // of the timed frames
+    uint64_t peakMemory{ 0 };
+};
+
+// the peak resident memory of the process so far, in bytes
+uint64_t peakMemoryBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);          // bytes
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;   // kilobytes
+#endif
+#endif
+}
+
+template<typename Policy>
+ScenarioResult runScenario(const Scenario& scenario, unsigned int frameCount, Renderer& renderer, ShaderVariants& shaders, SharedUniforms& shared)
+{
+    using Clock = std::chrono::steady_clock;
+    StageTimers& timers = StageTimers::global();
+    ScenarioResult result;
+    result.scenario = &scenario;
+    result.frameCount = frameCount;
+
+    // import and upload, on this thread
+    StageTimers::Totals before = timers.snapshot();
+    ModelData data = loadModelData(scenario.model);
+    if (!data.valid)
+    {
+        std::cout << "ERROR::BENCHMARK:: cannot import " << scenario.model << ", scenario " << scenario.name << " skipped" << std::endl;
+        return result;
+    }
+    for (const MeshData& mesh : data.meshes) result.triangles += mesh.indices.size() / 3;
+    result.meshes = data.meshes.size();
+    result.textures = data.images.size();
+    Model model(std::move(data));
+    glFinish();
+    result.load = timers.snapshot() - before;
+    result.valid = true;
+
+    // the orbit: the warm-up frames first, then the timed ones
+    JobSpec spec;
+    spec.models = { scenario.model };
+    spec.cameras = conf::benchmark_warmup_frames + frameCount;
+    spec.cameraRadius = scenario.radius;
+    spec.cameraElevation[0] = -20.0f;
+    spec.cameraElevation[1] = 50.0f;
+    spec.cameraTarget = scenario.target;
+    spec.lightElevation[0] = spec.lightElevation[1] = 30.0f;
+    spec.sensor = Intrinsics().resized(scenario.width, scenario.height);
+
+    glm::mat4 modelMatrix = glm::mat4(1.0f);
+    glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
+    shaders.forEach([&](Shader& shader) {
+        shader.use();
+        shader.setMat4("model", modelMatrix);
+        shader.setMat3("normalMatrix", normalMatrix);
+    });
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+
+    auto render = [&](uint64_t i) {
+        FrameDescriptor frame = spec.frame(i);
+        shared.frame.projection = frame.sensor.projection(Policy::reverse);
+        shared.frame.Near = frame.sensor.near;
+        shared.frame.Far = frame.sensor.far;
+        shared.frame.view = frame.view;
+        shared.frame.camPos = frame.camPos;
+        shared.light.wDir = frame.lightDir;
+        shared.upload();
+
+        renderer.save_to_txt = true;
+        renderer.nSnapshots = static_cast<int>(i);
+        renderer.snapshot_view = frame.view;
+        renderer.snapshot_light = frame.lightDir;
+        renderer.Draw<Policy>(model, shaders, frame.sensor);
+        renderer.targetPool.nextFrame();
+    };
+    // everything rendered so far written, and timed
+    auto drain = [&]() {
+        renderer.exports.flush();
+        renderer.passTimers.collect(true);
+    };
+
+    // the warm-up frames create the framebuffers and the readback buffers, and fill the caches
+    for (uint64_t i = 0; i < conf::benchmark_warmup_frames; ++i) render(i);
+    drain();
+
+    FileWriter::Stats writerBefore = renderer.exports.writerStats();
+    before = timers.snapshot();
+    auto start = Clock::now();
+    for (uint64_t i = conf::benchmark_warmup_frames; i < spec.cameras; ++i) render(i);
+    drain();
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    result.frames = timers.snapshot() - before;
+    FileWriter::Stats writerAfter = renderer.exports.writerStats();
+    result.writer = writerAfter;
+    result.writer.bytes = writerAfter.bytes - writerBefore.bytes;
+    result.writer.files = writerAfter.files - writerBefore.files;
+    result.writer.seconds = writerAfter.seconds - writerBefore.seconds;
+
+    result.peakMemory = peakMemoryBytes();
+    return result;
+}
+
+// JSON string, quotes included
+std::string quoted(const std::string& text)
+{
+    std::string result = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\') result += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20) result += c;
+    }
+    return result + "\"";
+}
+
+void writeReport(std::ostream& out, const std::vector<ScenarioResult>& results, const std::string& writerName)
+{
+    const char* renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+    out << std::fixed << std::setprecision(3);
+    out << "{\n";
+    out << "  \"renderer\": " << quoted(renderer ? renderer : "") << ",\n";
+    out << "  \"gl_version\": " << quoted(version ? version : "") << ",\n";
+    out << "  \"config\": {\n";
+    out << "    \"depth_mode\": " << quoted(conf::depth_mode) << ",\n";
+    out << "    \"gbuffer_pass\": " << (conf::gbuffer_pass ? "true" : "false") << ",\n";
+    out << "    \"optimize_meshes\": " << (conf::optimize_meshes ? "true" : "false") << ",\n";
+    out << "    \"batch_meshes\": " << (conf::batch_meshes ? "true" : "false") << ",\n";
+    out << "    \"asset_cache\": " << (conf::asset_cache_folder.empty() ? "false" : "true") << ",\n";
+    out << "    \"frame_ring\": " << (conf::frame_ring.empty() ? "false" : "true") << ",\n";
+    out << "    \"writer\": " << quoted(writerName) << ",\n";
+    out << "    \"frames_in_flight\": " << conf::frames_in_flight << ",\n";
+    out << "    \"warmup_frames\": " << conf::benchmark_warmup_frames << "\n";
+    out << "  },\n";
+    out << "  \"scenarios\": [";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const ScenarioResult& result = results[i];
+        const Scenario& scenario = *result.scenario;
+        out << (i > 0 ? "," : "") << "\n    {\n";
+        out << "      \"name\": " << quoted(scenario.name) << ",\n";
+        out << "      \"model\": " << quoted(scenario.model) << ",\n";
+        out << "      \"width\": " << scenario.width << ",\n";
+        out << "      \"height\": " << scenario.height << ",\n";
+        out << "      \"outputs\": [";
+        const char* separator = "";
+        if (scenario.outputs & OUTPUT_DEPTH) { out << separator << "\"depth_map\""; separator = ", "; }
+        if (scenario.outputs & OUTPUT_HDR) { out << separator << "\"HDR\""; separator = ", "; }
+        if (scenario.outputs & OUTPUT_NORMALS) { out << separator << "\"normals\""; }
+        out << "],\n";
+        out << "      \"valid\": " << (result.valid ? "true" : "false");
+        if (!result.valid)
+        {
+            out << "\n    }";
+            continue;
+        }
+        out << ",\n";
+        out << "      \"triangles\": " << result.triangles << ",\n";
+        out << "      \"meshes\": " << result.meshes << ",\n";
+        out << "      \"textures\": " << result.textures << ",\n";
+        out << "      \"load_ms\": {";
+        const Stage loadStages[] = { Stage::Import, Stage::TextureDecode, Stage::Upload };
+        for (size_t s = 0; s < 3; ++s)
+            out << (s > 0 ? ", " : " ") << quoted(stageName(loadStages[s])) << ": " << result.load[loadStages[s]].milliseconds();
+        out << " },\n";
+        out << "      \"frames\": " << result.frameCount << ",\n";
+        out << "      \"seconds\": " << result.seconds << ",\n";
+        out << "      \"fps\": " << (result.seconds > 0.0 ? result.frameCount / result.seconds : 0.0) << ",\n";
+        // the stages of the frames: totals, and per frame
+        out << "      \"stages\": {";
+        bool first = true;
+        for (int s = static_cast<int>(Stage::DepthPass); s < StageTimers::STAGES; ++s)
+        {
+            const StageTimers::Total& total = result.frames.stages[s];
+            if (total.count == 0) continue;
+            out << (first ? "\n" : ",\n") << "        " << quoted(stageName(static_cast<Stage>(s))) << ": { \"total_ms\": " << total.milliseconds()
+                << ", \"count\": " << total.count << ", \"per_frame_ms\": " << total.milliseconds() / result.frameCount << " }";
+            first = false;
+        }
+        out << (first ? "},\n" : "\n      },\n");
+        out << "      \"writer\": { \"bytes\": " << result.writer.bytes << ", \"files\": " << result.writer.files << ", \"seconds\": " << result.writer.seconds
+            << ", \"MB_per_s\": " << result.writer.bandwidth() / (1024.0 * 1024.0) << ", \"max_in_flight\": " << result.writer.maxInFlight << " },\n";
+        out << "      \"peak_memory_bytes\": " << result.peakMemory << "\n";
+        out << "    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv)
+{
+    std::string outPath = conf::benchmark_out_folder + "results.json";
+    std::vector<std::string> selected;
+    unsigned int frames = conf::benchmark_frames;
+    bool all = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--out" && i + 1 < argc) outPath = argv[++i];
+        else if (arg == "--scenario" && i + 1 < argc) selected.push_back(argv[++i]);
+        else if (arg == "--all") all = true;
+        else if (arg == "--frames" && i + 1 < argc) frames = static_cast<unsigned int>(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--list")
+        {
+            for (const Scenario& scenario : scenarios) std::cout << scenario.name << (scenario.large ? " (large)" : "") << "\n";
+            return 0;
+        }
+        else
+        {
+            std::cout << "Unknown argument " << arg << ", expected --out path, --scenario name, --all, --frames n or --list" << std::endl;
+            return -1;
+        }
+    }
+    if (frames == 0)
+    {
+        std::cout << "ERROR::BENCHMARK:: --frames must be at least 1" << std::endl;
+        return -1;
+    }
+    std::vector<const Scenario*> runs;
+    for (const Scenario& scenario : scenarios)
+    {
+        bool named = std::find(selected.begin(), selected.end(), scenario.name) != selected.end();
+        if (named || (selected.empty() && (all || !scenario.large))) runs.push_back(&scenario);
+    }
+    if (runs.size() < selected.size())
+    {
+        std::cout << "ERROR::BENCHMARK:: unknown scenario, see --list" << std::endl;
+        return -1;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(conf::benchmark_out_folder, error);
+
+    // a hidden window, for its context
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow* window = glfwCreateWindow(conf::SCR_WIDTH, conf::SCR_HEIGHT, "Benchmark", NULL, NULL);
+    if (window == NULL)
+    {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(window);
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    {
+        std::cout << "Failed to initialize GLAD" << std::endl;
+        return -1;
+    }
+    stbi_set_flip_vertically_on_load(true);
+
+    PipelineConfig pipeline = PipelineConfig::fromConf();
+    pipeline.preview = Preview::None;
+    if (pipeline.depth == DepthMode::Reverse) glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
+
+    {   // the GL objects are deleted at the end of this scope, while the context is still there
+        Shader::setBinaryCache(conf::shader_cache_folder);
+        Shader::enableParallelCompile((GLADloadproc)glfwGetProcAddress);
+        // the variants of every scenario to run, whatever the outputs of conf.h
+        std::vector<ShaderOutput> variants;
+        for (const Scenario* scenario : runs)
+        {
+            PipelineConfig config = pipeline;
+            config.outputs = scenario->outputs;
+            for (ShaderOutput output : Renderer::requiredOutputs(config))
+                if (std::find(variants.begin(), variants.end(), output) == variants.end()) variants.push_back(output);
+        }
+        ShaderVariants standardShaders("../Data/shaders/standard.vert", "../Data/shaders/standard.frag", variants);
+        Renderer renderer;
+        renderer.out_folder = conf::benchmark_out_folder;
+        SharedUniforms shared;
+        shared.light.color = glm::vec3(10.0f, 10.0f, 10.0f);
+
+        StageTimers::global().enable();
+        std::vector<ScenarioResult> results;
+        for (const Scenario* scenario : runs)
+        {
+            std::cout << "Benchmark: " << scenario->name << std::endl;
+            pipeline.outputs = scenario->outputs;
+            dispatchPipeline(pipeline, [&](auto policy) {
+                results.push_back(runScenario<decltype(policy)>(*scenario, frames, renderer, standardShaders, shared));
+            });
+        }
+
+        std::ofstream out(outPath);
+        if (!out) std::cout << "ERROR::BENCHMARK:: cannot write " << outPath << std::endl;
+        else
+        {
+            writeReport(out, results, renderer.exports.writerName());
+            std::cout << "Benchmark results saved to " << outPath << std::endl;
+        }
+    }
+
+    glfwTerminate();
+    return 0;
+}
@@ -4,10 +4,17 @@ out vec4 FragColor;
 in vec2 TexCoords;
 
 uniform sampler2D depthMap;
-uniform float near_plane;
-uniform float far_plane;
 uniform int reverse;
 
+// shared per-frame data, see uniform_blocks.h: we only need the near and far planes
+layout (std140) uniform Frame {
+    mat4 projection;
+    mat4 view;
+    vec3 camPos;
+    float near_plane;
+    float far_plane;
+};
+
 // required when using a perspective projection matrix
 float LinearizeDepth(float depth, int reverse)  // depth is gl_FragCoord.z
 {   
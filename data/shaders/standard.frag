@@ -1,28 +1,43 @@
 #version 330 core
 
-struct Light{
-	vec3 color;
-	vec3 wDir;
-};
+// output type, injected by ShaderVariants: OUTPUT_DEPTH_ONLY, OUTPUT_NORMALS, OUTPUT_HDR or OUTPUT_GBUFFER
+#if !defined(OUTPUT_DEPTH_ONLY) && !defined(OUTPUT_NORMALS) && !defined(OUTPUT_GBUFFER)
+#define OUTPUT_HDR
+#endif
 
 struct Material{
 	sampler2D texture_diffuse1;
 	sampler2D texture_specular1;
 };
 
+#if defined(OUTPUT_GBUFFER)
+layout (location = 0) out vec4 FragColor;
+layout (location = 1) out vec4 FragNormal;
+#elif !defined(OUTPUT_DEPTH_ONLY)
 out vec4 FragColor;
+#endif
+
+#ifndef OUTPUT_DEPTH_ONLY
 in vec2 TexCoords;
 in vec3 Normal;
 in vec3 wPos;
+#endif
 
-uniform vec3 camPos;
 uniform Material material;
-uniform Light light;
 
-uniform int normal_map;	// controls whether the color will be the normals or not
+// shared per-frame and light data, see uniform_blocks.h
+layout (std140) uniform Frame {
+	mat4 projection;
+	mat4 view;
+	vec3 camPos;
+	float Near;
+	float Far;
+};
+layout (std140) uniform Light {
+	vec3 color;
+	vec3 wDir;
+} light;
 
-uniform float Near;
-uniform float Far;
 // Take as input the depth in NDC, further (linearly) mapped to [0,1], and get back the z value in eye coordinates (camera coordinates)
 float retrieve_depth(float z_01)
 {
@@ -30,32 +45,36 @@ float retrieve_depth(float z_01)
     return (2.0 * Near * Far) / (Far + Near - z * (Far - Near));	
 }
 
+#if defined(OUTPUT_HDR) || defined(OUTPUT_GBUFFER)
+vec3 shade()
+{
+	vec3 normlightdir = normalize(-light.wDir);
+	vec3 n = normalize(Normal);
+
+	// diffuse
+	vec3 diffuse_sh = max(dot(normlightdir, n),0) * light.color;
+
+	// specular
+	float c = 20.0;
+	vec3 viewdir = normalize(camPos-wPos);
+	vec3 refl = reflect(-normlightdir, n);	// the first vector should point to the fragment
+	float spec = pow(max(dot(refl,viewdir),0.0), c);
+	vec3 spec_sh = spec * light.color;
+
+	return vec3(texture(material.texture_diffuse1, TexCoords))*diffuse_sh+vec3(texture(material.texture_specular1, TexCoords))*spec_sh;
+}
+#endif
+
 void main()
 {    
+#if defined(OUTPUT_HDR)
+	FragColor = vec4(shade(), 1.0f);
+#elif defined(OUTPUT_NORMALS)
+	FragColor = vec4(Normal*0.5f+0.5f, 1.0f);
+#elif defined(OUTPUT_GBUFFER)
+	FragColor = vec4(shade(), 1.0f);
+	FragNormal = vec4(Normal*0.5f+0.5f, 1.0f);
+#endif
 
-	if (normal_map==0)
-	{
-   		vec3 normlightdir = normalize(-light.wDir);
-		vec3 n = normalize(Normal);
-
-		// diffuse
-		vec3 diffuse_sh = max(dot(normlightdir, n),0) * light.color;
-
-		// specular
-		float c = 20.0;
-		vec3 viewdir = normalize(camPos-wPos);
-		vec3 refl = reflect(-normlightdir, n);	// the first vector should point to the fragment
-		float spec = pow(max(dot(refl,viewdir),0.0), c);
-		vec3 spec_sh = spec * light.color;
-	
-		vec3 res = vec3(texture(material.texture_diffuse1, TexCoords))*diffuse_sh+vec3(texture(material.texture_specular1, TexCoords))*spec_sh;
-		FragColor = vec4(res, 1.0f);
-	}
-	else{
-		FragColor = vec4(Normal*0.5f+0.5f, 1.0f);
-	}
-
-	// Note: if we're in depth map mode, this will not happen, and the .z component of the fragment will be returned instead
-	// So, it is fine to leave this code as is
-
-}
\ No newline at end of file
+	// Note: in depth only mode nothing is written, and the .z component of the fragment goes to the depth buffer
+}
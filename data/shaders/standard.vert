@@ -3,25 +3,36 @@ layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
 
+// output type, injected by ShaderVariants: OUTPUT_DEPTH_ONLY, OUTPUT_NORMALS, OUTPUT_HDR or OUTPUT_GBUFFER
+#if !defined(OUTPUT_DEPTH_ONLY) && !defined(OUTPUT_NORMALS) && !defined(OUTPUT_GBUFFER)
+#define OUTPUT_HDR
+#endif
+
+#ifndef OUTPUT_DEPTH_ONLY
 out vec2 TexCoords;
 out vec3 Normal;
 out vec3 wPos;
+#endif
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+uniform mat3 normalMatrix;	// transpose(inverse(mat3(model))), computed once on the CPU
 
-// Take the matrix A, return A(i,j) (i-th row, j-th column)
-float el(mat4 A, int i, int j)
-{
-    return A[j][i]; // because of the column-major ordering: https://stackoverflow.com/questions/13633395/how-do-you-access-the-individual-elements-of-a-glsl-mat4
-}
+// shared per-frame data, see uniform_blocks.h
+layout (std140) uniform Frame {
+    mat4 projection;
+    mat4 view;
+    vec3 camPos;
+    float Near;
+    float Far;
+};
 
 void main()
 {
+    vec4 world = model * vec4(aPos, 1.0);
+    gl_Position = projection * view * world;
+#ifndef OUTPUT_DEPTH_ONLY
     TexCoords = aTexCoords;  
-    vec4 eye_coords = view * model * vec4(aPos, 1.0);
-    gl_Position = projection * eye_coords;
-    Normal = mat3(transpose(inverse(model))) * aNormal;
-    wPos = vec3(model * vec4(aPos, 1.0f));
-}
\ No newline at end of file
+    Normal = normalMatrix * aNormal;
+    wPos = vec3(world);
+#endif
+}
@@ -10,22 +10,35 @@
 #include <shaderClass.h>
 #include <camera.h>
 #include <model.h>
+#include <shader_variants.h>
+#include <render_pipeline.h>
+#include <uniform_blocks.h>
+#include <intrinsics.h>
+#include <render_targets.h>
+#include <renderer.h>
+#include <asset_streamer.h>
+#include <render_workers.h>
+#include <render_service.h>
+#include <job_runner.h>
+#include <work_queue.h>
 
 #include "conf.h"
 
 //#include "filesystem.h"
 #include <vector>
+#include <memory>
 #include <iostream>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
-void processInput(GLFWwindow* window, Model& ourModel);
+void processInput(GLFWwindow* window);
 glm::vec3 getLightDir(float t, float f);
-glm::mat4 getProjectionMatrix(float l, float r, float b, float t, float n, float f);
+template<typename Policy>
+void renderLoop(GLFWwindow* window, Renderer& renderer, AssetStreamer& streamer, std::unique_ptr<Model>& ourModel, ShaderVariants& standardShaders, SharedUniforms& shared, RenderWorkerPool* workers, const Intrinsics& sensor, IntrinsicsSampler& sampler);
 
 // camera
-bool lock{ true };  // the camera cannot move
+bool camera_lock{ true };  // the camera cannot move
 Camera camera(glm::vec3(0.0f, 0.0f, 3.0f));
 float lastX = conf::SCR_WIDTH / 2.0f;
 float lastY = conf::SCR_HEIGHT / 2.0f;
@@ -35,6 +48,9 @@ bool firstMouse = true;
 float theta{ 0.0f }, phi{ 180.0f };   // in degrees
 float v_deg{ 2.0f };    // how fast are those angles changing?
 
+// window size, updated by framebuffer_size_callback
+int windowWidth{ 0 }, windowHeight{ 0 };
+
 // timing
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
@@ -43,8 +59,40 @@ float lastFrame = 0.0f;
 bool save{ false };
 int nSnapshots{ 0 };
 
-int main()
+// model swap
+bool nextModel{ false };
+size_t currentModel{ 0 };   // index in conf::models
+
+int main(int argc, char** argv)
 {
+    // command line: --shard k/N, to render the share k of N of the job (see Shard); --worker k/N, to render it as worker k
+    // of N processes of the node, which balance the frames between them (see WorkQueue)
+    Shard shard, worker;
+    bool queued = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--shard" && i + 1 < argc)
+        {
+            if (!Shard::parse(argv[++i], shard)) return -1;
+        }
+        else if (arg == "--worker" && i + 1 < argc)
+        {
+            if (!Shard::parse(argv[++i], worker)) return -1;
+            queued = true;
+        }
+        else
+        {
+            std::cout << "Unknown argument " << arg << ", expected --shard k/N or --worker k/N" << std::endl;
+            return -1;
+        }
+    }
+    if ((shard.count > 1 || queued) && conf::job_spec.empty())
+    {
+        std::cout << "ERROR::MAIN:: --shard and --worker need a job (conf::job_spec)" << std::endl;
+        return -1;
+    }
+
     // glfw: initialize and configure
     // ------------------------------
     glfwInit();
@@ -52,13 +100,21 @@ int main()
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+    // the sensor: conf.h, unless a camera config says otherwise
+    Intrinsics sensor;
+    IntrinsicsSampler sampler;
+    if (!conf::camera_config.empty() && !loadCameraConfig(conf::camera_config, sensor, sampler))
+        return -1;
+
 #ifdef __APPLE__
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
 
     // glfw window creation
     // --------------------
-    GLFWwindow* window = glfwCreateWindow(conf::SCR_WIDTH, conf::SCR_HEIGHT, "Window", NULL, NULL);
+    const bool interactive = conf::service_socket.empty() && conf::job_spec.empty();
+    if (!interactive) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);    // the service and the jobs only need the context
+    GLFWwindow* window = glfwCreateWindow(sensor.width, sensor.height, "Window", NULL, NULL);
     if (window == NULL)
     {
         std::cout << "Failed to create GLFW window" << std::endl;
@@ -66,12 +122,13 @@ int main()
         return -1;
     }
     glfwMakeContextCurrent(window);
+    glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
 
     // tell GLFW to capture our mouse
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    if (interactive) glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
     // glad: load all OpenGL function pointers
     // ---------------------------------------
@@ -84,28 +141,99 @@ int main()
     // tell stb_image.h to flip loaded texture's on the y-axis (before loading model).
     stbi_set_flip_vertically_on_load(true);
 
+    // What the frames do: read once here, then fixed at compile time inside the frame loop (see render_pipeline.h)
+    const PipelineConfig pipeline = PipelineConfig::fromConf();
+
     // Use the reverse z trick
-    if(conf::depth_mode == "reverse")    glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
+    if(pipeline.depth == DepthMode::Reverse)    glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
  
-    // build and compile shaders
-    // -------------------------
-    Shader normalShader("../Data/shaders/standard.vert", "../Data/shaders/standard.frag");   
-    // load models
-    // -----------
-    Model ourModel("C:/Code/University/TUM/learnOpenGL/data/models/backpack/backpack.obj");
-
-    // lights and shadows
-    // ------
-    glm::vec3 lightCol(10.0f, 10.0f, 10.0f);
-    normalShader.use();
-    normalShader.setVec3("light.color", lightCol);
-    normalShader.setInt("shadowMap", 2);
-
-    // draw in wireframe
-    //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-
-    // render loop
-    // -----------
+    {   // the GL objects are deleted at the end of this scope, while the context is still there
+        // build and compile shaders (in parallel where the driver allows it, or straight from the binary cache)
+        // -------------------------
+        Shader::setBinaryCache(conf::shader_cache_folder);
+        Shader::enableParallelCompile((GLADloadproc)glfwGetProcAddress);
+        ShaderVariants standardShaders("../Data/shaders/standard.vert", "../Data/shaders/standard.frag", Renderer::requiredOutputs(pipeline));
+
+        // what stays for the whole run: screen shaders, screen quad, framebuffers
+        // -----------
+        Renderer renderer;
+
+        // uniform blocks shared by all the programs: per-frame data and light
+        // ------
+        SharedUniforms shared;
+        shared.light.color = glm::vec3(10.0f, 10.0f, 10.0f);
+
+        // models are imported in the background, see AssetStreamer
+        // -----------
+        AssetStreamer streamer;
+
+        // a local render service instead of the window, if asked: it keeps everything above loaded between requests
+        // -----------
+        if (!conf::service_socket.empty())
+        {
+            RenderService service(conf::service_socket);
+            if (service.listening())
+                dispatchPipeline(pipeline, [&](auto policy) {
+                    serveRequests<decltype(policy)>(service, renderer, standardShaders, shared, streamer);
+                });
+        }
+        // or a batch job
+        // -----------
+        else if (!conf::job_spec.empty())
+        {
+            JobSpec spec;
+            uint64_t first, end;
+            if (loadJobSpec(conf::job_spec, spec))
+            {
+                jobRange(spec, conf::job_first, conf::job_count, shard, first, end);
+                dispatchPipeline(pipeline, [&](auto policy) {
+                    if (queued)
+                    {
+                        WorkQueue queue(conf::work_queue, spec, first, end, worker, pipeline.outputs);
+                        if (queue.valid()) runJob<decltype(policy)>(window, spec, queue, renderer, standardShaders, shared, streamer);
+                    }
+                    else
+                    {
+                        JobRange range(first, end);
+                        runJob<decltype(policy)>(window, spec, range, renderer, standardShaders, shared, streamer);
+                    }
+                });
+            }
+        }
+        else
+        {
+            // load the first model, the others are swapped in with N (and imported in the background in the meantime)
+            // -----------
+            std::unique_ptr<Model> ourModel = std::make_unique<Model>(streamer.take(conf::models[0]));
+            if (conf::models.size() > 1) streamer.prefetch(conf::models[1]);   // a single model would be held twice
+
+            // threads rendering the snapshots in their own contexts, if any (declared after the model: they go first)
+            // ------
+            std::unique_ptr<RenderWorkerPool> workers;
+            if (conf::render_workers > 0) workers = std::make_unique<RenderWorkerPool>(window);
+
+            // draw in wireframe
+            //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+
+            // render loop, instantiated for the configuration of the pipeline
+            // -----------
+            dispatchPipeline(pipeline, [&](auto policy) {
+                renderLoop<decltype(policy)>(window, renderer, streamer, ourModel, standardShaders, shared, workers.get(), sensor, sampler);
+            });
+        }
+    }
+
+    // glfw: terminate, clearing all previously allocated GLFW resources.
+    // ------------------------------------------------------------------
+    glfwTerminate();
+    return 0;
+}
+
+// the frame loop, one instantiation per RenderPolicy (see dispatchPipeline)
+// ---------------------------------------------------------------------------------------------------------
+template<typename Policy>
+void renderLoop(GLFWwindow* window, Renderer& renderer, AssetStreamer& streamer, std::unique_ptr<Model>& ourModel, ShaderVariants& standardShaders, SharedUniforms& shared, RenderWorkerPool* workers, const Intrinsics& sensor, IntrinsicsSampler& sampler)
+{
     while (!glfwWindowShouldClose(window))
     {
         // per-frame time logic
@@ -116,47 +244,51 @@ int main()
 
         // input
         // -----
-        processInput(window, ourModel);
+        processInput(window);
+
+        // swap the model: the old one is deleted first, so that a single model is on the GPU at any time. The new one
+        // has been imported in the background (only the upload is left), and the import of the following one starts
+        if (nextModel)
+        {
+            currentModel = (currentModel + 1) % conf::models.size();
+            if (workers) workers->release(*ourModel);
+            ourModel.reset();
+            ourModel = std::make_unique<Model>(streamer.take(conf::models[currentModel]));
+            if (conf::models.size() > 1) streamer.prefetch(conf::models[(currentModel + 1) % conf::models.size()]);
+            nextModel = false;
+        }
 
         // render
         // ------
         glClearColor(0.0f, 0.0f, 0.0f, 0.0f);        
 
         // For the light
-        normalShader.use();
         glm::vec3 lightDir = getLightDir(theta, phi);
-        normalShader.setVec3("light.wDir", lightDir);
+        shared.light.wDir = lightDir;
 
-        // Save stuff
-        if (save) {
-            ourModel.save_to_txt = true;
-            ourModel.nSnapshots = nSnapshots;
+        // The intrinsics of this frame: snapshots get their own random ones, if the camera config asks for it
+        Intrinsics camera_sensor = conf::sensor_follows_window && windowWidth > 0 && windowHeight > 0 ? sensor.resized(windowWidth, windowHeight) : sensor;
+        Intrinsics intrinsics = (save && sampler.enabled()) ? sampler.sample(camera_sensor) : camera_sensor;
 
+        // Save stuff: the outputs are rendered by a worker if there are some, otherwise by this frame
+        if (save) {
+            if (workers)
             {
-                // Save light
-                std::string light_path{ conf::out_folder + std::to_string(nSnapshots) + "_" + "light_direction.txt" };
-                std::ofstream fout(light_path);
-                fout << std::setprecision(10);
-                std::vector<double> v = { lightDir.x, lightDir.y, lightDir.z };
-                std::copy(v.begin(), v.end(),
-                    std::ostream_iterator<double>(fout, "\n"));
-                std::cout << "Light direction successfully saved to " + light_path << std::endl;
-                fout.close();
+                FrameJob job;
+                job.index = nSnapshots;
+                job.intrinsics = intrinsics;
+                job.view = camera.GetViewMatrix();
+                job.camPos = camera.Position;
+                job.lightDir = lightDir;
+                job.lightColor = shared.light.color;
+                workers->submit<Policy>(*ourModel, job);
             }
-
+            else
             {
-                // Save camera
-                std::string camera_path{ conf::out_folder + std::to_string(nSnapshots) + "_" + "camera_pose.txt" };
-                std::ofstream fout(camera_path);
-                fout << std::setprecision(10);
-                glm::mat4 cp = camera.GetViewMatrix();
-                cp = glm::inverse(cp);  // C->W !
-                std::vector<double> v;
-                for (int i{ 0 }; i < 4; ++i) for (int j{ 0 }; j<4; ++j)    v.push_back(cp[j][i]);
-                std::copy(v.begin(), v.end(),
-                    std::ostream_iterator<double>(fout, "\n"));
-                std::cout << "Camera pose successfully saved to " + camera_path << std::endl;
-                fout.close(); 
+                renderer.save_to_txt = true;
+                renderer.nSnapshots = nSnapshots;
+                renderer.snapshot_view = camera.GetViewMatrix();
+                renderer.snapshot_light = lightDir;
             }
 
             save = false;
@@ -165,52 +297,46 @@ int main()
 
         // Matrices and other geometry
         //glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)conf::SCR_WIDTH / (float)conf::SCR_HEIGHT, conf::near, conf::far);
-        glm::mat4 projection = getProjectionMatrix(conf::l, conf::r, conf::b, conf::t, conf::near, conf::far);
-        if (conf::depth_mode == "reverse") {
-            glm::mat4 maybe_Id = glm::mat4(1.0f);
-            maybe_Id[2][2] = -0.5f;     
-            maybe_Id[3][2] = 0.5f;  // NB: 3rd column index, 2nd row index!
-            projection = maybe_Id * projection;
-        }
-        glm::mat4 view = camera.GetViewMatrix();
-        normalShader.setMat4("projection", projection);
-        normalShader.setMat4("view", view);
-        normalShader.setFloat("Near", conf::near);
-        normalShader.setFloat("Far", conf::far);
-        normalShader.setVec3("camPos", camera.Position);    // Camera positions for not just lambertian colors
+        shared.frame.projection = intrinsics.projection(Policy::reverse);
+        shared.frame.Near = intrinsics.near;
+        shared.frame.Far = intrinsics.far;
+        shared.frame.view = camera.GetViewMatrix();
+        shared.frame.camPos = camera.Position;    // Camera positions for not just lambertian colors
+        shared.upload();
 
         // Render the model
         glm::mat4 model = glm::mat4(1.0f);
         model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f)); // translate it down so it's at the center of the scene
         model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f));	// it's a bit too big for our scene, so scale it down
-        normalShader.setMat4("model", model);
-        ourModel.Draw(normalShader);
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+        standardShaders.forEach([&](Shader& shader) {
+            shader.use();
+            shader.setMat4("model", model);
+            shader.setMat3("normalMatrix", normalMatrix);
+        });
+        renderer.Draw<Policy>(*ourModel, standardShaders, intrinsics);
+        renderer.targetPool.nextFrame();    // frees the framebuffers no longer used (e.g. the old size after a resize)
 
         // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
         // -------------------------------------------------------------------------------
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
-
-    // glfw: terminate, clearing all previously allocated GLFW resources.
-    // ------------------------------------------------------------------
-    glfwTerminate();
-    return 0;
 }
 
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
 // ---------------------------------------------------------------------------------------------------------
-void processInput(GLFWwindow* window, Model & ourModel)
+void processInput(GLFWwindow* window)
 {
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
         glfwSetWindowShouldClose(window, true);
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS && !lock)
+    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS && !camera_lock)
         camera.ProcessKeyboard(FORWARD, deltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS && !lock)
+    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS && !camera_lock)
         camera.ProcessKeyboard(BACKWARD, deltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS && !lock)
+    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS && !camera_lock)
         camera.ProcessKeyboard(LEFT, deltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS && !lock)
+    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS && !camera_lock)
         camera.ProcessKeyboard(RIGHT, deltaTime);
     if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS)
         save = true;
@@ -223,7 +349,13 @@ void processInput(GLFWwindow* window, Model & ourModel)
     if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS)
         phi += v_deg;
     if (glfwGetKey(window, GLFW_KEY_U) == GLFW_PRESS)
-        lock = !lock;
+        camera_lock = !camera_lock;
+    // one swap per key press, not one per frame
+    static bool nWasPressed{ false };
+    bool nPressed = glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS;
+    if (nPressed && !nWasPressed)
+        nextModel = true;
+    nWasPressed = nPressed;
 
 }
 
@@ -255,6 +387,8 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
     // make sure the viewport matches the new window dimensions; note that width and 
     // height will be significantly larger than specified on retina displays.
     glViewport(0, 0, width, height);
+    windowWidth = width;
+    windowHeight = height;
 }
 
 // glfw: whenever the mouse moves, this callback is called
@@ -271,8 +405,8 @@ void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
         firstMouse = false;
     }
 
-    float xoffset = (lock ? 0.0f : xpos - lastX);
-    float yoffset = (lock ? 0.0f : lastY - ypos); // reversed since y-coordinates go from bottom to top
+    float xoffset = (camera_lock ? 0.0f : xpos - lastX);
+    float yoffset = (camera_lock ? 0.0f : lastY - ypos); // reversed since y-coordinates go from bottom to top
 
     lastX = xpos;
     lastY = ypos;
@@ -284,23 +418,5 @@ void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
 // ----------------------------------------------------------------------
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
-    if (!lock) camera.ProcessMouseScroll(static_cast<float>(yoffset));
+    if (!camera_lock) camera.ProcessMouseScroll(static_cast<float>(yoffset));
 }
-
-glm::mat4 getProjectionMatrix(float l, float r, float b, float t, float n, float f) {
-    // NB: l, b might as well be negative, n, f are positive!!
-
-    float matrix[16];
-    for (int i{ 0 }; i < 16; ++i) matrix[i] = 0.0f;
-
-    matrix[0] = 2 * n / (r - l);
-    matrix[5] = 2 * n / (t - b);
-    matrix[8] = (r + l) / (r - l);
-    matrix[9] = (t + b) / (t - b);
-    matrix[10] = -(f + n) / (f - n);
-    matrix[11] = -1;
-    matrix[14] = -(2 * f * n) / (f - n);
-
-    glm::mat4 res = glm::make_mat4(matrix);
-    return res;
-}
\ No newline at end of file
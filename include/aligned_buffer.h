@@ -0,0 +1,108 @@
+#ifndef ALIGNED_BUFFER_H
+#define ALIGNED_BUFFER_H
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Raw bytes on a page boundary, which suits vector loads and unbuffered file writes alike. Grows, never shrinks, and
+// does not keep its content when it grows: it is meant to be filled again and again.
+class AlignedBuffer {
+public:
+    static constexpr size_t ALIGNMENT{ 4096 };
+
+    AlignedBuffer() = default;
+    explicit AlignedBuffer(size_t bytes) { reserve(bytes); }
+    ~AlignedBuffer() { release(); }
+
+    AlignedBuffer(AlignedBuffer&& other) noexcept : bytes(other.bytes), capacity_(other.capacity_), size_(other.size_)
+    {
+        other.bytes = nullptr;
+        other.capacity_ = other.size_ = 0;
+    }
+    AlignedBuffer& operator=(AlignedBuffer&& other) noexcept
+    {
+        std::swap(bytes, other.bytes);
+        std::swap(capacity_, other.capacity_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    // at least that many bytes, rounded up to the alignment
+    void reserve(size_t count)
+    {
+        if (count <= capacity_) return;
+        release();
+        capacity_ = (count + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        bytes = static_cast<char*>(::operator new(capacity_, std::align_val_t(ALIGNMENT)));
+    }
+
+    char* data() { return bytes; }
+    const char* data() const { return bytes; }
+    size_t capacity() const { return capacity_; }
+
+    // the bytes in use, set by whoever fills the buffer
+    size_t size() const { return size_; }
+    void resize(size_t count) { size_ = count; }
+
+private:
+    char* bytes{ nullptr };
+    size_t capacity_{ 0 };
+    size_t size_{ 0 };
+
+    void release()
+    {
+        if (bytes) ::operator delete(bytes, std::align_val_t(ALIGNMENT));
+        bytes = nullptr;
+        capacity_ = size_ = 0;
+    }
+};
+
+// Buffers of one size, handed out and given back instead of allocated and freed: in steady state nothing is allocated.
+// Thread safe, so that a buffer can be filled by one thread and given back by another
+class BufferPool {
+public:
+    BufferPool(size_t bufferBytes, size_t count) : bufferBytes(bufferBytes)
+    {
+        free.reserve(count);
+        for (size_t i = 0; i < count; ++i) free.emplace_back(bufferBytes);
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // a free buffer, or a new one when they are all out
+    AlignedBuffer acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!free.empty())
+            {
+                AlignedBuffer buffer = std::move(free.back());
+                free.pop_back();
+                buffer.resize(0);
+                return buffer;
+            }
+        }
+        return AlignedBuffer(bufferBytes);
+    }
+
+    void release(AlignedBuffer&& buffer)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        free.push_back(std::move(buffer));
+    }
+
+    size_t bufferSize() const { return bufferBytes; }
+
+private:
+    size_t bufferBytes;
+    std::mutex mutex;
+    std::vector<AlignedBuffer> free;
+};
+
+#endif
@@ -0,0 +1,367 @@
+#ifndef ASSET_CACHE_H
+#define ASSET_CACHE_H
+
+#include <model_import.h>
+#include <procedural_scene.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#undef near     // windows.h defines these as empty macros, which would break conf::near and conf::far
+#undef far
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "conf.h"
+
+// A file mapped read-only in memory. The pages are shared by all the processes mapping the same file
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path)
+    {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) return;
+        bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (bytes) length = static_cast<size_t>(fileSize.QuadPart);
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) return;
+        void* address = mmap(NULL, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) return;
+        bytes = static_cast<const unsigned char*>(address);
+        length = static_cast<size_t>(info.st_size);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping != NULL) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (bytes) munmap(const_cast<unsigned char*>(bytes), length);
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return bytes; }    // null if the file could not be mapped
+    size_t size() const { return length; }
+
+private:
+    const unsigned char* bytes{ nullptr };
+    size_t length{ 0 };
+#ifdef _WIN32
+    HANDLE file{ INVALID_HANDLE_VALUE };
+    HANDLE mapping{ NULL };
+#else
+    int fd{ -1 };
+#endif
+};
+
+// Node-local cache of imported models: the ModelData of a model (optimized meshes and decoded images) is written once in a
+// cache file, which the other processes of the node map read-only instead of importing and decoding again. The images are
+// used straight from the mapping, so the decoded pixels exist once in RAM (in the page cache) whatever the number of workers.
+//
+// File layout (native endianness, the key includes the Vertex size so a different build never reads it):
+//   header:   char magic[8] "MDLCACHE", u32 version, u32 sizeof(Vertex), u64 data start
+//   metadata: string directory,
+//             u32 image count, per image: string path, i32 width, i32 height, i32 components, u64 offset, u64 size
+//             u32 mesh count, per mesh: u64 vertex count, u64 vertex offset, u64 index count, u64 index offset,
+//                                       u32 texture count, per texture: u32 image, string type
+//   data:     the vertex, index and pixel arrays, 16 byte aligned, at the offsets above (relative to the data start)
+// Strings are a u32 length followed by the characters. Files are written to a temporary name and renamed, so readers
+// never see half a file.
+class AssetCache {
+public:
+    static constexpr uint32_t VERSION{ 1 };
+
+    explicit AssetCache(const std::string& folder) : folder(folder) {}
+
+    // the model, from the cache if it is there, otherwise imported and then published in the cache
+    ModelData load(const std::string& path)
+    {
+        const std::string file = cachePath(path);
+        ModelData data;
+        if (!file.empty() && read(file, data)) return data;
+        data = ModelImporter().import(path);
+        if (data.valid && !file.empty()) write(file, data);
+        return data;
+    }
+
+private:
+    std::string folder;
+
+    static uint64_t hash(const void* data, size_t size, uint64_t h = 14695981039346656037ull)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i)
+        {
+            h ^= bytes[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // keyed by the path, the size and modification time of the model file, and the import settings. Empty if the model
+    // file does not exist
+    std::string cachePath(const std::string& path) const
+    {
+#ifdef _WIN32
+        struct _stat64 info;
+        if (_stat64(path.c_str(), &info) != 0) return "";
+#else
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) return "";
+#endif
+        uint64_t size = static_cast<uint64_t>(info.st_size), mtime = static_cast<uint64_t>(info.st_mtime);
+        uint32_t settings[3] = { VERSION, static_cast<uint32_t>(sizeof(Vertex)), conf::optimize_meshes ? 1u : 0u };
+        uint64_t h = hash(path.data(), path.size());
+        h = hash(&size, sizeof(size), h);
+        h = hash(&mtime, sizeof(mtime), h);
+        h = hash(settings, sizeof(settings), h);
+        std::stringstream name;
+        name << folder << "/" << std::hex << h << ".mdl";
+        return name.str();
+    }
+
+    static uint64_t align(uint64_t offset) { return (offset + 15) & ~uint64_t(15); }
+
+    // sequential reads from the mapping, with bounds checks
+    struct Reader {
+        const unsigned char* data;
+        size_t size;
+        size_t at{ 0 };
+        bool ok{ true };
+
+        template<typename T>
+        T get()
+        {
+            T value{};
+            if (at + sizeof(T) > size) { ok = false; return value; }
+            std::memcpy(&value, data + at, sizeof(T));
+            at += sizeof(T);
+            return value;
+        }
+        std::string getString()
+        {
+            uint32_t length = get<uint32_t>();
+            if (!ok || at + length > size) { ok = false; return ""; }
+            std::string value(reinterpret_cast<const char*>(data + at), length);
+            at += length;
+            return value;
+        }
+    };
+
+    // false if the file is not a cache file of this build, or if anything in it does not hold together: a count or an
+    // offset pointing out of the file, an image whose size does not match its dimensions, an index past the vertices
+    // of its mesh. The cache is shared between processes, so a file is never trusted further than that
+    bool read(const std::string& file, ModelData& data)
+    {
+        std::shared_ptr<MappedFile> mapped = std::make_shared<MappedFile>(file);
+        if (!mapped->data()) return false;
+        Reader in{ mapped->data(), mapped->size() };
+
+        char magic[8];
+        for (char& c : magic) c = in.get<char>();
+        uint32_t version = in.get<uint32_t>(), vertexSize = in.get<uint32_t>();
+        uint64_t dataStart = in.get<uint64_t>();
+        if (!in.ok || std::memcmp(magic, "MDLCACHE", 8) != 0 || version != VERSION || vertexSize != sizeof(Vertex) || dataStart > mapped->size())
+            return false;
+        const unsigned char* blobs = mapped->data() + dataStart;
+        const uint64_t blobsSize = mapped->size() - dataStart;
+        auto inBounds = [&](uint64_t offset, uint64_t size) { return offset <= blobsSize && size <= blobsSize - offset; };
+
+        data.path = "";
+        data.directory = in.getString();
+        uint32_t imageCount = in.get<uint32_t>();
+        for (uint32_t i = 0; i < imageCount && in.ok; ++i)
+        {
+            ImageData image;
+            image.path = in.getString();
+            image.width = in.get<int32_t>();
+            image.height = in.get<int32_t>();
+            image.components = in.get<int32_t>();
+            uint64_t offset = in.get<uint64_t>(), size = in.get<uint64_t>();
+            if (!inBounds(offset, size)) return false;
+            // size 0: the image could not be decoded. Otherwise the pixels must be exactly width * height * components
+            // bytes (the area is checked first, so that the product cannot overflow)
+            if (size > 0 && (image.width <= 0 || image.height <= 0 || image.components < 1 || image.components > 4
+                || static_cast<uint64_t>(image.width) * static_cast<uint64_t>(image.height) > size || imageBytes(image) != size))
+                return false;
+            // the pixels stay in the mapping (read-only: they are only read by the upload), nothing to free
+            if (size > 0) image.pixels = std::unique_ptr<unsigned char, void(*)(void*)>(const_cast<unsigned char*>(blobs + offset), [](void*) {});
+            data.images.push_back(std::move(image));
+        }
+        uint32_t meshCount = in.get<uint32_t>();
+        for (uint32_t m = 0; m < meshCount && in.ok; ++m)
+        {
+            MeshData mesh;
+            uint64_t vertexCount = in.get<uint64_t>(), vertexOffset = in.get<uint64_t>();
+            uint64_t indexCount = in.get<uint64_t>(), indexOffset = in.get<uint64_t>();
+            // the counts are checked against the file size before they are multiplied, so that the products cannot overflow
+            if (vertexCount > blobsSize / sizeof(Vertex) || indexCount > blobsSize / sizeof(unsigned int)) return false;
+            if (!inBounds(vertexOffset, vertexCount * sizeof(Vertex)) || !inBounds(indexOffset, indexCount * sizeof(unsigned int))) return false;
+            mesh.vertices.resize(static_cast<size_t>(vertexCount));
+            mesh.indices.resize(static_cast<size_t>(indexCount));
+            if (vertexCount > 0) std::memcpy(mesh.vertices.data(), blobs + vertexOffset, static_cast<size_t>(vertexCount * sizeof(Vertex)));
+            if (indexCount > 0) std::memcpy(mesh.indices.data(), blobs + indexOffset, static_cast<size_t>(indexCount * sizeof(unsigned int)));
+            for (unsigned int index : mesh.indices)
+                if (index >= vertexCount) return false;
+            uint32_t textureCount = in.get<uint32_t>();
+            for (uint32_t t = 0; t < textureCount && in.ok; ++t)
+            {
+                TextureRef ref;
+                ref.image = in.get<uint32_t>();
+                ref.type = in.getString();
+                if (ref.image >= data.images.size()) return false;
+                mesh.textures.push_back(ref);
+            }
+            data.meshes.push_back(std::move(mesh));
+        }
+        if (!in.ok) return false;
+        data.backing = mapped;
+        data.valid = true;
+        return true;
+    }
+
+    void write(const std::string& file, const ModelData& data) const
+    {
+        // layout of the data section
+        uint64_t end = 0;
+        auto place = [&](uint64_t size) { uint64_t offset = align(end); end = offset + size; return offset; };
+        std::vector<uint64_t> imageOffsets, vertexOffsets, indexOffsets;
+        for (const ImageData& image : data.images)
+            imageOffsets.push_back(place(image.pixels ? imageBytes(image) : 0));
+        for (const MeshData& mesh : data.meshes)
+        {
+            vertexOffsets.push_back(place(mesh.vertices.size() * sizeof(Vertex)));
+            indexOffsets.push_back(place(mesh.indices.size() * sizeof(unsigned int)));
+        }
+
+        // metadata
+        std::string meta;
+        auto put = [&meta](const void* value, size_t size) { meta.append(static_cast<const char*>(value), size); };
+        auto putU32 = [&put](uint32_t value) { put(&value, sizeof(value)); };
+        auto putU64 = [&put](uint64_t value) { put(&value, sizeof(value)); };
+        auto putString = [&](const std::string& value) { putU32(static_cast<uint32_t>(value.size())); put(value.data(), value.size()); };
+        putString(data.directory);
+        putU32(static_cast<uint32_t>(data.images.size()));
+        for (size_t i = 0; i < data.images.size(); ++i)
+        {
+            const ImageData& image = data.images[i];
+            putString(image.path);
+            int32_t size[3] = { image.width, image.height, image.components };
+            put(size, sizeof(size));
+            putU64(imageOffsets[i]);
+            putU64(image.pixels ? imageBytes(image) : 0);
+        }
+        putU32(static_cast<uint32_t>(data.meshes.size()));
+        for (size_t m = 0; m < data.meshes.size(); ++m)
+        {
+            const MeshData& mesh = data.meshes[m];
+            putU64(mesh.vertices.size());
+            putU64(vertexOffsets[m]);
+            putU64(mesh.indices.size());
+            putU64(indexOffsets[m]);
+            putU32(static_cast<uint32_t>(mesh.textures.size()));
+            for (const TextureRef& ref : mesh.textures)
+            {
+                putU32(ref.image);
+                putString(ref.type);
+            }
+        }
+        const uint64_t headerSize = 8 + 4 + 4 + 8;
+        const uint64_t dataStart = align(headerSize + meta.size());
+
+#ifdef _WIN32
+        _mkdir(folder.c_str());
+        const std::string tmp = file + "." + std::to_string(_getpid()) + ".tmp";
+#else
+        mkdir(folder.c_str(), 0755);
+        const std::string tmp = file + "." + std::to_string(getpid()) + ".tmp";
+#endif
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            uint32_t version = VERSION, vertexSize = sizeof(Vertex);
+            out.write("MDLCACHE", 8);
+            out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+            out.write(reinterpret_cast<const char*>(&vertexSize), sizeof(vertexSize));
+            out.write(reinterpret_cast<const char*>(&dataStart), sizeof(dataStart));
+            out.write(meta.data(), meta.size());
+
+            uint64_t written = 0;   // relative to dataStart
+            auto blob = [&](uint64_t offset, const void* bytes, uint64_t size) {
+                static const char zeros[16] = {};
+                out.write(zeros, static_cast<std::streamsize>(offset - written));
+                out.write(static_cast<const char*>(bytes), static_cast<std::streamsize>(size));
+                written = offset + size;
+            };
+            out.write(std::string(static_cast<size_t>(dataStart - headerSize - meta.size()), '\0').data(), static_cast<std::streamsize>(dataStart - headerSize - meta.size()));
+            for (size_t i = 0; i < data.images.size(); ++i)
+                if (data.images[i].pixels) blob(imageOffsets[i], data.images[i].pixels.get(), imageBytes(data.images[i]));
+            for (size_t m = 0; m < data.meshes.size(); ++m)
+            {
+                blob(vertexOffsets[m], data.meshes[m].vertices.data(), data.meshes[m].vertices.size() * sizeof(Vertex));
+                blob(indexOffsets[m], data.meshes[m].indices.data(), data.meshes[m].indices.size() * sizeof(unsigned int));
+            }
+            if (!out)
+            {
+                std::cout << "ERROR::ASSET_CACHE:: cannot write " << tmp << std::endl;
+                out.close();
+                std::remove(tmp.c_str());
+                return;
+            }
+        }
+        // another worker may have published it in the meantime: same content, keep theirs
+        if (std::rename(tmp.c_str(), file.c_str()) != 0) std::remove(tmp.c_str());
+    }
+
+    static uint64_t imageBytes(const ImageData& image)
+    {
+        return static_cast<uint64_t>(image.width) * image.height * image.components;
+    }
+};
+
+// the ModelData of a model: through the asset cache if conf::asset_cache_folder is set, imported from scratch otherwise.
+// Procedural scenes (see procedural_scene.h) are generated, never cached: that is quicker than reading them back
+inline ModelData loadModelData(const std::string& path)
+{
+    ScopedStage stage(Stage::Import);   // the reads of the cache too
+    if (isProceduralPath(path)) return generateProceduralScene(path);
+    if (conf::asset_cache_folder.empty()) return ModelImporter().import(path);
+    ModelData data = AssetCache(conf::asset_cache_folder).load(path);
+    data.path = path;
+    return data;
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef ASSET_STREAMER_H
+#define ASSET_STREAMER_H
+
+#include <model_import.h>
+#include <asset_cache.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "conf.h"
+
+// Imports models on worker threads while the current one renders.
+//
+// prefetch() queues a model; a worker runs the Assimp import, the mesh optimization and the image decoding (everything in
+// ModelImporter, which makes no GL call), or maps the result from the asset cache if another process did it already. take() hands the result over, waiting only if the import is not over yet, and
+// the caller uploads it with Model(ModelData&&) on the thread of the context.
+class AssetStreamer {
+public:
+    explicit AssetStreamer(unsigned int workers = conf::streaming_threads)
+    {
+        for (unsigned int i = 0; i < (workers > 0 ? workers : 1); ++i)
+            threads.emplace_back([this] { work(); });
+    }
+
+    ~AssetStreamer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            queue.clear();
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads) thread.join();
+    }
+
+    AssetStreamer(const AssetStreamer&) = delete;
+    AssetStreamer& operator=(const AssetStreamer&) = delete;
+
+    // starts importing a model in the background, unless it is already queued, being imported or imported
+    void prefetch(const std::string& path)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (requested(path)) return;
+            queue.push_back(path);
+        }
+        wake.notify_one();
+    }
+
+    // true if take(path) would not wait
+    bool ready(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return imported.count(path) != 0;
+    }
+
+    // the imported model, waiting for its import if needed (and importing it here if it was never prefetched)
+    ModelData take(const std::string& path)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!requested(path))
+        {
+            lock.unlock();
+            return loadModelData(path);
+        }
+        done.wait(lock, [&] { return imported.count(path) != 0; });
+        ModelData data = std::move(imported[path]);
+        imported.erase(path);
+        return data;
+    }
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;   // something in the queue, or stopping
+    std::condition_variable done;   // an import is over
+    std::deque<std::string> queue;
+    std::set<std::string> importing;
+    std::map<std::string, ModelData> imported;
+    bool stopping{ false };
+
+    bool requested(const std::string& path) const
+    {
+        return imported.count(path) != 0 || importing.count(path) != 0 || std::find(queue.begin(), queue.end(), path) != queue.end();
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) return;
+            std::string path = queue.front();
+            queue.pop_front();
+            importing.insert(path);
+
+            lock.unlock();
+            ModelData data = loadModelData(path);
+            lock.lock();
+
+            importing.erase(path);
+            imported[path] = std::move(data);
+            done.notify_all();
+        }
+    }
+};
+
+#endif
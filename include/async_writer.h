@@ -0,0 +1,563 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <aligned_buffer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include "conf.h"
+
+// Writes files from pooled buffers without waiting for the disk: write() queues a buffer and returns, the buffer goes
+// back to its pool once it is on its way. Used by a single thread (the encoder of FramePipeline), which is the one the
+// queue pushes back on when it is full. Files are written front to back, one buffer after the other.
+class FileWriter {
+public:
+    struct Stats {
+        unsigned long long bytes{ 0 };  // written, padding excluded
+        unsigned long long files{ 0 };
+        size_t inFlight{ 0 };           // queue depth right now
+        size_t maxInFlight{ 0 };
+        size_t depth{ 0 };              // the most the queue takes
+        double seconds{ 0.0 };          // from the first write to the last completion
+
+        double bandwidth() const { return seconds > 0.0 ? bytes / seconds : 0.0; }  // bytes per second
+    };
+
+    virtual ~FileWriter() = default;
+
+    // a new (truncated) file, label is for the log (empty: not logged). Returns -1 if the file cannot be created
+    virtual int open(const std::string& path, const char* label) = 0;
+    // appends buffer.size() bytes. All the buffers of a file but the last must be full (see AlignedBuffer) for direct I/O
+    virtual void write(int file, AlignedBuffer&& buffer) = 0;
+    // no more writes to the file: it is closed once they are done
+    virtual void close(int file) = 0;
+    // makes progress without blocking, for when there is nothing to write
+    virtual void poll() = 0;
+    // true while poll() has something to make progress on: the caller may sleep without polling otherwise
+    virtual bool needsPolling() const { return false; }
+    // waits until everything is on disk (synced, if syncing is on)
+    virtual void flush() = 0;
+    virtual const char* name() const = 0;
+
+    Stats stats() const { return counters; }
+
+    void report() const
+    {
+        if (counters.files == 0) return;
+        std::cout << "Writer (" << name() << "): " << counters.files << " files, " << counters.bytes / (1024.0 * 1024.0) << " MB in "
+            << counters.seconds << " s, " << counters.bandwidth() / (1024.0 * 1024.0) << " MB/s, queue depth up to "
+            << counters.maxInFlight << "/" << counters.depth << "\n";
+    }
+
+protected:
+    Stats counters;
+    std::chrono::steady_clock::time_point first;
+
+    void started(size_t inFlight)
+    {
+        if (counters.bytes == 0 && counters.inFlight == 0) first = std::chrono::steady_clock::now();
+        counters.inFlight = inFlight;
+        counters.maxInFlight = std::max(counters.maxInFlight, inFlight);
+    }
+    void completed(size_t inFlight, unsigned long long bytes)
+    {
+        counters.inFlight = inFlight;
+        counters.bytes += bytes;
+        counters.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - first).count();
+    }
+};
+
+// Portable backend: one thread writing the queued buffers with unbuffered ofstreams (text mode, so the files are the same
+// as those written directly). Syncing is left to the OS
+class ThreadedWriter : public FileWriter {
+public:
+    ThreadedWriter(BufferPool& pool, unsigned int depth = conf::writer_queue_depth) : pool(pool), depth(depth > 0 ? depth : 1)
+    {
+        counters.depth = this->depth;
+        thread = std::thread([this] { work(); });
+    }
+
+    ~ThreadedWriter() override
+    {
+        flush();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        thread.join();
+    }
+
+    int open(const std::string& path, const char* label) override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        int file = 0;
+        while (file < static_cast<int>(files.size()) && files[file]->used) ++file;
+        if (file == static_cast<int>(files.size())) files.push_back(std::make_unique<File>());
+        File& f = *files[file];
+        f.used = true;
+        f.path = path;
+        f.label = label;
+        push(lock, { Job::Open, file, AlignedBuffer() });
+        return file;
+    }
+
+    void write(int file, AlignedBuffer&& buffer) override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        push(lock, { Job::Write, file, std::move(buffer) });
+    }
+
+    void close(int file) override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        push(lock, { Job::Close, file, AlignedBuffer() });
+    }
+
+    void poll() override {}
+
+    void flush() override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return jobs.empty() && !busy; });
+    }
+
+    const char* name() const override { return "thread"; }
+
+private:
+    struct Job {
+        enum Type { Open, Write, Close } type;
+        int file;
+        AlignedBuffer buffer;
+    };
+    struct File {
+        bool used{ false };
+        std::string path;
+        const char* label{ "" };
+        std::ofstream out;
+    };
+
+    BufferPool& pool;
+    size_t depth;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;   // a job, or stopping
+    std::condition_variable done;   // a job is over
+    std::deque<Job> jobs;
+    std::vector<std::unique_ptr<File>> files;
+    bool busy{ false };
+    bool stopping{ false };
+
+    // waits while the queue is full: the backpressure on the encoder
+    void push(std::unique_lock<std::mutex>& lock, Job&& job)
+    {
+        done.wait(lock, [this] { return jobs.size() < depth; });
+        jobs.push_back(std::move(job));
+        started(jobs.size());
+        wake.notify_one();
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;   // stopping
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            File& f = *files[job.file];
+            lock.unlock();
+
+            size_t bytes = 0;
+            switch (job.type)
+            {
+            case Job::Open:
+                f.out.rdbuf()->pubsetbuf(nullptr, 0);
+                f.out.open(f.path);
+                if (!f.out) std::cout << "ERROR::ASYNC_WRITER:: cannot write " << f.path << "\n";
+                break;
+            case Job::Write:
+                bytes = job.buffer.size();
+                if (f.out) f.out.write(job.buffer.data(), bytes);
+                pool.release(std::move(job.buffer));
+                break;
+            case Job::Close:
+                f.out.close();
+                if (f.out) { if (*f.label) std::cout << f.label << " successfully saved to " << f.path << "\n"; }
+                else std::cout << "ERROR::ASYNC_WRITER:: cannot write " << f.path << "\n";
+                f.out.clear();
+                break;
+            }
+
+            lock.lock();
+            if (job.type == Job::Close) { f.used = false; ++counters.files; }
+            completed(jobs.size(), bytes);
+            busy = false;
+            done.notify_all();
+        }
+    }
+};
+
+#ifdef __linux__
+// Linux backend: io_uring, through the raw system calls (no liburing). Up to depth writes are in flight at once, each one
+// a whole buffer at its offset in its file, so a single thread keeps a fast drive busy. With direct I/O (O_DIRECT) the
+// page cache is bypassed: the buffers are page aligned and full, the last one of a file is padded and the file truncated
+// to its size afterwards. Closed files are synced in batches of fsyncBatch (0: not synced), one IORING_OP_FSYNC each,
+// submitted together.
+class UringWriter : public FileWriter {
+public:
+    // nullptr if the kernel has no io_uring (or it is not allowed)
+    static std::unique_ptr<UringWriter> create(BufferPool& pool, unsigned int depth = conf::writer_queue_depth, bool direct = conf::writer_direct_io, unsigned int fsyncBatch = conf::writer_fsync_batch)
+    {
+        std::unique_ptr<UringWriter> writer(new UringWriter(pool, depth > 0 ? depth : 1, direct, fsyncBatch));
+        if (writer->ring < 0) return nullptr;
+        return writer;
+    }
+
+    ~UringWriter() override
+    {
+        if (ring < 0) return;
+        flush();
+        munmap(sqes, sqesBytes);
+        if (cqRing != sqRing) munmap(cqRing, cqRingBytes);
+        munmap(sqRing, sqRingBytes);
+        ::close(ring);
+    }
+
+    int open(const std::string& path, const char* label) override
+    {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+        bool isDirect = direct;
+        if (fd < 0 && direct && errno == EINVAL)   // the file system does not do direct I/O (tmpfs, ...)
+        {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            isDirect = false;
+        }
+        if (fd < 0)
+        {
+            std::cout << "ERROR::ASYNC_WRITER:: cannot write " << path << ": " << std::strerror(errno) << "\n";
+            return -1;
+        }
+        int file = 0;
+        while (file < static_cast<int>(files.size()) && files[file].fd >= 0) ++file;
+        if (file == static_cast<int>(files.size())) files.emplace_back();
+        File& f = files[file];
+        f.fd = fd;
+        f.path = path;
+        f.label = label;
+        f.offset = f.size = 0;
+        f.pending = 0;
+        f.closing = false;
+        f.direct = isDirect;
+        return file;
+    }
+
+    void write(int file, AlignedBuffer&& buffer) override
+    {
+        if (file < 0) { pool.release(std::move(buffer)); return; }
+        File& f = files[file];
+        size_t bytes = buffer.size();
+        size_t length = bytes;
+        if (f.direct && length % AlignedBuffer::ALIGNMENT != 0)
+        {
+            // the last buffer: pad it to a whole block, the file is truncated back when it is closed
+            length = (length + AlignedBuffer::ALIGNMENT - 1) / AlignedBuffer::ALIGNMENT * AlignedBuffer::ALIGNMENT;
+            std::memset(buffer.data() + bytes, 0, length - bytes);
+        }
+
+        unsigned int r = request();
+        Request& req = requests[r];
+        req.file = file;
+        req.fsync = false;
+        req.bytes = bytes;
+        req.length = length;
+        req.buffer = std::move(buffer);
+        req.iov.iov_base = req.buffer.data();
+        req.iov.iov_len = length;
+
+        io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = f.fd;
+        sqe.addr = reinterpret_cast<unsigned long long>(&req.iov);
+        sqe.len = 1;
+        sqe.off = f.offset;
+        sqe.user_data = r;
+        f.offset += length;
+        f.size += bytes;
+        ++f.pending;
+        submit(sqe);
+    }
+
+    void close(int file) override
+    {
+        if (file < 0) return;
+        files[file].closing = true;
+        if (files[file].pending == 0) finish(file);
+        pump();
+    }
+
+    void poll() override
+    {
+        reap();
+        pump();
+    }
+
+    bool needsPolling() const override { return inFlight > 0 || !syncQueue.empty(); }
+
+    void flush() override
+    {
+        // the batch is not full, but everything must be on disk now
+        syncQueue.insert(syncQueue.end(), toSync.begin(), toSync.end());
+        toSync.clear();
+        while (true)
+        {
+            reap();
+            pump();
+            bool closing = false;
+            for (const File& f : files) if (f.fd >= 0 && f.closing) closing = true;
+            if (!closing && syncQueue.empty() && inFlight == 0) return;
+            if (inFlight > 0) enter(0, 1, IORING_ENTER_GETEVENTS);
+            if (!toSync.empty()) { syncQueue.insert(syncQueue.end(), toSync.begin(), toSync.end()); toSync.clear(); }
+        }
+    }
+
+    const char* name() const override { return direct ? "io_uring, direct" : "io_uring"; }
+
+private:
+    struct Request {
+        int file{ -1 };
+        bool fsync{ false };
+        size_t bytes{ 0 };      // of data
+        size_t length{ 0 };     // written, with the padding
+        AlignedBuffer buffer;
+        iovec iov{};
+    };
+    struct File {
+        int fd{ -1 };
+        std::string path;
+        const char* label{ "" };
+        unsigned long long offset{ 0 };     // where the next write goes
+        unsigned long long size{ 0 };       // without the padding
+        unsigned int pending{ 0 };          // writes in flight
+        bool closing{ false };
+        bool direct{ false };
+    };
+
+    BufferPool& pool;
+    bool direct;
+    unsigned int fsyncBatch;
+    std::vector<Request> requests;
+    std::vector<unsigned int> freeRequests;
+    std::vector<File> files;
+    std::vector<int> toSync;        // closed files, waiting for their batch to fill
+    std::deque<int> syncQueue;      // files whose fsync waits for a free request
+    size_t inFlight{ 0 };
+
+    int ring{ -1 };
+    void* sqRing{ nullptr };
+    void* cqRing{ nullptr };
+    size_t sqRingBytes{ 0 }, cqRingBytes{ 0 }, sqesBytes{ 0 };
+    unsigned int* sqTail{ nullptr };
+    unsigned int* sqMask{ nullptr };
+    unsigned int* sqArray{ nullptr };
+    io_uring_sqe* sqes{ nullptr };
+    unsigned int* cqHead{ nullptr };
+    unsigned int* cqTail{ nullptr };
+    unsigned int* cqMask{ nullptr };
+    io_uring_cqe* cqes{ nullptr };
+
+    UringWriter(BufferPool& pool, unsigned int depth, bool direct, unsigned int fsyncBatch)
+        : pool(pool), direct(direct), fsyncBatch(fsyncBatch), requests(depth)
+    {
+        counters.depth = depth;
+        for (unsigned int i = depth; i > 0; --i) freeRequests.push_back(i - 1);
+
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+        if (fd < 0) return;
+
+        // the submission and completion rings, and the submission entries, are shared with the kernel
+        sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+        sqRing = mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) { ::close(fd); return; }
+        cqRing = sqRing;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+        {
+            cqRing = mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) { munmap(sqRing, sqRingBytes); ::close(fd); return; }
+        }
+        sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+        {
+            if (cqRing != sqRing) munmap(cqRing, cqRingBytes);
+            munmap(sqRing, sqRingBytes);
+            ::close(fd);
+            return;
+        }
+
+        char* sq = static_cast<char*>(sqRing);
+        sqTail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        ring = fd;
+    }
+
+    int enter(unsigned int submitted, unsigned int waitFor, unsigned int flags)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ring, submitted, waitFor, flags, nullptr, 0));
+    }
+
+    // a free request, waiting for a completion if they are all in flight
+    unsigned int request()
+    {
+        while (freeRequests.empty())
+        {
+            enter(0, 1, IORING_ENTER_GETEVENTS);
+            reap();
+        }
+        unsigned int r = freeRequests.back();
+        freeRequests.pop_back();
+        return r;
+    }
+
+    void submit(const io_uring_sqe& sqe)
+    {
+        unsigned int tail = *sqTail;    // only this thread writes it
+        unsigned int index = tail & *sqMask;
+        sqes[index] = sqe;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++inFlight;
+        started(inFlight);
+        if (enter(1, 0, 0) < 0) std::cout << "ERROR::ASYNC_WRITER:: io_uring_enter: " << std::strerror(errno) << "\n";
+    }
+
+    // handles the completions which are there, without waiting
+    void reap()
+    {
+        unsigned int head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe& cqe = cqes[head & *cqMask];
+            unsigned int r = static_cast<unsigned int>(cqe.user_data);
+            int result = cqe.res;
+            ++head;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+            Request& req = requests[r];
+            int file = req.file;
+            File& f = files[file];
+            --inFlight;
+            if (result < 0) std::cout << "ERROR::ASYNC_WRITER:: " << (req.fsync ? "fsync " : "write ") << f.path << ": " << std::strerror(-result) << "\n";
+            else if (!req.fsync && static_cast<size_t>(result) != req.length) std::cout << "ERROR::ASYNC_WRITER:: short write to " << f.path << "\n";
+            completed(inFlight, req.fsync || result < 0 ? 0 : req.bytes);
+
+            bool fsync = req.fsync;
+            if (!fsync) pool.release(std::move(req.buffer));
+            freeRequests.push_back(r);
+
+            if (fsync) release(file);
+            else if (--f.pending == 0 && f.closing) finish(file);
+        }
+    }
+
+    // the writes of a closing file are done: fix its size, then sync it with its batch or let it go
+    void finish(int file)
+    {
+        File& f = files[file];
+        if (f.direct && f.size != f.offset && ftruncate(f.fd, static_cast<off_t>(f.size)) != 0)
+            std::cout << "ERROR::ASYNC_WRITER:: cannot truncate " << f.path << "\n";
+        f.closing = false;
+        if (fsyncBatch == 0) { release(file); return; }
+        f.closing = true;   // until synced
+        toSync.push_back(file);
+        if (toSync.size() >= fsyncBatch)
+        {
+            syncQueue.insert(syncQueue.end(), toSync.begin(), toSync.end());
+            toSync.clear();
+        }
+    }
+
+    // submits the fsyncs there are requests for
+    void pump()
+    {
+        while (!syncQueue.empty() && !freeRequests.empty())
+        {
+            int file = syncQueue.front();
+            syncQueue.pop_front();
+            unsigned int r = freeRequests.back();
+            freeRequests.pop_back();
+            Request& req = requests[r];
+            req.file = file;
+            req.fsync = true;
+            req.bytes = req.length = 0;
+
+            io_uring_sqe sqe;
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_FSYNC;
+            sqe.fd = files[file].fd;
+            sqe.user_data = r;
+            submit(sqe);
+        }
+    }
+
+    void release(int file)
+    {
+        File& f = files[file];
+        ::close(f.fd);
+        f.fd = -1;
+        f.closing = false;
+        ++counters.files;
+        if (*f.label) std::cout << f.label << " successfully saved to " << f.path << "\n";
+    }
+};
+#endif
+
+// The io_uring backend where there is one, the thread otherwise
+inline std::unique_ptr<FileWriter> makeFileWriter(BufferPool& pool)
+{
+#ifdef __linux__
+    if (conf::writer_io_uring)
+    {
+        std::unique_ptr<UringWriter> writer = UringWriter::create(pool);
+        if (writer) return writer;
+        std::cout << "io_uring not available, writing from a thread instead\n";
+    }
+#endif
+    return std::make_unique<ThreadedWriter>(pool);
+}
+
+#endif
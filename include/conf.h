@@ -2,6 +2,7 @@
 #define CONF
 
 # include <string>
+# include <vector>
 
 // Some constants: screen size, near and far plane
 namespace conf {
@@ -21,9 +22,34 @@ namespace conf {
 	constexpr float t{ focal / fy * (SCR_HEIGHT - cy) };
 	constexpr float b{ - focal / fy * cy };
 
+	// Camera config file (see loadCameraConfig in intrinsics.h) overriding the sensor above at runtime, and possibly
+	// randomizing the intrinsics of every snapshot. Empty to use the constants above
+	const std::string camera_config = "";
+
 	// Rendering configurations
-	const std::string render_type = "color";	// normals, HDR, depth_map, otherwise it's the normal thing
+	constexpr bool sensor_follows_window{ false };	// render at the window size (intrinsics rescaled), instead of the sensor size
+	const std::string render_type = "color";	// normals, HDR, depth_map, none (no preview), otherwise it's the normal thing
 	const std::string depth_mode = "standard";
+	const std::string outputs = "depth_map HDR normals";	// what is saved on snapshots, any of depth_map, HDR, normals
+	constexpr bool gbuffer_pass{ true };	// render HDR color and normals in a single pass with two render targets
+
+	// Framebuffers (see RenderTargetPool): resolutions unused for this many frames are freed, and the least recently used
+	// are freed while the pool is above the budget
+	constexpr unsigned int render_target_idle_frames{ 60 };
+	constexpr unsigned int render_target_budget_mb{ 512 };
+	constexpr unsigned int frames_in_flight{ 3 };	// snapshots between their render and the end of their writing, see FramePipeline
+	constexpr bool writer_io_uring{ true };	// on Linux, write the snapshot files through io_uring (see UringWriter), otherwise from a thread
+	constexpr bool writer_direct_io{ false };	// io_uring only: bypass the page cache (O_DIRECT)
+	constexpr unsigned int writer_queue_depth{ 8 };	// writes in flight at once, each a 1 MB chunk
+	constexpr unsigned int writer_fsync_batch{ 16 };	// io_uring only: closed files are synced this many at a time, 0 never
+	const std::string frame_ring = "";	// name of a shared memory ring to stream the snapshots to a consumer process (see FrameRingProducer) instead of files, empty for files
+	constexpr unsigned int frame_ring_slots{ 4 };	// frames the consumer can be behind before the generator waits for it
+	constexpr unsigned int render_workers{ 0 };	// threads rendering the snapshots, each with its own context (see RenderWorkerPool), 0 to render them in the frame loop
+
+	// Mesh import configuration
+	constexpr bool optimize_meshes{ true };	// weld vertices and reorder triangles/vertices after import, see mesh_optimizer.h
+	constexpr bool batch_meshes{ true };	// pack all the meshes of a model in shared buffers, drawn with glMultiDrawElementsIndirect, see mesh_batch.h
+	constexpr bool keep_cpu_geometry{ false };	// keep the vertices and indices in RAM after the upload (for CPU-side consumers, e.g. ray casting)
 
 	// Shadow configuration
 	//constexpr bool shadows{ false };
@@ -31,6 +57,36 @@ namespace conf {
 	//constexpr float light_nearPlane{ .1f };	// to render shadows from the perspective of light, we need a newar and far plane. This is the near. 
 	//constexpr float light_farPlane{light_nearPlane + 2 * scene_size};	//The far is near + 2 scene_size
 
+	// Models of the run, in order: the first is loaded at startup, N swaps to the next one
+	const std::vector<std::string> models = { "C:/Code/University/TUM/learnOpenGL/data/models/backpack/backpack.obj" };
+	constexpr unsigned int streaming_threads{ 1 };	// threads importing the next models while the current one renders, see AssetStreamer
+
+	// Cache of linked shader programs (see Shader::setBinaryCache), empty to always compile from sources
+	const std::string shader_cache_folder = "../data/shader_cache";
+
+	// Imported models shared by the processes of the node (see AssetCache), empty to always import from the model files
+	const std::string asset_cache_folder = "../data/asset_cache";
+
+	// Batch job (see JobSpec): the spec to render, without the interactive window, empty for the window. A run renders the
+	// frames [job_first, job_first + job_count) of the job, job_count 0 for all the frames from job_first
+	const std::string job_spec = "";
+	constexpr unsigned long long job_first{ 0 };
+	constexpr unsigned long long job_count{ 0 };
+	const std::string work_queue = "depth_map_work_queue";	// shared memory of the workers of a node (--worker k/N), see WorkQueue
+	constexpr unsigned int work_queue_wait_s{ 60 };	// how long the workers wait for worker 0 to create the queue
+
+	// Local render service (see RenderService, POSIX only): the socket to listen on instead of opening the interactive window, empty for the window
+	const std::string service_socket = "";
+	constexpr long long service_batch_window_us{ 2000 };	// requests arriving within this of the first one are rendered as one batch
+	constexpr unsigned int service_batch_max{ 64 };	// at most this many per batch
+	constexpr unsigned int service_models{ 4 };	// models kept loaded between the requests
+
+	// Benchmark (see benchmark/benchmark.cpp): the frames each scenario times, after the warm-up ones, and where their
+	// snapshots go (they are rewritten by every scenario)
+	constexpr unsigned int benchmark_frames{ 32 };
+	constexpr unsigned int benchmark_warmup_frames{ 4 };
+	const std::string benchmark_out_folder = "../data/benchmark/";
+
 	// Output folder
 	const std::string out_folder = "C:/Code/University/TUM/learnOpenGL/data/models/backpack/synthetic/run_0/";
 	
@@ -0,0 +1,60 @@
+#ifndef COUNTER_RNG_H
+#define COUNTER_RNG_H
+
+#include <cstdint>
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3", SC 2011): the random numbers are a
+// function of a key and a counter, with no state carried from one to the next. A stream is (seed, stream), e.g. (job
+// seed, frame index): the draws of a frame are the same whichever process renders it, in whatever order, and computing
+// them needs nothing from the frames before.
+class CounterRng {
+public:
+    CounterRng(uint64_t seed, uint64_t stream)
+        : key{ static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32) }, stream{ static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32) } {}
+
+    // the four words of block n of the stream
+    void block(uint64_t n, uint32_t out[4]) const
+    {
+        uint32_t c[4] = { static_cast<uint32_t>(n), static_cast<uint32_t>(n >> 32), stream[0], stream[1] };
+        uint32_t k[2] = { key[0], key[1] };
+        for (int round = 0; round < 10; ++round)
+        {
+            uint64_t p0 = static_cast<uint64_t>(M0) * c[0], p1 = static_cast<uint64_t>(M1) * c[2];
+            uint32_t next[4] = {
+                static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0], static_cast<uint32_t>(p1),
+                static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1], static_cast<uint32_t>(p0)
+            };
+            for (int i = 0; i < 4; ++i) c[i] = next[i];
+            k[0] += W0;
+            k[1] += W1;
+        }
+        for (int i = 0; i < 4; ++i) out[i] = c[i];
+    }
+
+    // the next word of the stream
+    uint32_t next()
+    {
+        if (used == 4)
+        {
+            block(blocks++, buffer);
+            used = 0;
+        }
+        return buffer[used++];
+    }
+
+    // uniform in [0, 1), 24 bits
+    float uniform() { return static_cast<float>(next() >> 8) * (1.0f / 16777216.0f); }
+    float uniform(float a, float b) { return a + (b - a) * uniform(); }
+
+private:
+    static constexpr uint32_t M0{ 0xD2511F53 }, M1{ 0xCD9E8D57 };   // multipliers
+    static constexpr uint32_t W0{ 0x9E3779B9 }, W1{ 0xBB67AE85 };   // Weyl sequence of the key
+
+    uint32_t key[2];
+    uint32_t stream[2];
+    uint64_t blocks{ 0 };
+    uint32_t buffer[4]{ 0, 0, 0, 0 };
+    int used{ 4 };
+};
+
+#endif
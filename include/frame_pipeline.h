@@ -0,0 +1,444 @@
+#ifndef FRAME_PIPELINE_H
+#define FRAME_PIPELINE_H
+
+#include <glad/glad.h>
+
+#include <spsc_queue.h>
+#include <aligned_buffer.h>
+#include <async_writer.h>
+#include <frame_ring.h>
+#include <stage_timers.h>
+
+#include <atomic>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "conf.h"
+
+// The snapshot outputs, from the framebuffers to the files, without stalling the frames which render in the meantime.
+//
+// Three stages, each at its own pace:
+//  - render (the GL thread, in Renderer::Draw): capture() queues the copies of the textures into pixel buffer objects,
+//    and a fence behind them. Nothing waits for the GPU here;
+//  - readback (the GL thread again, poll() at every frame): the buffers whose fence has passed are mapped and handed to
+//    the encoder, the ones it is done with are unmapped;
+//  - encode (its own thread): formats the mapped data into chunks, which a FileWriter writes to the files in the
+//    background (io_uring on Linux, see async_writer.h), the metadata of the snapshot (see writeMetadata) included. Or,
+//    with conf::frame_ring, publishes the frame to a consumer process through shared memory (see FrameRingProducer), and
+//    nothing touches the disk.
+// At most conf::frames_in_flight snapshots are between capture and the end of their encoding. When they all are,
+// capture() waits for the oldest one: that is the backpressure which keeps a slow disk from piling up GPU memory.
+// The stages hand the slots over through lock-free single producer/single consumer queues. A stage with nothing to do
+// sleeps on a condition variable, which the other one notifies after each push (see notify).
+//
+// Nothing is allocated per snapshot once the slots have seen the largest one: the pixel buffers, the paths and the text
+// chunks of the encoder are all reused (the chunks come back from the writer), and the encoder formats the mapped floats
+// in place (std::to_chars).
+class FramePipeline {
+public:
+    explicit FramePipeline(unsigned int framesInFlight = conf::frames_in_flight)
+        : slots(framesInFlight > 0 ? framesInFlight : 1), toEncode(slots.size()), encoded(slots.size()), chunks(CHUNK_BYTES, conf::frame_ring.empty() ? conf::writer_queue_depth + 1 : 0)
+    {
+        // the frames go either to the ring or to the files, never both: no writer (nor its chunks) with a ring
+        if (!conf::frame_ring.empty()) ring = &FrameRingProducer::shared();
+        else writer = makeFileWriter(chunks);
+        encoder = std::thread([this] { encode(); });
+    }
+
+    // writes what is in flight, then stops the encoder. The context must still be current
+    ~FramePipeline()
+    {
+        flush();
+        notify(encoderWake, [this] { stopping = true; });
+        encoder.join();
+        if (writer) writer->report();
+        for (Slot& slot : slots)
+            for (Readback& read : slot.reads)
+                if (read.PBO) glDeleteBuffers(1, &read.PBO);
+    }
+
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+
+    // one texture to save
+    struct Output {
+        unsigned int output;    // OUTPUT_DEPTH, OUTPUT_HDR, OUTPUT_NORMALS
+        GLuint texture;
+        GLenum format;          // GL_DEPTH_COMPONENT, GL_RGB, GL_RGBA
+        unsigned int channels;
+        const char* name;       // the file is prefix + name
+        const char* what;       // for the log
+    };
+
+    // queues the readback of the outputs of a snapshot (all of the same size), waiting only if all the slots are in flight
+    void capture(unsigned int width, unsigned int height, const std::string& prefix, const FrameMetadata& metadata, const Output* outputs, size_t count)
+    {
+        Slot& slot = acquire();
+        slot.metadata = metadata;
+        slot.prefix.assign(prefix);     // keeps its capacity
+        slot.width = width;
+        slot.height = height;
+        slot.reads.resize(count);   // the slots keep their buffers from one snapshot to the next
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        readbackTimer.begin(Stage::Readback);
+        for (size_t i = 0; i < count; ++i)
+        {
+            Readback& read = slot.reads[i];
+            read.output = outputs[i];
+            read.path.assign(prefix);   // keeps its capacity
+            read.path.append(outputs[i].name);
+            read.values = static_cast<size_t>(width) * height * outputs[i].channels;
+            GLsizeiptr bytes = static_cast<GLsizeiptr>(read.values * sizeof(GLfloat));
+            if (read.PBO == 0) glGenBuffers(1, &read.PBO);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, read.PBO);
+            if (read.capacity < bytes)
+            {
+                glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+                read.capacity = bytes;
+            }
+            glBindTexture(GL_TEXTURE_2D, outputs[i].texture);
+            glGetTexImage(GL_TEXTURE_2D, 0, outputs[i].format, GL_FLOAT, (void*)0);    // into the buffer: returns at once
+        }
+        readbackTimer.end();
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.sequence = nextSequence++;
+        slot.state = SlotState::Reading;
+    }
+
+    // the readback stage: to call once per frame on the GL thread
+    void poll()
+    {
+        readbackTimer.collect(false);
+
+        // the encoder is done with these: unmap them and reuse them
+        size_t index;
+        while (encoded.pop(index))
+        {
+            Slot& slot = slots[index];
+            for (Readback& read : slot.reads)
+            {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, read.PBO);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                read.data = nullptr;
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            slot.state = SlotState::Free;
+        }
+
+        // the finished readbacks go to the encoder, in the order of the snapshots
+        while (true)
+        {
+            Slot* oldest = oldestReading();
+            if (oldest == nullptr || glClientWaitSync(oldest->fence, 0, 0) == GL_TIMEOUT_EXPIRED) break;
+            map(*oldest);
+        }
+    }
+
+    // waits until every captured snapshot is written
+    void flush()
+    {
+        while (inFlight() > 0)
+        {
+            poll();
+            wait();
+        }
+        // the encoder is done, the writer may not be: it belongs to the encoder thread, which flushes it
+        notify(encoderWake, [this] { flushing = true; });
+        {
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            rendererWake.wait(lock, [this] { return !flushing; });
+        }
+        readbackTimer.collect(true);
+    }
+
+    // what the writer did, as of the last flush
+    FileWriter::Stats writerStats() const { return flushedStats; }
+    const char* writerName() const { return writer ? writer->name() : "frame ring"; }
+
+    size_t inFlight() const
+    {
+        size_t n = 0;
+        for (const Slot& slot : slots) if (slot.state != SlotState::Free) ++n;
+        return n;
+    }
+
+private:
+    enum class SlotState { Free, Reading, Encoding };
+
+    struct Readback {
+        Output output{ 0, 0, GL_NONE, 0, "", "" };
+        std::string path;
+        GLuint PBO{ 0 };
+        GLsizeiptr capacity{ 0 };
+        size_t values{ 0 };
+        const GLfloat* data{ nullptr };     // mapped while encoding
+    };
+
+    struct Slot {
+        SlotState state{ SlotState::Free };
+        GLsync fence{ nullptr };
+        unsigned long long sequence{ 0 };
+        std::vector<Readback> reads;
+        FrameMetadata metadata;
+        std::string prefix;     // of the files of the snapshot
+        unsigned int width{ 0 }, height{ 0 };
+    };
+
+    std::vector<Slot> slots;
+    SpscQueue<size_t> toEncode;     // GL thread -> encoder: mapped slots
+    SpscQueue<size_t> encoded;      // encoder -> GL thread: slots to unmap
+    std::thread encoder;
+    BufferPool chunks;      // the encoder's text, on its way to the files
+    std::unique_ptr<FileWriter> writer;     // used by the encoder thread only, null with a ring
+    FrameRingProducer* ring{ nullptr };     // instead of the files
+    static constexpr size_t CHUNK_BYTES{ 1 << 20 };     // a multiple of the page size, for direct I/O
+    static constexpr size_t MAX_VALUE_CHARS{ 32 };     // "-1.234567891e-308\n" and then some
+    std::atomic<bool> stopping{ false };
+    std::atomic<bool> flushing{ false };    // set by flush(), cleared by the encoder once the writer is flushed
+    FileWriter::Stats flushedStats;     // written by the encoder before it clears flushing
+    std::mutex wakeMutex;   // only guards the waits, the queues and flags above need no lock
+    std::condition_variable encoderWake;    // a slot to encode, flushing or stopping
+    std::condition_variable rendererWake;   // a slot encoded, or the writer flushed
+    GpuStageTimer readbackTimer;
+    unsigned long long nextSequence{ 0 };
+    std::string metadataPath;   // the encoder's, reused
+
+    Slot* oldestReading()
+    {
+        Slot* oldest = nullptr;
+        for (Slot& slot : slots)
+            if (slot.state == SlotState::Reading && (oldest == nullptr || slot.sequence < oldest->sequence)) oldest = &slot;
+        return oldest;
+    }
+
+    // a free slot, waiting for one if needed
+    Slot& acquire()
+    {
+        while (true)
+        {
+            poll();
+            for (Slot& slot : slots) if (slot.state == SlotState::Free) return slot;
+            wait();
+        }
+    }
+
+    // blocks a little: on the oldest fence if something is on the GPU, otherwise until the encoder hands a slot back
+    void wait()
+    {
+        Slot* oldest = oldestReading();
+        if (oldest != nullptr) glClientWaitSync(oldest->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);    // 1 ms
+        else
+        {
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            rendererWake.wait(lock, [this] { return !encoded.empty(); });
+        }
+    }
+
+    // changes what a waiting thread checks, then wakes it. The change is made visible under the mutex, so that the waiter
+    // cannot check between the change and the notification and sleep through it
+    template<typename F>
+    void notify(std::condition_variable& wake, F&& change)
+    {
+        change();
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+        }
+        wake.notify_one();
+    }
+
+    void map(Slot& slot)
+    {
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+        for (Readback& read : slot.reads)
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, read.PBO);
+            read.data = static_cast<const GLfloat*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, static_cast<GLsizeiptr>(read.values * sizeof(GLfloat)), GL_MAP_READ_BIT));
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.state = SlotState::Encoding;
+        notify(encoderWake, [&] { toEncode.push(static_cast<size_t>(&slot - slots.data())); });  // never full: it holds as many as there are slots
+    }
+
+    // one value per line, as ostream << std::setprecision(10) would print it, formatted in place into full chunks (a value
+    // may straddle two of them), handed to the writer as they fill up
+    void write(const Readback& read)
+    {
+        if (read.data == nullptr)
+        {
+            std::cout << "ERROR::FRAME_PIPELINE:: cannot map the readback of " << read.path << "\n";
+            return;
+        }
+        ScopedStage stage(Stage::Encode);
+        int file = handOver([&] { return writer->open(read.path, read.output.what); });
+        if (file < 0) return;
+        AlignedBuffer chunk = chunks.acquire();
+        char* begin = chunk.data();
+        char* end = begin + CHUNK_BYTES;
+        char* p = begin;
+        for (size_t i = 0; i < read.values; ++i)
+        {
+            if (static_cast<size_t>(end - p) >= MAX_VALUE_CHARS)
+            {
+                p = std::to_chars(p, end, static_cast<double>(read.data[i]), std::chars_format::general, 10).ptr;
+                *p++ = '\n';
+                continue;
+            }
+            // the end of the chunk: fill it up to the last byte, the rest goes at the start of the next one
+            char value[MAX_VALUE_CHARS];
+            char* v = std::to_chars(value, value + MAX_VALUE_CHARS, static_cast<double>(read.data[i]), std::chars_format::general, 10).ptr;
+            *v++ = '\n';
+            size_t length = v - value, fits = std::min(length, static_cast<size_t>(end - p));
+            std::memcpy(p, value, fits);
+            p += fits;
+            if (p == end)
+            {
+                chunk.resize(CHUNK_BYTES);
+                handOver([&] { writer->write(file, std::move(chunk)); });
+                chunk = chunks.acquire();
+                begin = chunk.data();
+                end = begin + CHUNK_BYTES;
+                p = begin;
+                std::memcpy(p, value + fits, length - fits);
+                p += length - fits;
+            }
+        }
+        chunk.resize(p - begin);
+        handOver([&] {
+            if (chunk.size() > 0) writer->write(file, std::move(chunk));
+            else chunks.release(std::move(chunk));
+            writer->close(file);
+        });
+    }
+
+    // the metadata of the snapshot, in small files next to its images, one value per line like them: light direction,
+    // camera pose (C->W, row-major), intrinsics (width height near far fx fy cx cy) and, for a job frame, its seed and
+    // augmentation. Through the writer as well, so that they are batched with the images and never block the GL thread
+    void writeMetadata(const Slot& slot)
+    {
+        ScopedStage stage(Stage::Encode);
+        const FrameMetadata& metadata = slot.metadata;
+        writeSmall(slot, "light_direction.txt", [&](char* p, char* end) {
+            for (int i = 0; i < 3; ++i) p = formatValue(p, end, metadata.lightDir[i]);
+            return p;
+        });
+        writeSmall(slot, "camera_pose.txt", [&](char* p, char* end) {
+            for (int i = 0; i < 4; ++i) for (int j = 0; j < 4; ++j) p = formatValue(p, end, metadata.pose[j][i]);
+            return p;
+        });
+        writeSmall(slot, "intrinsics.txt", [&](char* p, char* end) {
+            for (float value : metadata.intrinsics) p = formatValue(p, end, value);
+            return p;
+        });
+        auto integer = [](uint64_t value) {
+            return [value](char* p, char* end) {
+                p = std::to_chars(p, end, value).ptr;
+                *p++ = '\n';
+                return p;
+            };
+        };
+        if (metadata.seedFile) writeSmall(slot, "seed.txt", integer(metadata.seed));
+        if (metadata.augmentationFile) writeSmall(slot, "augmentation.txt", integer(metadata.augmentation));
+    }
+
+    // a file of a few values, prefix + name, formatted by format(begin, end) (returns the end of the text) into a single
+    // chunk. Not logged, the images are
+    template<typename F>
+    void writeSmall(const Slot& slot, const char* name, F&& format)
+    {
+        metadataPath.assign(slot.prefix);
+        metadataPath.append(name);
+        int file = handOver([&] { return writer->open(metadataPath, ""); });
+        if (file < 0) return;
+        AlignedBuffer chunk = chunks.acquire();
+        chunk.resize(format(chunk.data(), chunk.data() + CHUNK_BYTES) - chunk.data());
+        handOver([&] {
+            writer->write(file, std::move(chunk));
+            writer->close(file);
+        });
+    }
+
+    // a value and its newline, as ostream << std::setprecision(10) prints it. Room for MAX_VALUE_CHARS is left to the caller
+    static char* formatValue(char* p, char* end, double value)
+    {
+        p = std::to_chars(p, end, value, std::chars_format::general, 10).ptr;
+        *p++ = '\n';
+        return p;
+    }
+
+    // a call to the writer, timed apart from the encoding: it waits when the writer's queue is full
+    template<typename F>
+    static auto handOver(F&& f) -> decltype(f())
+    {
+        ScopedStage stage(Stage::Write);
+        return f();
+    }
+
+    // the whole frame to the shared memory ring, straight from the mapped buffers
+    void publish(const Slot& slot)
+    {
+        ScopedStage stage(Stage::Encode);
+        const float* images[3];
+        unsigned int outputs = 0;
+        size_t count = 0;
+        for (const Readback& read : slot.reads)
+        {
+            if (read.data == nullptr)
+            {
+                std::cout << "ERROR::FRAME_PIPELINE:: cannot map the readback of snapshot " << slot.metadata.index << "\n";
+                return;
+            }
+            outputs |= read.output.output;
+            images[count++] = read.data;
+        }
+        ring->publish(slot.metadata, slot.width, slot.height, outputs, images);
+    }
+
+    // the encode stage, on its own thread
+    void encode()
+    {
+        while (true)
+        {
+            size_t index;
+            if (!toEncode.pop(index))
+            {
+                if (flushing)
+                {
+                    if (writer)
+                    {
+                        writer->flush();
+                        flushedStats = writer->stats();
+                    }
+                    notify(rendererWake, [this] { flushing = false; });
+                }
+                if (stopping) return;
+                if (writer) writer->poll();
+                // asleep until there is something to do, waking up regularly only while the writer has I/O to complete
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                auto ready = [this] { return !toEncode.empty() || flushing || stopping; };
+                if (writer && writer->needsPolling()) encoderWake.wait_for(lock, std::chrono::milliseconds(1), ready);
+                else encoderWake.wait(lock, ready);
+                continue;
+            }
+            if (ring) publish(slots[index]);
+            else
+            {
+                writeMetadata(slots[index]);
+                for (const Readback& read : slots[index].reads) write(read);
+            }
+            notify(rendererWake, [&] { encoded.push(index); });
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,386 @@
+#ifndef FRAME_RENDERER_H
+#define FRAME_RENDERER_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <glm/glm.hpp>
+
+#include <model.h>
+#include <shader_variants.h>
+#include <render_pipeline.h>
+#include <uniform_blocks.h>
+#include <intrinsics.h>
+#include <renderer.h>
+#include <asset_streamer.h>
+#include <resident_models.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "conf.h"
+
+// The generator as a library: a C++ program (a training or simulation loop) asks for a batch of frames and gets their
+// images back as contiguous tensors, in its own process, without any file in between.
+//
+//     FrameRenderer frames;                              // its own hidden window, or the current context if there is one
+//     std::vector<FrameRequest> requests = ...;          // model, pose, light, intrinsics of each frame
+//     FrameBatch batch = frames.render(requests);        // batch.depth: N x 1 x H x W, batch.HDR: N x 4 x H x W, ...
+//
+// The frames of a batch are rendered grouped by model (each one is imported once, the next ones in the background) and
+// read back into pixel buffers as they go; the buffers are mapped once at the end of the batch. The depth convention is
+// the one of conf::depth_mode, the outputs those of the options.
+
+enum class TensorLayout { NCHW, NHWC };
+
+struct FrameRequest {
+    std::string model;              // path of the model file, as in conf::models
+    glm::mat4 pose{ 1.0f };         // camera to world, as in camera_pose.txt
+    glm::vec3 lightDir{ 0.0f, 0.0f, -1.0f };
+    Intrinsics intrinsics;          // all the frames of a batch have the same resolution, in [1, MAX_SENSOR_SIZE]
+};
+
+// the images of a batch, one contiguous tensor per output (empty for the outputs not rendered)
+struct FrameBatch {
+    size_t count{ 0 };
+    unsigned int width{ 0 }, height{ 0 };
+    unsigned int outputs{ 0 };
+    TensorLayout layout{ TensorLayout::NCHW };
+    std::vector<float> depth;       // 1 channel
+    std::vector<float> HDR;         // 4 channels, RGBA
+    std::vector<float> normals;     // 3 channels, n/2 + 1/2
+    std::vector<unsigned char> valid;   // per frame: 0 if it is malformed or its model could not be imported (its images are 0)
+
+    static unsigned int channels(unsigned int output) { return output == OUTPUT_DEPTH ? 1 : output == OUTPUT_HDR ? 4 : 3; }
+
+    std::vector<float>& images(unsigned int output) { return output == OUTPUT_DEPTH ? depth : output == OUTPUT_HDR ? HDR : normals; }
+    const std::vector<float>& images(unsigned int output) const { return output == OUTPUT_DEPTH ? depth : output == OUTPUT_HDR ? HDR : normals; }
+
+    // the images of frame i for one output, in the layout of the batch
+    const float* frame(unsigned int output, size_t i) const { return images(output).data() + i * channels(output) * width * height; }
+};
+
+struct FrameRendererOptions {
+    unsigned int outputs{ OUTPUT_ALL };
+    TensorLayout layout{ TensorLayout::NCHW };
+    bool topDown{ true };           // first row at the top of the image (the snapshot files have it at the bottom, as GL)
+    unsigned int residentModels{ 4 };   // models kept loaded between batches
+    glm::vec3 lightColor{ 10.0f };
+};
+
+// the renderer never previews: with OUTPUT_NORMALS alone, the normals get their own pass (and shader variant)
+static_assert(RenderPolicy<DepthMode::Standard, OUTPUT_NORMALS, Preview::None>::normalsPass
+    && !RenderPolicy<DepthMode::Standard, OUTPUT_NORMALS, Preview::None>::gBufferPass, "normals alone need the normals pass");
+
+class FrameRenderer {
+public:
+    explicit FrameRenderer(const FrameRendererOptions& options = FrameRendererOptions()) : options(options)
+    {
+        // a context of its own, unless the caller has one current: then the objects live in it
+        if (glfwGetCurrentContext() == NULL)
+        {
+            if (!acquireGlfw())
+            {
+                std::cout << "ERROR::FRAME_RENDERER:: cannot initialize GLFW" << std::endl;
+                return;
+            }
+            ownsGlfw = true;
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+            glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+            glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+#ifdef __APPLE__
+            glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+            window = glfwCreateWindow(1, 1, "FrameRenderer", NULL, NULL);
+            if (window == NULL)
+            {
+                std::cout << "ERROR::FRAME_RENDERER:: cannot create the context" << std::endl;
+                return;
+            }
+            glfwMakeContextCurrent(window);
+            if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+            {
+                std::cout << "ERROR::FRAME_RENDERER:: cannot load the GL functions" << std::endl;
+                glfwDestroyWindow(window);
+                window = NULL;
+                return;
+            }
+            stbi_set_flip_vertically_on_load(true);
+        }
+        context = glfwGetCurrentContext();
+        pipeline = PipelineConfig::fromConf();
+        pipeline.outputs = options.outputs & OUTPUT_ALL;
+        pipeline.preview = Preview::None;
+        if (pipeline.depth == DepthMode::Reverse) glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
+
+        Shader::setBinaryCache(conf::shader_cache_folder);
+        state = std::make_unique<State>(options.residentModels, pipeline);
+        glm::mat4 model = glm::mat4(1.0f);
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+        state->shaders.forEach([&](Shader& shader) {
+            shader.use();
+            shader.setMat4("model", model);
+            shader.setMat3("normalMatrix", normalMatrix);
+        });
+        state->shared.light.color = options.lightColor;
+    }
+
+    ~FrameRenderer()
+    {
+        if (state)
+        {
+            glfwMakeContextCurrent(context);
+            glDeleteBuffers(3, PBOs);
+            state.reset();      // the GL objects go while their context is there
+        }
+        if (window != NULL) glfwDestroyWindow(window);
+        if (ownsGlfw) releaseGlfw();
+    }
+
+    FrameRenderer(const FrameRenderer&) = delete;
+    FrameRenderer& operator=(const FrameRenderer&) = delete;
+
+    bool valid() const { return state != nullptr; }
+
+    FrameBatch render(const std::vector<FrameRequest>& requests)
+    {
+        FrameBatch batch;
+        render(requests.data(), requests.size(), batch);
+        return batch;
+    }
+
+    // the frames into batch, reusing its buffers: in a loop, nothing is allocated once they are large enough
+    void render(const FrameRequest* requests, size_t count, FrameBatch& batch)
+    {
+        batch.count = 0;
+        if (!state || count == 0) return;
+        const unsigned int width = requests[0].intrinsics.width, height = requests[0].intrinsics.height;
+        for (size_t i = 0; i < count; ++i)
+            if (requests[i].intrinsics.width != width || requests[i].intrinsics.height != height)
+            {
+                std::cout << "ERROR::FRAME_RENDERER:: the frames of a batch must have the same resolution" << std::endl;
+                return;
+            }
+        if (width == 0 || height == 0 || width > MAX_SENSOR_SIZE || height > MAX_SENSOR_SIZE)
+        {
+            // nothing to render, nor to size buffers by: every frame is invalid, the images are empty
+            std::cout << "ERROR::FRAME_RENDERER:: the resolution must be in [1, " << MAX_SENSOR_SIZE << "], got " << width << "x" << height << std::endl;
+            batch.count = count;
+            batch.width = batch.height = 0;
+            batch.outputs = pipeline.outputs;
+            batch.layout = options.layout;
+            batch.valid.assign(count, 0);
+            for (unsigned int output : OUTPUTS) batch.images(output).clear();
+            return;
+        }
+        glfwMakeContextCurrent(context);
+
+        batch.count = count;
+        batch.width = width;
+        batch.height = height;
+        batch.outputs = pipeline.outputs;
+        batch.layout = options.layout;
+        batch.valid.assign(count, 1);
+        const size_t pixels = static_cast<size_t>(width) * height;
+        for (unsigned int output : OUTPUTS)
+            batch.images(output).resize((pipeline.outputs & output) ? count * pixels * FrameBatch::channels(output) : 0);
+
+        dispatchPipeline(pipeline, [&](auto policy) { renderFrames<decltype(policy)>(requests, count, batch); });
+        readBack(batch);
+    }
+
+private:
+    // what lives in the context, deleted before it
+    struct State {
+        ShaderVariants shaders;
+        Renderer renderer;
+        SharedUniforms shared;
+        AssetStreamer streamer;
+        ResidentModels models;
+
+        State(unsigned int residentModels, const PipelineConfig& pipeline)
+            : shaders("../Data/shaders/standard.vert", "../Data/shaders/standard.frag", Renderer::requiredOutputs(pipeline)), models(streamer, residentModels) {}
+    };
+
+    static constexpr unsigned int OUTPUTS[3] = { OUTPUT_DEPTH, OUTPUT_HDR, OUTPUT_NORMALS };
+
+    FrameRendererOptions options;
+    PipelineConfig pipeline;
+    GLFWwindow* window{ NULL };     // only if the context is our own
+    GLFWwindow* context{ NULL };
+    bool ownsGlfw{ false };        // this renderer counts in glfwUsers
+    std::unique_ptr<State> state;
+    GLuint PBOs[3]{ 0, 0, 0 };      // the readbacks of the batch, one buffer per output, frame after frame
+    GLsizeiptr capacities[3]{ 0, 0, 0 };
+    std::vector<size_t> order;
+
+    // GLFW is initialized by the first renderer which needs a window of its own, and terminated with the last one
+    static std::mutex& glfwMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static unsigned int& glfwUsers()
+    {
+        static unsigned int users = 0;
+        return users;
+    }
+    static bool acquireGlfw()
+    {
+        std::lock_guard<std::mutex> lock(glfwMutex());
+        if (glfwUsers() == 0 && !glfwInit()) return false;
+        ++glfwUsers();
+        return true;
+    }
+    static void releaseGlfw()
+    {
+        std::lock_guard<std::mutex> lock(glfwMutex());
+        if (--glfwUsers() == 0) glfwTerminate();
+    }
+
+    // the same checks as the render service (see serveRequests): the intrinsics make a frustum, the pose an inverse
+    static bool wellFormed(const FrameRequest& request)
+    {
+        const Intrinsics& intrinsics = request.intrinsics;
+        if (!(intrinsics.near > 0.0f && intrinsics.far > intrinsics.near) || !(intrinsics.fx > 0.0f && intrinsics.fy > 0.0f)) return false;
+        if (!std::isfinite(intrinsics.far) || !std::isfinite(intrinsics.fx) || !std::isfinite(intrinsics.fy)
+            || !std::isfinite(intrinsics.cx) || !std::isfinite(intrinsics.cy)) return false;
+        for (int i = 0; i < 4; ++i) for (int j = 0; j < 4; ++j) if (!std::isfinite(request.pose[j][i])) return false;
+        for (int i = 0; i < 3; ++i) if (!std::isfinite(request.lightDir[i])) return false;
+        float determinant = glm::determinant(request.pose);
+        return std::isfinite(determinant) && std::abs(determinant) > 1e-12f;
+    }
+
+    template<typename FramePolicy>
+    void renderFrames(const FrameRequest* requests, size_t count, FrameBatch& batch)
+    {
+        using Policy = RenderPolicy<FramePolicy::depth, FramePolicy::outputs, Preview::None>;
+        Renderer& renderer = state->renderer;
+        SharedUniforms& shared = state->shared;
+        const size_t pixels = static_cast<size_t>(batch.width) * batch.height;
+
+        GLenum formats[3] = { GL_DEPTH_COMPONENT, GL_RGBA, GL_RGB };
+        for (int k = 0; k < 3; ++k)
+        {
+            if (!(Policy::outputs & OUTPUTS[k])) continue;
+            GLsizeiptr bytes = static_cast<GLsizeiptr>(count * pixels * FrameBatch::channels(OUTPUTS[k]) * sizeof(GLfloat));
+            if (PBOs[k] == 0) glGenBuffers(1, &PBOs[k]);
+            if (capacities[k] < bytes)
+            {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, PBOs[k]);
+                glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+                capacities[k] = bytes;
+            }
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        // grouped by model, each group imported once; the images keep the order of the requests
+        order.resize(count);
+        std::iota(order.begin(), order.end(), size_t{ 0 });
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return requests[a].model < requests[b].model; });
+        for (size_t i : order) if (wellFormed(requests[i])) state->models.prefetch(requests[i].model);
+
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        Model* model = nullptr;
+        const std::string* modelPath = nullptr;     // of model: the malformed frames skipped in between do not count
+        for (size_t n = 0; n < count; ++n)
+        {
+            const size_t i = order[n];
+            const FrameRequest& request = requests[i];
+            if (!wellFormed(request))
+            {
+                batch.valid[i] = 0;
+                continue;
+            }
+            if (modelPath == nullptr || request.model != *modelPath)
+            {
+                model = state->models.get(request.model);
+                modelPath = &request.model;
+            }
+            if (model == nullptr)
+            {
+                batch.valid[i] = 0;
+                continue;
+            }
+
+            const Intrinsics& intrinsics = request.intrinsics;
+            shared.frame.projection = intrinsics.projection(Policy::reverse);
+            shared.frame.Near = intrinsics.near;
+            shared.frame.Far = intrinsics.far;
+            shared.frame.view = glm::inverse(request.pose);
+            shared.frame.camPos = glm::vec3(request.pose[3]);
+            shared.light.wDir = request.lightDir;
+            shared.upload();
+            renderer.Draw<Policy>(*model, state->shaders, intrinsics);
+
+            // into the slot of the frame in the batch buffers: returns at once
+            const RenderTargetPool::Targets& targets = renderer.currentTargets();
+            const GLuint textures[3] = { targets.depthMap, targets.HDRTex, targets.normalsTex };
+            for (int k = 0; k < 3; ++k)
+            {
+                if (!(Policy::outputs & OUTPUTS[k])) continue;
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, PBOs[k]);
+                glBindTexture(GL_TEXTURE_2D, textures[k]);
+                glGetTexImage(GL_TEXTURE_2D, 0, formats[k], GL_FLOAT, (void*)(i * pixels * FrameBatch::channels(OUTPUTS[k]) * sizeof(GLfloat)));
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        renderer.targetPool.nextFrame();
+    }
+
+    // the pixel buffers to the tensors of the batch: flipped and transposed as the options ask, zeros for the failed frames
+    void readBack(FrameBatch& batch)
+    {
+        const size_t width = batch.width, height = batch.height, pixels = width * height;
+        for (int k = 0; k < 3; ++k)
+        {
+            if (!(batch.outputs & OUTPUTS[k])) continue;
+            const size_t channels = FrameBatch::channels(OUTPUTS[k]), frameValues = pixels * channels;
+            float* out = batch.images(OUTPUTS[k]).data();
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, PBOs[k]);
+            const float* in = static_cast<const float*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, static_cast<GLsizeiptr>(batch.count * frameValues * sizeof(float)), GL_MAP_READ_BIT));
+            if (in == nullptr)
+            {
+                std::cout << "ERROR::FRAME_RENDERER:: cannot map the readback" << std::endl;
+                std::fill(out, out + batch.count * frameValues, 0.0f);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                continue;
+            }
+            for (size_t i = 0; i < batch.count; ++i)
+            {
+                float* frameOut = out + i * frameValues;
+                if (!batch.valid[i])
+                {
+                    std::fill(frameOut, frameOut + frameValues, 0.0f);
+                    continue;
+                }
+                const float* frameIn = in + i * frameValues;    // rows bottom to top, channels interleaved
+                for (size_t y = 0; y < height; ++y)
+                {
+                    const float* row = frameIn + (options.topDown ? height - 1 - y : y) * width * channels;
+                    if (batch.layout == TensorLayout::NHWC)
+                        std::memcpy(frameOut + y * width * channels, row, width * channels * sizeof(float));
+                    else
+                        for (size_t c = 0; c < channels; ++c)
+                        {
+                            float* plane = frameOut + c * pixels + y * width;
+                            for (size_t x = 0; x < width; ++x) plane[x] = row[x * channels + c];
+                        }
+                }
+            }
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <shared_memory.h>
+#include <render_pipeline.h>
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+#include "conf.h"
+
+// Streams the snapshots to another process of the node through shared memory, instead of files: a ring of slots, each
+// holding a whole frame (images and metadata). The consumer reads the slots in place, and the producer never overwrites a
+// slot which is not consumed yet: a slow consumer slows the generator down instead of losing frames.
+//
+// Layout (native endianness, offsets in bytes from the start of the block):
+//   header, 4096 bytes:
+//     0    char magic[8] "FRMRING1"
+//     8    u32 version
+//     12   u32 slot count
+//     16   u64 slot size, a multiple of 4096
+//     24   u32 width, u32 height      of every frame in the ring
+//     32   u32 outputs                bit mask: 1 depth, 2 HDR, 4 normals (OUTPUT_* in render_pipeline.h)
+//     36   u32 generation             0 for the first ring of the producer, see below
+//     64   u64 published              frames written so far, by the producer
+//     128  u64 consumed               frames read so far, by the consumer
+//     192  u32 closed                 1 once the producer is gone
+//     196  u32 superseded             1 once the producer has moved on to the next generation
+//   frame n in slot n % slot count, at 4096 + slot * slot size:
+//     0    u64 frame number n
+//     8    i32 snapshot index         as in the file names
+//     16   f32 camera pose[16]        camera to world, row-major (as in camera_pose.txt)
+//     80   f32 light direction[3]
+//     96   f32 intrinsics[8]          width height near far fx fy cx cy (as in intrinsics.txt)
+//     128  u64 depth, HDR, normals    offsets of the images from the start of the slot, 0 if not in the ring
+//     152  u64 augmentation           the augmentation copy of a job frame (see JobSpec), 0 otherwise
+//     160  u64 seed                   the seed of a job frame (see FrameDescriptor), 0 otherwise
+//     256  the images, each 4096 aligned: depth f32[h][w], HDR f32[h][w][4] (RGBA), normals f32[h][w][3], rows from the
+//          bottom of the image up (as OpenGL reads them)
+// The counters sit on their own cache lines and are lock-free 64 bit atomics. The producer writes frame n only once
+// n - consumed < slot count, then publishes it by storing published = n + 1 (release). The consumer reads frame n once
+// n < published (acquire), then gives the slot back by storing consumed = n + 1 (release).
+//
+// A ring holds frames of one size and one set of outputs. When a frame of another size (or with other outputs) comes, the
+// producer waits until every frame of the ring is consumed, creates the next generation (a new ring, named after the
+// first one with ".<generation>" appended, the first one being generation 0), then sets superseded in the old one and
+// removes it. A consumer which finds the ring empty and superseded opens the next generation and goes on from there.
+namespace frame_ring {
+    constexpr char MAGIC[8] = { 'F', 'R', 'M', 'R', 'I', 'N', 'G', '1' };
+    constexpr uint32_t VERSION{ 2 };
+    constexpr size_t PAGE{ 4096 };
+    constexpr size_t HEADER_BYTES{ PAGE };
+    constexpr size_t SLOT_HEADER_BYTES{ 256 };
+
+    // header offsets
+    constexpr size_t SLOT_COUNT{ 12 }, SLOT_SIZE{ 16 }, WIDTH{ 24 }, HEIGHT{ 28 }, OUTPUTS{ 32 }, GENERATION{ 36 }, PUBLISHED{ 64 }, CONSUMED{ 128 }, CLOSED{ 192 }, SUPERSEDED{ 196 };
+    // slot offsets
+    constexpr size_t FRAME{ 0 }, INDEX{ 8 }, POSE{ 16 }, LIGHT{ 80 }, INTRINSICS{ 96 }, IMAGES{ 128 }, AUGMENTATION{ 152 }, SEED{ 160 };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring counters must be lock-free to be shared between processes");
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "the ring counters must be lock-free to be shared between processes");
+
+    inline size_t pageAlign(size_t bytes) { return (bytes + PAGE - 1) / PAGE * PAGE; }
+    inline std::string generationName(const std::string& name, uint32_t generation) { return generation == 0 ? name : name + "." + std::to_string(generation); }
+    inline std::atomic<uint64_t>& counter(unsigned char* block, size_t offset) { return *reinterpret_cast<std::atomic<uint64_t>*>(block + offset); }
+    inline std::atomic<uint32_t>& flag(unsigned char* block, size_t offset) { return *reinterpret_cast<std::atomic<uint32_t>*>(block + offset); }
+    template<typename T> T get(const unsigned char* p) { T value; std::memcpy(&value, p, sizeof(T)); return value; }
+    template<typename T> void put(unsigned char* p, T value) { std::memcpy(p, &value, sizeof(T)); }
+
+    // channels of each image, in the order of the slot
+    constexpr unsigned int OUTPUT_BITS[3] = { OUTPUT_DEPTH, OUTPUT_HDR, OUTPUT_NORMALS };
+    constexpr unsigned int CHANNELS[3] = { 1, 4, 3 };
+}
+
+// What goes with the images of a snapshot
+struct FrameMetadata {
+    int index{ 0 };
+    glm::mat4 pose{ 1.0f };         // camera to world
+    glm::vec3 lightDir{ 0.0f };
+    float intrinsics[8]{};          // width height near far fx fy cx cy
+    uint64_t augmentation{ 0 };     // of a job frame
+    uint64_t seed{ 0 };             // of a job frame
+    // which of the two also get a file next to the images (the ring has both): the seed of any job frame, the
+    // augmentation when the job makes several copies
+    bool seedFile{ false }, augmentationFile{ false };
+};
+
+// The producer side. One per process, shared by the threads which publish (the encoders of the render workers): they
+// take turns, the consumer does not see them. The ring is created with the first frame, sized for it, and recreated
+// (the next generation) for the first frame of another size or with other outputs.
+class FrameRingProducer {
+public:
+    FrameRingProducer(const std::string& name, unsigned int slots = conf::frame_ring_slots) : name(name), slotCount(slots > 0 ? slots : 1) {}
+
+    ~FrameRingProducer()
+    {
+        if (memory.data()) frame_ring::flag(memory.data(), frame_ring::CLOSED).store(1, std::memory_order_release);
+    }
+
+    FrameRingProducer(const FrameRingProducer&) = delete;
+    FrameRingProducer& operator=(const FrameRingProducer&) = delete;
+
+    // the producer of the process for conf::frame_ring
+    static FrameRingProducer& shared()
+    {
+        static FrameRingProducer producer(conf::frame_ring);
+        return producer;
+    }
+
+    // copies a frame into the next slot, waiting while the consumer is a whole ring behind. images: one per bit of
+    // outputs, in the order of the slot. false if the ring cannot be created
+    bool publish(const FrameMetadata& metadata, unsigned int width, unsigned int height, unsigned int outputs, const float* const* images)
+    {
+        using namespace frame_ring;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!memory.data() && !create(width, height, outputs)) return false;
+        unsigned char* block = memory.data();
+        if (width != get<uint32_t>(block + WIDTH) || height != get<uint32_t>(block + HEIGHT) || outputs != get<uint32_t>(block + OUTPUTS))
+        {
+            if (!supersede(width, height, outputs)) return false;
+            block = memory.data();
+        }
+
+        // backpressure: the slot of frame n is free once the consumer has read frame n - slot count
+        uint64_t n = counter(block, PUBLISHED).load(std::memory_order_relaxed);
+        while (n - counter(block, CONSUMED).load(std::memory_order_acquire) >= slotCount)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+        unsigned char* slot = block + HEADER_BYTES + (n % slotCount) * slotBytes;
+        put<uint64_t>(slot + FRAME, n);
+        put<int32_t>(slot + INDEX, metadata.index);
+        for (int i = 0; i < 4; ++i) for (int j = 0; j < 4; ++j) put<float>(slot + POSE + (i * 4 + j) * 4, metadata.pose[j][i]);
+        for (int i = 0; i < 3; ++i) put<float>(slot + LIGHT + i * 4, metadata.lightDir[i]);
+        std::memcpy(slot + INTRINSICS, metadata.intrinsics, sizeof(metadata.intrinsics));
+        put<uint64_t>(slot + AUGMENTATION, metadata.augmentation);
+        put<uint64_t>(slot + SEED, metadata.seed);
+        size_t image = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            if (!(outputs & OUTPUT_BITS[k])) continue;
+            size_t offset = get<uint64_t>(slot + IMAGES + k * 8);
+            std::memcpy(slot + offset, images[image++], static_cast<size_t>(width) * height * CHANNELS[k] * sizeof(float));
+        }
+        counter(block, PUBLISHED).store(n + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::string name;
+    unsigned int slotCount;
+    size_t slotBytes{ 0 };
+    SharedMemory memory;
+    uint32_t generation{ 0 };
+    std::mutex mutex;
+
+    // the next generation, for frames of this size and outputs. The current ring is drained first, so that the consumer
+    // is done with it when it goes
+    bool supersede(unsigned int width, unsigned int height, unsigned int outputs)
+    {
+        using namespace frame_ring;
+        unsigned char* old = memory.data();
+        uint64_t published = counter(old, PUBLISHED).load(std::memory_order_relaxed);
+        while (counter(old, CONSUMED).load(std::memory_order_acquire) < published)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+        SharedMemory previous = std::move(memory);
+        ++generation;
+        if (!create(width, height, outputs))
+        {
+            memory = std::move(previous);
+            --generation;
+            return false;
+        }
+        // the next ring exists before the consumer is told to open it. previous removes its name as it goes, the consumer
+        // keeps its mapping until it moves on
+        flag(old, SUPERSEDED).store(1, std::memory_order_release);
+        return true;
+    }
+
+    bool create(unsigned int width, unsigned int height, unsigned int outputs)
+    {
+        using namespace frame_ring;
+        size_t imageOffsets[3] = { 0, 0, 0 };
+        size_t bytes = SLOT_HEADER_BYTES;
+        for (int k = 0; k < 3; ++k)
+        {
+            if (!(outputs & OUTPUT_BITS[k])) continue;
+            bytes = pageAlign(bytes);
+            imageOffsets[k] = bytes;
+            bytes += static_cast<size_t>(width) * height * CHANNELS[k] * sizeof(float);
+        }
+        slotBytes = pageAlign(bytes);
+        memory = SharedMemory::create(generationName(name, generation), HEADER_BYTES + slotCount * slotBytes);
+        unsigned char* block = memory.data();
+        if (!block) return false;
+
+        std::memcpy(block, MAGIC, sizeof(MAGIC));
+        put<uint32_t>(block + 8, VERSION);
+        put<uint32_t>(block + SLOT_COUNT, slotCount);
+        put<uint64_t>(block + SLOT_SIZE, slotBytes);
+        put<uint32_t>(block + WIDTH, width);
+        put<uint32_t>(block + HEIGHT, height);
+        put<uint32_t>(block + OUTPUTS, outputs);
+        put<uint32_t>(block + GENERATION, generation);
+        new (block + PUBLISHED) std::atomic<uint64_t>(0);
+        new (block + CONSUMED) std::atomic<uint64_t>(0);
+        new (block + CLOSED) std::atomic<uint32_t>(0);
+        new (block + SUPERSEDED) std::atomic<uint32_t>(0);
+        for (unsigned int s = 0; s < slotCount; ++s)
+            for (int k = 0; k < 3; ++k) put<uint64_t>(block + HEADER_BYTES + s * slotBytes + IMAGES + k * 8, imageOffsets[k]);
+        std::cout << "Streaming " << width << "x" << height << " frames to shared memory " << generationName(name, generation) << ": " << slotCount << " slots of " << slotBytes / (1024.0 * 1024.0) << " MB" << std::endl;
+        return true;
+    }
+};
+
+// The consumer side, for the process reading the frames (the layout above is all it needs; this is the C++ version).
+// Reads in place: a frame stays valid until release(). Follows the generations of the ring on its own: width(),
+// height() and outputs() may change between two frames, generation() tells when they did.
+class FrameRingConsumer {
+public:
+    struct Frame {
+        uint64_t number;
+        int index;
+        const float* pose;          // [16], row-major
+        const float* lightDir;      // [3]
+        const float* intrinsics;    // [8]
+        uint64_t augmentation;
+        uint64_t seed;
+        const float* depth;         // null when not in the ring
+        const float* HDR;
+        const float* normals;
+    };
+
+    explicit FrameRingConsumer(const std::string& name) : name(name), memory(attach(name, false)) {}
+
+    bool valid() const { return memory.data() != nullptr; }
+    uint32_t generation() const { return frame_ring::get<uint32_t>(memory.data() + frame_ring::GENERATION); }
+    unsigned int width() const { return frame_ring::get<uint32_t>(memory.data() + frame_ring::WIDTH); }
+    unsigned int height() const { return frame_ring::get<uint32_t>(memory.data() + frame_ring::HEIGHT); }
+    unsigned int outputs() const { return frame_ring::get<uint32_t>(memory.data() + frame_ring::OUTPUTS); }
+    // the producer is gone (the frames it published can still be read)
+    bool closed() const { return frame_ring::flag(memory.data(), frame_ring::CLOSED).load(std::memory_order_acquire) != 0; }
+
+    // the next frame if it is published, without waiting
+    bool next(Frame& frame)
+    {
+        using namespace frame_ring;
+        unsigned char* block = memory.data();
+        uint64_t n = counter(block, CONSUMED).load(std::memory_order_relaxed);
+        if (n >= counter(block, PUBLISHED).load(std::memory_order_acquire))
+        {
+            // all read: the next frames may be in the next generation
+            if (flag(block, SUPERSEDED).load(std::memory_order_acquire) == 0) return false;
+            SharedMemory next = attach(generationName(name, generation() + 1), true);
+            if (!next.data()) return false;
+            memory = std::move(next);
+            return this->next(frame);
+        }
+        const unsigned char* slot = block + HEADER_BYTES + (n % get<uint32_t>(block + SLOT_COUNT)) * get<uint64_t>(block + SLOT_SIZE);
+        frame.number = get<uint64_t>(slot + FRAME);
+        frame.index = get<int32_t>(slot + INDEX);
+        frame.pose = reinterpret_cast<const float*>(slot + POSE);
+        frame.lightDir = reinterpret_cast<const float*>(slot + LIGHT);
+        frame.intrinsics = reinterpret_cast<const float*>(slot + INTRINSICS);
+        frame.augmentation = get<uint64_t>(slot + AUGMENTATION);
+        frame.seed = get<uint64_t>(slot + SEED);
+        const float** images[3] = { &frame.depth, &frame.HDR, &frame.normals };
+        for (int k = 0; k < 3; ++k)
+        {
+            uint64_t offset = get<uint64_t>(slot + IMAGES + k * 8);
+            *images[k] = offset ? reinterpret_cast<const float*>(slot + offset) : nullptr;
+        }
+        return true;
+    }
+
+    // gives the slot of the frame returned by next() back to the producer
+    void release()
+    {
+        std::atomic<uint64_t>& consumed = frame_ring::counter(memory.data(), frame_ring::CONSUMED);
+        consumed.store(consumed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    std::string name;   // of generation 0
+    SharedMemory memory;
+
+    static SharedMemory attach(const std::string& name, bool quiet)
+    {
+        SharedMemory block = SharedMemory::open(name, quiet);
+        if (block.data() && (block.size() < frame_ring::HEADER_BYTES || std::memcmp(block.data(), frame_ring::MAGIC, sizeof(frame_ring::MAGIC)) != 0
+            || frame_ring::get<uint32_t>(block.data() + 8) != frame_ring::VERSION))
+        {
+            std::cout << "ERROR::FRAME_RING:: " << name << " is not a frame ring" << std::endl;
+            return SharedMemory();
+        }
+        return block;
+    }
+};
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef INTRINSICS_H
+#define INTRINSICS_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "conf.h"
+
+// Perspective projection from the frustum at the near plane. NB: l, b might as well be negative, n, f are positive!!
+inline glm::mat4 getProjectionMatrix(float l, float r, float b, float t, float n, float f)
+{
+    float matrix[16];
+    for (int i{ 0 }; i < 16; ++i) matrix[i] = 0.0f;
+
+    matrix[0] = 2 * n / (r - l);
+    matrix[5] = 2 * n / (t - b);
+    matrix[8] = (r + l) / (r - l);
+    matrix[9] = (t + b) / (t - b);
+    matrix[10] = -(f + n) / (f - n);
+    matrix[11] = -1;
+    matrix[14] = -(2 * f * n) / (f - n);
+
+    glm::mat4 res = glm::make_mat4(matrix);
+    return res;
+}
+
+// Sensor configuration, as in conf.h but known at runtime: resolution, near and far plane, pinhole intrinsics in pixels
+struct Intrinsics {
+    unsigned int width{ conf::SCR_WIDTH };
+    unsigned int height{ conf::SCR_HEIGHT };
+    float near{ conf::near };
+    float far{ conf::far };
+    float fx{ conf::fx };
+    float fy{ conf::fy };
+    float cx{ conf::cx };
+    float cy{ conf::cy };
+
+    // the frustum at the near plane (the focal length is the near plane distance, see conf.h)
+    float l() const { return -near / fx * cx; }
+    float r() const { return near / fx * (width - cx); }
+    float b() const { return -near / fy * cy; }
+    float t() const { return near / fy * (height - cy); }
+
+    glm::mat4 projection(bool reverse) const
+    {
+        glm::mat4 projection = getProjectionMatrix(l(), r(), b(), t(), near, far);
+        if (reverse) {
+            glm::mat4 maybe_Id = glm::mat4(1.0f);
+            maybe_Id[2][2] = -0.5f;
+            maybe_Id[3][2] = 0.5f;  // NB: 3rd column index, 2nd row index!
+            projection = maybe_Id * projection;
+        }
+        return projection;
+    }
+
+    // the same camera with another resolution (same field of view and principal point, relative to the sensor)
+    Intrinsics resized(unsigned int newWidth, unsigned int newHeight) const
+    {
+        Intrinsics scaled = *this;
+        float sx = static_cast<float>(newWidth) / width, sy = static_cast<float>(newHeight) / height;
+        scaled.width = newWidth;
+        scaled.height = newHeight;
+        scaled.fx *= sx;
+        scaled.cx *= sx;
+        scaled.fy *= sy;
+        scaled.cy *= sy;
+        return scaled;
+    }
+
+    // width height near far fx fy cx cy, one per line, like the other files of a snapshot
+    void toFile(const std::string& path) const
+    {
+        std::ofstream fout(path);
+        fout << std::setprecision(10);
+        fout << width << "\n" << height << "\n" << near << "\n" << far << "\n" << fx << "\n" << fy << "\n" << cx << "\n" << cy << "\n";
+    }
+};
+
+// Random variations of the intrinsics, for datasets which should not be tied to a single sensor
+struct IntrinsicsSampler {
+    float focalJitter{ 0.0f };      // fx and fy are scaled by the same factor in [1 - focalJitter, 1 + focalJitter]
+    float principalJitter{ 0.0f };  // cx and cy are moved by up to this many pixels
+    std::mt19937 rng{ 0 };
+
+    bool enabled() const { return focalJitter > 0.0f || principalJitter > 0.0f; }
+
+    Intrinsics sample(const Intrinsics& base)
+    {
+        Intrinsics sampled = base;
+        std::uniform_real_distribution<float> focal(1.0f - focalJitter, 1.0f + focalJitter);
+        std::uniform_real_distribution<float> principal(-principalJitter, principalJitter);
+        float scale = focal(rng);
+        sampled.fx *= scale;
+        sampled.fy *= scale;
+        sampled.cx += principal(rng);
+        sampled.cy += principal(rng);
+        return sampled;
+    }
+};
+
+// largest width or height of a sensor, in pixels
+constexpr unsigned int MAX_SENSOR_SIZE{ 16384 };
+
+// Reads "key = value" lines (# starts a comment). Keys: width height near far fx fy cx cy focal_jitter principal_jitter seed.
+// Missing keys keep the values of conf.h; cx and cy default to the center of the sensor. False, with an error line, if
+// the file cannot be read, a value is not a number, or the sensor makes no sense (no pixels, near not before far...)
+inline bool loadCameraConfig(const std::string& path, Intrinsics& intrinsics, IntrinsicsSampler& sampler)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cout << "ERROR::CAMERA_CONFIG:: cannot open " << path << std::endl;
+        return false;
+    }
+    bool hasCx = false, hasCy = false, hasFx = false, hasFy = false;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        line = line.substr(0, line.find('#'));
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key;
+        std::stringstream(line.substr(0, eq)) >> key;
+        std::stringstream value(line.substr(eq + 1));
+        long long size = 0;     // signed, so that -1 is not read as a huge unsigned
+        if (key == "width" || key == "height")
+        {
+            value >> size;
+            if (value && (size <= 0 || size > MAX_SENSOR_SIZE))
+            {
+                std::cout << "ERROR::CAMERA_CONFIG:: " << key << " must be in [1, " << MAX_SENSOR_SIZE << "], got " << size << " in " << path << std::endl;
+                return false;
+            }
+            (key == "width" ? intrinsics.width : intrinsics.height) = static_cast<unsigned int>(size);
+        }
+        else if (key == "near") value >> intrinsics.near;
+        else if (key == "far") value >> intrinsics.far;
+        else if (key == "fx") { value >> intrinsics.fx; hasFx = true; }
+        else if (key == "fy") { value >> intrinsics.fy; hasFy = true; }
+        else if (key == "cx") { value >> intrinsics.cx; hasCx = true; }
+        else if (key == "cy") { value >> intrinsics.cy; hasCy = true; }
+        else if (key == "focal_jitter") value >> sampler.focalJitter;
+        else if (key == "principal_jitter") value >> sampler.principalJitter;
+        else if (key == "seed") { unsigned int seed = 0; value >> seed; sampler.rng.seed(seed); }
+        else
+        {
+            std::cout << "Unknown camera config key " << key << ", ignored" << std::endl;
+            continue;
+        }
+        if (!value)
+        {
+            std::cout << "ERROR::CAMERA_CONFIG:: bad value for " << key << " in " << path << std::endl;
+            return false;
+        }
+    }
+    if (!(intrinsics.near > 0.0f && intrinsics.far > intrinsics.near && intrinsics.fx > 0.0f && intrinsics.fy > 0.0f))
+    {
+        std::cout << "ERROR::CAMERA_CONFIG:: need 0 < near < far and positive focal lengths in " << path << std::endl;
+        return false;
+    }
+    if (!hasCx) intrinsics.cx = intrinsics.width / 2.0f;
+    if (!hasCy) intrinsics.cy = intrinsics.height / 2.0f;
+    if (hasFx && !hasFy) intrinsics.fy = intrinsics.fx;
+    if (hasFy && !hasFx) intrinsics.fx = intrinsics.fy;
+    return true;
+}
+
+#endif
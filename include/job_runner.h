@@ -0,0 +1,151 @@
+#ifndef JOB_RUNNER_H
+#define JOB_RUNNER_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <glm/glm.hpp>
+
+#include <model.h>
+#include <shader_variants.h>
+#include <render_pipeline.h>
+#include <uniform_blocks.h>
+#include <renderer.h>
+#include <asset_streamer.h>
+#include <job_spec.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+
+#include "conf.h"
+
+// The frames of a run in one piece, e.g. those of a shard (see jobRange). The chunk source of runJob; the other one is
+// WorkQueue, which hands out the frames of the node to its worker processes as they go.
+class JobRange {
+public:
+    JobRange(uint64_t first, uint64_t end) : first(first), last(end) {}
+
+    // the next frames to render, [begin, end). false once there are none left
+    bool next(uint64_t& begin, uint64_t& end)
+    {
+        if (taken || first >= last) return false;
+        taken = true;
+        begin = first;
+        end = last;
+        return true;
+    }
+
+    uint64_t end() const { return last; }  // no frame of the run is beyond
+
+    // what the run learns about the models, for the sources which estimate costs
+    void loaded(size_t, uint64_t) {}
+    void rendered(size_t, uint64_t, double) {}
+
+private:
+    uint64_t first, last;
+    bool taken{ false };
+};
+
+// Renders the frames of a job that chunks hands out (see JobRange, WorkQueue) as snapshots named by their index in the
+// job: runs over different frames write different files, and together the same ones as a single run. The frames are
+// computed one at a time (see JobSpec::frame), the models loaded one at a time, the next one imported in the background.
+template<typename FramePolicy, typename Chunks>
+void runJob(GLFWwindow* window, const JobSpec& spec, Chunks& chunks, Renderer& renderer, ShaderVariants& shaders, SharedUniforms& shared, AssetStreamer& streamer)
+{
+    // nothing to show: the window is hidden
+    using Policy = RenderPolicy<FramePolicy::depth, FramePolicy::outputs, Preview::None>;
+
+    const uint64_t framesPerModel = spec.size() / spec.models.size();
+    if (chunks.end() > 0 && chunks.end() - 1 > static_cast<uint64_t>(INT_MAX))
+    {
+        std::cout << "ERROR::JOB_RUNNER:: the snapshot indices go up to " << INT_MAX << ", split the job" << std::endl;
+        return;
+    }
+
+    glm::mat4 modelMatrix = glm::mat4(1.0f);
+    glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(modelMatrix)));
+    shaders.forEach([&](Shader& shader) {
+        shader.use();
+        shader.setMat4("model", modelMatrix);
+        shader.setMat3("normalMatrix", normalMatrix);
+    });
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+
+    std::unique_ptr<Model> model;
+    size_t loaded = spec.models.size();     // none
+    uint64_t begin, end, rendered = 0;
+    while (!glfwWindowShouldClose(window) && chunks.next(begin, end))
+    {
+        std::cout << "Job: frames " << begin << " to " << end - 1 << "\n";
+        // the time per frame of each model, for the chunk sources which balance costs
+        auto start = std::chrono::steady_clock::now();
+        uint64_t frames = 0;
+        auto measured = [&]() {
+            auto now = std::chrono::steady_clock::now();
+            if (frames > 0) chunks.rendered(loaded, frames, std::chrono::duration<double>(now - start).count());
+            start = now;
+            frames = 0;
+        };
+
+        for (uint64_t i = begin; i < end && !glfwWindowShouldClose(window); ++i)
+        {
+            FrameDescriptor frame = spec.frame(i);
+
+            // a new model: the old one goes first, the next one starts importing if this chunk gets to it (an import
+            // nobody takes would stay in memory: the chunks after this one may go to another worker)
+            if (frame.model != loaded)
+            {
+                measured();
+                model.reset();
+                loaded = frame.model;
+                ModelData data = streamer.take(spec.models[frame.model]);
+                if (frame.model + 1 < spec.models.size() && (frame.model + 1) * framesPerModel < end)
+                    streamer.prefetch(spec.models[frame.model + 1]);
+                if (!data.valid)
+                {
+                    std::cout << "ERROR::JOB_RUNNER:: cannot import " << spec.models[frame.model] << ", its frames are skipped" << std::endl;
+                    i = std::min(end, (frame.model + 1) * framesPerModel) - 1;
+                    continue;
+                }
+                uint64_t triangles = 0;
+                for (const MeshData& mesh : data.meshes) triangles += mesh.indices.size() / 3;
+                chunks.loaded(frame.model, triangles);
+                model = std::make_unique<Model>(std::move(data));
+                start = std::chrono::steady_clock::now();   // the import is not the frames' time
+            }
+            if (!model) continue;   // the rest of a model which could not be imported
+
+            shared.frame.projection = frame.sensor.projection(Policy::reverse);
+            shared.frame.Near = frame.sensor.near;
+            shared.frame.Far = frame.sensor.far;
+            shared.frame.view = frame.view;
+            shared.frame.camPos = frame.camPos;
+            shared.light.wDir = frame.lightDir;
+            shared.upload();
+
+            renderer.save_to_txt = true;
+            renderer.nSnapshots = static_cast<int>(frame.index);
+            renderer.snapshot_view = frame.view;
+            renderer.snapshot_light = frame.lightDir;
+            renderer.snapshot_augmentation = frame.augmentation;
+            renderer.snapshot_seed = frame.seed;
+            renderer.snapshot_job = true;
+            renderer.snapshot_augmented = spec.augmentations > 1;
+            renderer.Draw<Policy>(*model, shaders, frame.sensor);
+            renderer.targetPool.nextFrame();
+            ++frames;
+            ++rendered;
+
+            glfwPollEvents();
+        }
+        measured();
+    }
+    renderer.exports.flush();
+    std::cout << "Job done: " << rendered << " frames" << std::endl;
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef JOB_SPEC_H
+#define JOB_SPEC_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <intrinsics.h>
+#include <counter_rng.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "conf.h"
+
+// A batch job: every combination of models x camera poses x intrinsics x lights x augmentations, without ever listing
+// them. Frame i is computed from i alone (its digits in the mixed radix of the axis sizes, the model being the most
+// significant one, so that consecutive frames share their model), so a job of any size takes the memory of its spec and a
+// run can start at any frame.
+//
+// The values of an axis are computed from their index as well: camera positions and light directions are spread over a
+// band of elevations by a spherical Fibonacci spiral, the intrinsics are jittered around the sensor along a Halton
+// sequence. The random part of a frame (the jitter of its camera and light) is drawn from a counter-based generator keyed
+// by (seed, frame index): a frame is the same whichever process renders it, so any split of the job (see Shard) makes
+// the same dataset.
+
+// one frame of a job
+struct FrameDescriptor {
+    uint64_t index{ 0 };
+    // its digits, one per axis. The augmentation copies of a frame differ by their augmentation digit only: it goes with
+    // their images (see FrameMetadata), for the consumer to tell them apart
+    size_t model{ 0 };
+    uint64_t camera{ 0 }, intrinsics{ 0 }, light{ 0 }, augmentation{ 0 };
+    // the seed of the frame, a function of (job seed, index) like its jitter: saved with its images, for the consumers'
+    // own random draws (e.g. the augmentations), so that a dataset is reproducible to the last draw
+    uint64_t seed{ 0 };
+    // their values
+    glm::mat4 view{ 1.0f };     // world to camera
+    glm::vec3 camPos{ 0.0f };
+    glm::vec3 lightDir{ 0.0f };
+    Intrinsics sensor;
+};
+
+struct JobSpec {
+    std::vector<std::string> models;
+    uint64_t cameras{ 1 };
+    float cameraRadius{ 3.0f };
+    float cameraElevation[2]{ 0.0f, 0.0f };     // degrees, min max
+    glm::vec3 cameraTarget{ 0.0f };
+    uint64_t intrinsicsVariants{ 1 };
+    Intrinsics sensor;
+    IntrinsicsSampler jitter;   // its ranges only, the variants do not use its generator
+    uint64_t lights{ 1 };
+    float lightElevation[2]{ 0.0f, 0.0f };
+    uint64_t augmentations{ 1 };
+    float cameraJitter{ 0.0f };     // the camera moves by up to this distance, still looking at the target
+    float lightJitter{ 0.0f };      // degrees, on the elevation and the azimuth of the light
+    uint64_t seed{ 0 };
+
+    // the number of frames of the job
+    uint64_t size() const
+    {
+        return static_cast<uint64_t>(models.size()) * cameras * intrinsicsVariants * lights * augmentations;
+    }
+
+    FrameDescriptor frame(uint64_t index) const
+    {
+        FrameDescriptor frame;
+        frame.index = index;
+        frame.augmentation = index % augmentations; index /= augmentations;
+        frame.light = index % lights; index /= lights;
+        frame.intrinsics = index % intrinsicsVariants; index /= intrinsicsVariants;
+        frame.camera = index % cameras; index /= cameras;
+        frame.model = static_cast<size_t>(index);
+
+        // the draws are always made, in the same order, whatever is jittered
+        CounterRng rng(seed, frame.index);
+        glm::vec3 offset;
+        do offset = glm::vec3(rng.uniform(-1.0f, 1.0f), rng.uniform(-1.0f, 1.0f), rng.uniform(-1.0f, 1.0f));
+        while (glm::dot(offset, offset) > 1.0f);    // uniform in the ball
+        float lightOffset[2] = { rng.uniform(-1.0f, 1.0f), rng.uniform(-1.0f, 1.0f) };
+        uint32_t words[4];
+        rng.block(~uint64_t(0), words);     // the last block of the stream, far from the draws above
+        frame.seed = static_cast<uint64_t>(words[0]) | static_cast<uint64_t>(words[1]) << 32;
+
+        frame.camPos = cameraTarget + cameraRadius * spiral(frame.camera, cameras, cameraElevation) + cameraJitter * offset;
+        frame.view = glm::lookAt(frame.camPos, cameraTarget, glm::vec3(0.0f, 1.0f, 0.0f));
+        frame.lightDir = jittered(spiral(frame.light, lights, lightElevation), lightJitter * lightOffset[0], lightJitter * lightOffset[1]);
+        frame.sensor = variant(frame.intrinsics);
+        return frame;
+    }
+
+private:
+    // point k of n on the unit sphere, between two elevations (degrees, from the xz plane towards +y): equal areas per
+    // point along the elevation, golden angle steps along the azimuth
+    static glm::vec3 spiral(uint64_t k, uint64_t n, const float elevation[2])
+    {
+        const double pi = 3.14159265358979323846, golden = pi * (3.0 - std::sqrt(5.0));
+        double y0 = std::sin(elevation[0] * pi / 180.0), y1 = std::sin(elevation[1] * pi / 180.0);
+        double y = y0 + (y1 - y0) * (static_cast<double>(k) + 0.5) / static_cast<double>(n);
+        double r = std::sqrt(std::max(0.0, 1.0 - y * y));
+        double azimuth = std::fmod(golden * static_cast<double>(k), 2.0 * pi);
+        return glm::vec3(static_cast<float>(r * std::sin(azimuth)), static_cast<float>(y), static_cast<float>(r * std::cos(azimuth)));
+    }
+
+    // a direction moved by some degrees of elevation (clamped at the poles) and azimuth
+    static glm::vec3 jittered(const glm::vec3& direction, float elevation, float azimuth)
+    {
+        if (elevation == 0.0f && azimuth == 0.0f) return direction;
+        const double pi = 3.14159265358979323846;
+        double e = std::asin(std::clamp(static_cast<double>(direction.y), -1.0, 1.0)) + elevation * pi / 180.0;
+        double a = std::atan2(static_cast<double>(direction.x), static_cast<double>(direction.z)) + azimuth * pi / 180.0;
+        e = std::clamp(e, -pi / 2.0, pi / 2.0);
+        return glm::vec3(static_cast<float>(std::cos(e) * std::sin(a)), static_cast<float>(std::sin(e)), static_cast<float>(std::cos(e) * std::cos(a)));
+    }
+
+    // the radical inverse of k in a prime base: a low-discrepancy sequence in [0, 1)
+    static double halton(uint64_t k, uint64_t base)
+    {
+        double result = 0.0, f = 1.0;
+        for (; k > 0; k /= base)
+        {
+            f /= static_cast<double>(base);
+            result += f * static_cast<double>(k % base);
+        }
+        return result;
+    }
+
+    // variant 0 is the sensor itself
+    Intrinsics variant(uint64_t k) const
+    {
+        Intrinsics sampled = sensor;
+        if (k == 0) return sampled;
+        float scale = 1.0f + jitter.focalJitter * static_cast<float>(2.0 * halton(k, 2) - 1.0);
+        sampled.fx *= scale;
+        sampled.fy *= scale;
+        sampled.cx += jitter.principalJitter * static_cast<float>(2.0 * halton(k, 3) - 1.0);
+        sampled.cy += jitter.principalJitter * static_cast<float>(2.0 * halton(k, 5) - 1.0);
+        return sampled;
+    }
+};
+
+// Reads "key = value" lines (# starts a comment), like loadCameraConfig. Keys:
+//   model = path                   one line per model, at least one (or a procedural scene, see procedural_scene.h)
+//   cameras = n                    positions per model, on a sphere around camera_target
+//   camera_radius = r
+//   camera_elevation = min max     degrees, within [-85, 85] (the camera looks at the target with +y up)
+//   camera_target = x y z
+//   camera_config = path           the sensor and its jitter (see loadCameraConfig), conf.h otherwise
+//   intrinsics = n                 variants of the sensor, the first one unjittered
+//   lights = n
+//   light_elevation = min max      degrees
+//   augmentations = n              copies of every frame, for the consumers which augment the images
+//   camera_jitter = d              random move of every camera, up to this distance
+//   light_jitter = degrees         random move of every light, up to this many degrees of elevation and azimuth
+//   seed = s                       of the random moves
+// Unsigned values with a sign are an error: >> would read "-1" as 2^64 - 1.
+inline bool loadJobSpec(const std::string& path, JobSpec& spec)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cout << "ERROR::JOB_SPEC:: cannot open " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line))
+    {
+        line = line.substr(0, line.find('#'));
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key;
+        std::stringstream(line.substr(0, eq)) >> key;
+        std::stringstream value(line.substr(eq + 1));
+        auto count = [&](uint64_t& out) {
+            if ((value >> std::ws).peek() == '-') value.setstate(std::ios::failbit);
+            else value >> out;
+        };
+        if (key == "model") { std::string model; value >> model; spec.models.push_back(model); }
+        else if (key == "cameras") count(spec.cameras);
+        else if (key == "camera_radius") value >> spec.cameraRadius;
+        else if (key == "camera_elevation") value >> spec.cameraElevation[0] >> spec.cameraElevation[1];
+        else if (key == "camera_target") value >> spec.cameraTarget.x >> spec.cameraTarget.y >> spec.cameraTarget.z;
+        else if (key == "camera_config")
+        {
+            std::string config;
+            value >> config;
+            if (!loadCameraConfig(config, spec.sensor, spec.jitter)) return false;
+        }
+        else if (key == "intrinsics") count(spec.intrinsicsVariants);
+        else if (key == "lights") count(spec.lights);
+        else if (key == "light_elevation") value >> spec.lightElevation[0] >> spec.lightElevation[1];
+        else if (key == "augmentations") count(spec.augmentations);
+        else if (key == "camera_jitter") value >> spec.cameraJitter;
+        else if (key == "light_jitter") value >> spec.lightJitter;
+        else if (key == "seed") count(spec.seed);
+        else
+        {
+            std::cout << "Unknown job spec key " << key << ", ignored" << std::endl;
+            continue;
+        }
+        if (!value)
+        {
+            std::cout << "ERROR::JOB_SPEC:: bad value for " << key << " in " << path << std::endl;
+            return false;
+        }
+    }
+
+    if (spec.models.empty() || spec.cameras == 0 || spec.intrinsicsVariants == 0 || spec.lights == 0 || spec.augmentations == 0)
+    {
+        std::cout << "ERROR::JOB_SPEC:: " << path << " needs at least one model, and no empty axis" << std::endl;
+        return false;
+    }
+    for (float& elevation : spec.cameraElevation) elevation = std::clamp(elevation, -85.0f, 85.0f);
+    // the size must fit in 64 bits
+    uint64_t size = spec.models.size();
+    for (uint64_t axis : { spec.cameras, spec.intrinsicsVariants, spec.lights, spec.augmentations })
+    {
+        if (size > std::numeric_limits<uint64_t>::max() / axis)
+        {
+            std::cout << "ERROR::JOB_SPEC:: " << path << " has more than 2^64 frames" << std::endl;
+            return false;
+        }
+        size *= axis;
+    }
+    return true;
+}
+
+// One of count processes (or machines) sharing a job: the frames are split in count contiguous ranges (contiguous, so that
+// a shard loads few models), shard index taking range index. Every frame is in exactly one shard.
+struct Shard {
+    uint64_t index{ 0 };
+    uint64_t count{ 1 };
+
+    // the frames of the shard among [first, end)
+    void range(uint64_t first, uint64_t end, uint64_t& shardFirst, uint64_t& shardEnd) const
+    {
+        uint64_t frames = end - first, base = frames / count, extra = frames % count;    // the first extra shards get one more
+        shardFirst = first + index * base + std::min(index, extra);
+        shardEnd = shardFirst + base + (index < extra ? 1 : 0);
+    }
+
+    // "k/N", 0 <= k < N
+    static bool parse(const std::string& text, Shard& shard)
+    {
+        std::stringstream in(text);
+        char slash = 0;
+        unsigned long long k = 0, n = 0;
+        if (!(in >> k >> slash >> n) || slash != '/' || n == 0 || k >= n || !(in >> std::ws).eof())
+        {
+            std::cout << "ERROR::JOB_SPEC:: bad " << text << ", expected k/N with 0 <= k < N" << std::endl;
+            return false;
+        }
+        shard.index = k;
+        shard.count = n;
+        return true;
+    }
+};
+
+// the frames [first, first + count) of a job (count 0: up to its end), or the share of them of a shard
+inline void jobRange(const JobSpec& spec, uint64_t first, uint64_t count, const Shard& shard, uint64_t& rangeFirst, uint64_t& rangeEnd)
+{
+    const uint64_t size = spec.size();
+    first = std::min(first, size);
+    uint64_t end = count == 0 || count > size - first ? size : first + count;
+    shard.range(first, end, rangeFirst, rangeEnd);
+}
+
+#endif
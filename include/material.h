@@ -0,0 +1,172 @@
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include <glad/glad.h>
+
+#include <mesh.h>
+#include <shaderClass.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Resolves the material samplers of each program once, and binds textures only when the state actually changes.
+//
+// Every sampler name used by the materials (material.texture_diffuse1, material.texture_specular1, ...) gets its own fixed
+// texture unit, in the order in which they are first seen. So the sampler uniforms of a program are set once, the first time
+// the program draws something, and binding a material is just a glBindTexture for each unit whose texture differs.
+class MaterialSystem {
+public:
+    // a texture bound to a fixed unit
+    struct Binding {
+        GLuint unit;
+        GLuint texture;
+    };
+    struct Material {
+        vector<Binding> bindings;
+    };
+
+    // returns the id of the material made of these textures (the same for equal texture sets)
+    unsigned int registerMaterial(const vector<Texture>& textures)
+    {
+        Material material;
+        unsigned int diffuseNr  = 1;
+        unsigned int specularNr = 1;
+        unsigned int normalNr   = 1;
+        unsigned int heightNr   = 1;
+        for (const Texture& texture : textures)
+        {
+            // retrieve texture number (the N in diffuse_textureN)
+            string number;
+            if (texture.type == "texture_diffuse")       number = std::to_string(diffuseNr++);
+            else if (texture.type == "texture_specular") number = std::to_string(specularNr++);
+            else if (texture.type == "texture_normal")   number = std::to_string(normalNr++);
+            else if (texture.type == "texture_height")   number = std::to_string(heightNr++);
+            material.bindings.push_back({ samplerUnit("material." + texture.type + number), texture.id });
+        }
+
+        for (unsigned int id = 0; id < materials.size(); ++id)
+            if (sameBindings(materials[id], material)) return id;
+        materials.push_back(material);
+        return static_cast<unsigned int>(materials.size() - 1);
+    }
+
+    // makes the material current for the shader, issuing only the GL calls which change something
+    void bind(Shader& shader, unsigned int id)
+    {
+        if (shader.ID != currentProgram)
+        {
+            configureProgram(shader.ID);
+            currentProgram = shader.ID;
+        }
+        if (id == currentMaterial) return;
+        for (const Binding& binding : materials[id].bindings)
+        {
+            if (boundTextures.size() <= binding.unit) boundTextures.resize(binding.unit + 1, 0);
+            if (boundTextures[binding.unit] == binding.texture) continue;
+            glActiveTexture(GL_TEXTURE0 + binding.unit);
+            glBindTexture(GL_TEXTURE_2D, binding.texture);
+            boundTextures[binding.unit] = binding.texture;
+        }
+        currentMaterial = id;
+    }
+
+    // forget what we think is bound: to be called when someone else may have touched the texture units
+    void invalidate()
+    {
+        boundTextures.clear();
+        currentProgram = 0;
+        currentMaterial = NO_MATERIAL;
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // to be called before drawing with the current context (one per thread). Outside of the materials, textures are only
+    // bound on unit 0 (the screen quads, the readbacks, the texture uploads), so that is the only unit to forget, unless
+    // another MaterialSystem drew on this thread since our last pass: then it may have bound any unit
+    void beginPass()
+    {
+        uint64_t& last = lastOnThread();
+        if (last != id) invalidate();
+        else
+        {
+            if (!boundTextures.empty()) boundTextures[0] = 0;
+            currentMaterial = NO_MATERIAL;
+            glActiveTexture(GL_TEXTURE0);
+        }
+        last = id;
+    }
+
+    size_t size() const { return materials.size(); }
+
+    // the same materials, with no binding state: for another GL context (the binding state is per context). Only reads
+    // the material definitions, so it can run while the original binds
+    MaterialSystem forContext() const
+    {
+        MaterialSystem copy;
+        copy.materials = materials;
+        copy.samplerNames = samplerNames;
+        return copy;
+    }
+
+private:
+    static constexpr unsigned int NO_MATERIAL{ ~0u };
+
+    vector<Material> materials;
+    vector<string> samplerNames;    // sampler name of every unit
+    std::unordered_map<GLuint, size_t> configuredSamplers;   // program -> number of sampler uniforms already set
+
+    vector<GLuint> boundTextures;   // what we bound to every unit
+    GLuint currentProgram{ 0 };
+    unsigned int currentMaterial{ NO_MATERIAL };
+    uint64_t id{ nextId() };        // tells the binding states apart, see beginPass (a copy from forContext gets its own)
+
+    static uint64_t nextId()
+    {
+        static std::atomic<uint64_t> next{ 1 };
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // the binding state which drew last on this thread
+    static uint64_t& lastOnThread()
+    {
+        thread_local uint64_t last = 0;
+        return last;
+    }
+
+    GLuint samplerUnit(const string& name)
+    {
+        for (GLuint unit = 0; unit < samplerNames.size(); ++unit)
+            if (samplerNames[unit] == name) return unit;
+        samplerNames.push_back(name);
+        return static_cast<GLuint>(samplerNames.size() - 1);
+    }
+
+    // points the samplers of the program to their units. Done once per program (and per newly seen sampler name)
+    void configureProgram(GLuint program)
+    {
+        size_t& configured = configuredSamplers[program];
+        if (configured == samplerNames.size()) return;
+        GLint previous;
+        glGetIntegerv(GL_CURRENT_PROGRAM, &previous);
+        if (static_cast<GLuint>(previous) != program) glUseProgram(program);
+        for (size_t unit = configured; unit < samplerNames.size(); ++unit)
+        {
+            GLint location = glGetUniformLocation(program, samplerNames[unit].c_str());
+            if (location != -1) glUniform1i(location, static_cast<GLint>(unit));
+        }
+        if (static_cast<GLuint>(previous) != program) glUseProgram(previous);
+        configured = samplerNames.size();
+    }
+
+    static bool sameBindings(const Material& a, const Material& b)
+    {
+        if (a.bindings.size() != b.bindings.size()) return false;
+        for (size_t i = 0; i < a.bindings.size(); ++i)
+            if (a.bindings[i].unit != b.bindings[i].unit || a.bindings[i].texture != b.bindings[i].texture) return false;
+        return true;
+    }
+};
+
+#endif
@@ -9,6 +9,7 @@
 #include <shaderClass.h>
 
 #include <string>
+#include <utility>
 #include <vector>
 using namespace std;
 
@@ -39,85 +40,90 @@ struct Texture {
 
 class Mesh {
 public:
-    // mesh Data
+    // mesh Data (vertices and indices may be released once on the GPU, see releaseCPUData)
     vector<Vertex>       vertices;
     vector<unsigned int> indices;
     vector<Texture>      textures;
-    unsigned int VAO;
-
-    // constructor
-    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
+    size_t vertexCount{ 0 };
+    size_t indexCount{ 0 };
+    unsigned int VAO{ 0 };
+    GLenum indexType{ GL_UNSIGNED_INT };    // narrowed to GL_UNSIGNED_SHORT in setupMesh when the vertices allow it
+    unsigned int material{ 0 };     // id in the MaterialSystem of the owning model
+
+    // constructor, upload = false leaves the GPU side to someone else (e.g. a MeshBatch).
+    // The data is taken by value and moved in: pass it with std::move to avoid any copy
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, bool upload = true)
+        : vertices(std::move(vertices)), indices(std::move(indices)), textures(std::move(textures))
     {
-        this->vertices = vertices;
-        this->indices = indices;
-        this->textures = textures;
+        vertexCount = this->vertices.size();
+        indexCount = this->indices.size();
 
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
-        setupMesh();
+        if (upload) setupMesh();
     }
 
-    // render the mesh
-    void Draw(Shader &shader) 
+    // the mesh owns its VAO and buffers (the textures belong to the model): move it, don't copy it
+    ~Mesh()
+    {
+        release();
+    }
+    Mesh(const Mesh&) = delete;
+    Mesh& operator=(const Mesh&) = delete;
+    Mesh(Mesh&& other) noexcept
+    {
+        *this = std::move(other);
+    }
+    Mesh& operator=(Mesh&& other) noexcept
     {
-        // bind appropriate textures
-        unsigned int diffuseNr  = 1;
-        unsigned int specularNr = 1;
-        unsigned int normalNr   = 1;
-        unsigned int heightNr   = 1;
-        for(unsigned int i = 0; i < textures.size(); i++)
+        if (this != &other)
         {
-            glActiveTexture(GL_TEXTURE0 + i); // active proper texture unit before binding
-            // retrieve texture number (the N in diffuse_textureN)
-            string number;
-            string name = textures[i].type;
-            if(name == "texture_diffuse")
-                number = std::to_string(diffuseNr++);
-            else if(name == "texture_specular")
-                number = std::to_string(specularNr++); // transfer unsigned int to string
-            else if(name == "texture_normal")
-                number = std::to_string(normalNr++); // transfer unsigned int to string
-            else if(name == "texture_height")
-                number = std::to_string(heightNr++); // transfer unsigned int to string
-
-            // now set the sampler to the correct texture unit
-            glUniform1i(glGetUniformLocation(shader.ID, ("material." + name + number).c_str()), i);
-            // and finally bind the texture
-            glBindTexture(GL_TEXTURE_2D, textures[i].id);
+            release();
+            vertices = std::move(other.vertices);
+            indices = std::move(other.indices);
+            textures = std::move(other.textures);
+            vertexCount = other.vertexCount;
+            indexCount = other.indexCount;
+            VAO = other.VAO;
+            VBO = other.VBO;
+            EBO = other.EBO;
+            indexType = other.indexType;
+            material = other.material;
+            other.VAO = other.VBO = other.EBO = 0;
         }
-        
-        // draw mesh
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-        // always good practice to set everything back to defaults once configured.
-        glActiveTexture(GL_TEXTURE0);
+        return *this;
     }
 
-private:
-    // render data 
-    unsigned int VBO, EBO;
-
-    // initializes all the buffer objects/arrays
-    void setupMesh()
+    // render the mesh with whatever textures are bound (see MaterialSystem::bind). vao: one from createVAO, to draw in
+    // another context than the one which uploaded the mesh (0: the mesh's own)
+    void DrawGeometry(GLuint vao = 0) const
     {
-        // create buffers/arrays
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-        glGenBuffers(1, &EBO);
+        glBindVertexArray(vao ? vao : VAO);
+        glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(indexCount), indexType, 0);
+    }
 
-        glBindVertexArray(VAO);
-        // load data into vertex buffers
+    // a vertex array for the buffers of the mesh, in the current context: buffers are shared between contexts, VAOs are not
+    GLuint createVAO() const
+    {
+        GLuint vao;
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        // A great thing about structs is that their memory layout is sequential for all its items.
-        // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
-        // again translates to 3/2 floats which translates to a byte array.
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);  
-
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        setVertexAttributes();
+        glBindVertexArray(0);
+        return vao;
+    }
 
-        // set the vertex attribute pointers
+    // frees the CPU copy of the geometry, once uploaded (by setupMesh or by a MeshBatch): the GPU has its own
+    void releaseCPUData()
+    {
+        vector<Vertex>().swap(vertices);
+        vector<unsigned int>().swap(indices);
+    }
+
+    // sets the vertex attribute pointers of the Vertex layout on the currently bound VAO and GL_ARRAY_BUFFER
+    static void setVertexAttributes()
+    {
         // vertex Positions
         glEnableVertexAttribArray(0);	
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
@@ -140,6 +146,53 @@ private:
 		// weights
 		glEnableVertexAttribArray(6);
 		glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, m_Weights));
+    }
+
+private:
+    // render data 
+    unsigned int VBO{ 0 }, EBO{ 0 };
+
+    // deletes the GPU objects, if any
+    void release()
+    {
+        if (VAO) glDeleteVertexArrays(1, &VAO);
+        if (VBO) glDeleteBuffers(1, &VBO);
+        if (EBO) glDeleteBuffers(1, &EBO);
+        VAO = VBO = EBO = 0;
+    }
+
+    // initializes all the buffer objects/arrays
+    void setupMesh()
+    {
+        // create buffers/arrays
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+        glGenBuffers(1, &EBO);
+
+        glBindVertexArray(VAO);
+        // load data into vertex buffers
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        // A great thing about structs is that their memory layout is sequential for all its items.
+        // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
+        // again translates to 3/2 floats which translates to a byte array.
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);  
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        if (vertices.size() <= 65536)
+        {
+            // 16 bit indices are enough: half the index memory and bandwidth
+            vector<unsigned short> shortIndices(indices.begin(), indices.end());
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(unsigned short), &shortIndices[0], GL_STATIC_DRAW);
+            indexType = GL_UNSIGNED_SHORT;
+        }
+        else
+        {
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+            indexType = GL_UNSIGNED_INT;
+        }
+
+        // set the vertex attribute pointers
+        setVertexAttributes();
         glBindVertexArray(0);
     }
 };
@@ -0,0 +1,225 @@
+#ifndef MESH_BATCH_H
+#define MESH_BATCH_H
+
+#include <glad/glad.h>
+
+#include <material.h>
+#include <mesh.h>
+#include <shaderClass.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Layout of the commands read by glMultiDrawElementsIndirect, see the OpenGL 4.3 specification
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint  baseVertex;
+    GLuint baseInstance;
+};
+
+// Packs many meshes (all the meshes of a model, or of a whole scene) into one vertex and one index buffer, and draws them
+// with one glMultiDrawElementsIndirect per material, the textures being bound in between. Going down to a single call per
+// batch would take the shader indexing the textures of every draw (texture arrays of a common size, or bindless handles),
+// which the GL 3.3 shaders cannot do.
+class MeshBatch {
+public:
+    unsigned int VAO{ 0 };
+
+    MeshBatch() = default;
+    ~MeshBatch() { release(); }
+    MeshBatch(const MeshBatch&) = delete;
+    MeshBatch& operator=(const MeshBatch&) = delete;
+
+    // true if meshes of these many vertices and indices in total can be batched: the commands address them with a GLint
+    // baseVertex and a GLuint firstIndex (about 1.4G triangles). Larger models keep a buffer per mesh
+    static bool fits(uint64_t vertexCount, uint64_t indexCount)
+    {
+        return vertexCount <= static_cast<uint64_t>(INT32_MAX) && indexCount <= static_cast<uint64_t>(UINT32_MAX);
+    }
+
+    // appends meshes to the batch (they must outlive it). The GPU buffers are (re)created by build()
+    void add(const vector<Mesh>& meshes)
+    {
+        for (const Mesh& mesh : meshes) sources.push_back(&mesh);
+    }
+
+    // uploads everything added so far in shared buffers, with the draws grouped by material. Needs the CPU data of the
+    // meshes (see Mesh::releaseCPUData)
+    void build()
+    {
+        release();
+
+        // group the meshes by material, keeping the first appearance order
+        vector<vector<const Mesh*>> byMaterial;
+        for (const Mesh* mesh : sources)
+        {
+            size_t m = 0;
+            while (m < materials.size() && materials[m] != mesh->material) ++m;
+            if (m == materials.size())
+            {
+                materials.push_back(mesh->material);
+                byMaterial.emplace_back();
+            }
+            byMaterial[m].push_back(mesh);
+        }
+
+        // 16 bit indices work for all the draws if every sub-mesh is small enough, since indices are relative to baseVertex
+        size_t vertexCount = 0, indexCount = 0, maxMeshVertices = 0;
+        for (const Mesh* mesh : sources)
+        {
+            vertexCount += mesh->vertexCount;
+            indexCount += mesh->indexCount;
+            maxMeshVertices = std::max(maxMeshVertices, mesh->vertexCount);
+            if (mesh->vertices.size() != mesh->vertexCount || mesh->indices.size() != mesh->indexCount)
+            {
+                std::cout << "ERROR::MESH_BATCH:: a mesh has released its CPU data, cannot build" << std::endl;
+                return;
+            }
+        }
+        if (!fits(vertexCount, indexCount))
+        {
+            std::cout << "ERROR::MESH_BATCH:: " << vertexCount << " vertices and " << indexCount << " indices are too many for one batch, cannot build" << std::endl;
+            return;
+        }
+        indexType = maxMeshVertices <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+        const size_t indexBytes = indexType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+        glGenBuffers(1, &EBO);
+        glGenBuffers(1, &commandBuffer);
+
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(Vertex), NULL, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * indexBytes, NULL, GL_STATIC_DRAW);
+
+        // copy the sub-meshes one after the other, material group by material group
+        vector<unsigned short> shortIndices;
+        GLuint firstVertex = 0, firstIndex = 0;
+        for (size_t m = 0; m < byMaterial.size(); ++m)
+        {
+            groups.push_back({ commands.size(), 0 });
+            for (const Mesh* mesh : byMaterial[m])
+            {
+                glBufferSubData(GL_ARRAY_BUFFER, firstVertex * sizeof(Vertex), mesh->vertices.size() * sizeof(Vertex), mesh->vertices.data());
+                if (indexType == GL_UNSIGNED_SHORT)
+                {
+                    shortIndices.assign(mesh->indices.begin(), mesh->indices.end());
+                    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, firstIndex * indexBytes, shortIndices.size() * indexBytes, shortIndices.data());
+                }
+                else
+                    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, firstIndex * indexBytes, mesh->indices.size() * indexBytes, mesh->indices.data());
+
+                DrawElementsIndirectCommand command;
+                command.count = static_cast<GLuint>(mesh->indices.size());
+                command.instanceCount = 1;
+                command.firstIndex = firstIndex;
+                command.baseVertex = static_cast<GLint>(firstVertex);
+                command.baseInstance = 0;
+                commands.push_back(command);
+
+                firstVertex += static_cast<GLuint>(mesh->vertices.size());
+                firstIndex += static_cast<GLuint>(mesh->indices.size());
+                ++groups.back().drawCount;
+            }
+        }
+
+        setAttributes();
+        glBindVertexArray(0);
+
+        // indirect commands
+        multiDraw = GLAD_GL_VERSION_4_3 != 0;
+        if (multiDraw)
+        {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        }
+    }
+
+    // a vertex array for the buffers of the batch, in the current context: buffers are shared between contexts, VAOs are not
+    GLuint createVAO() const
+    {
+        GLuint vao;
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        setAttributes();
+        glBindVertexArray(0);
+        return vao;
+    }
+
+    // draws all the meshes of the batch: one call per material, whatever the number of sub-meshes.
+    // vao: one from createVAO, to draw in another context than the one which built the batch (0: the batch's own)
+    void Draw(Shader& shader, MaterialSystem& materialSystem, GLuint vao = 0) const
+    {
+        glBindVertexArray(vao ? vao : VAO);
+        if (multiDraw) glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+        for (size_t m = 0; m < groups.size(); ++m)
+        {
+            materialSystem.bind(shader, materials[m]);
+            const Group& group = groups[m];
+            if (multiDraw)
+            {
+                glMultiDrawElementsIndirect(GL_TRIANGLES, indexType, (void*)(group.firstCommand * sizeof(DrawElementsIndirectCommand)), group.drawCount, 0);
+            }
+            else
+            {
+                // same commands, issued one by one (no GL 4.3 available)
+                const size_t indexBytes = indexType == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+                for (size_t c = group.firstCommand; c < group.firstCommand + group.drawCount; ++c)
+                {
+                    const DrawElementsIndirectCommand& command = commands[c];
+                    glDrawElementsBaseVertex(GL_TRIANGLES, command.count, indexType, (void*)(command.firstIndex * indexBytes), command.baseVertex);
+                }
+            }
+        }
+        if (multiDraw) glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+
+    size_t drawCount() const { return commands.size(); }
+    size_t materialCount() const { return materials.size(); }
+
+private:
+    struct Group {
+        size_t firstCommand;
+        GLsizei drawCount;
+    };
+
+    vector<const Mesh*> sources;    // all the meshes added to the batch
+    vector<unsigned int> materials;     // MaterialSystem ids of the groups
+    vector<Group> groups;   // one per material, same order as materials
+    vector<DrawElementsIndirectCommand> commands;
+    GLenum indexType{ GL_UNSIGNED_INT };
+    bool multiDraw{ false };
+
+    unsigned int VBO{ 0 }, EBO{ 0 }, commandBuffer{ 0 };
+
+    // the vertex layout, on the bound VAO
+    void setAttributes() const
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        Mesh::setVertexAttributes();
+    }
+
+    // deletes the GPU objects of a previous build
+    void release()
+    {
+        if (VAO) glDeleteVertexArrays(1, &VAO);
+        unsigned int buffers[] = { VBO, EBO, commandBuffer };
+        for (unsigned int buffer : buffers) if (buffer) glDeleteBuffers(1, &buffer);
+        VAO = VBO = EBO = commandBuffer = 0;
+        materials.clear();
+        groups.clear();
+        commands.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <glm/glm.hpp>
+
+#include <mesh.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+// Post-import mesh optimizations: vertex welding, post-transform cache and overdraw reordering, vertex fetch reordering.
+// All the functions work on the same vertices/indices vectors that Mesh uploads, so they can run right after processMesh.
+namespace meshopt {
+
+    // size of the FIFO post-transform cache we simulate to compute the ACMR
+    constexpr unsigned int CACHE_SIZE{ 16 };
+
+    // some numbers to compare a mesh before and after the optimization
+    struct MeshStats {
+        size_t vertexCount{ 0 };
+        size_t indexCount{ 0 };
+        float acmr{ 0.0f };     // average cache miss ratio: transformed vertices per triangle (0.5 is the ideal, 3 the worst)
+        size_t bytes{ 0 };      // GPU memory for vertices and indices
+    };
+
+    // bytes per index which Mesh will use when uploading, see Mesh::setupMesh
+    inline size_t indexSize(size_t vertexCount)
+    {
+        return vertexCount <= 65536 ? sizeof(unsigned short) : sizeof(unsigned int);
+    }
+
+    // simulates a FIFO cache of size cacheSize and returns the number of cache misses per triangle
+    inline float computeACMR(const std::vector<unsigned int>& indices, size_t vertexCount, unsigned int cacheSize = CACHE_SIZE)
+    {
+        if (indices.size() < 3) return 0.0f;
+
+        std::vector<unsigned int> timestamps(vertexCount, 0);  // time at which a vertex entered the cache (0 = never)
+        unsigned int time = cacheSize + 1;
+        size_t misses = 0;
+        for (unsigned int index : indices)
+        {
+            if (time - timestamps[index] > cacheSize)
+            {
+                timestamps[index] = time++;
+                ++misses;
+            }
+        }
+        return static_cast<float>(misses) / static_cast<float>(indices.size() / 3);
+    }
+
+    inline MeshStats computeStats(const std::vector<Vertex>& vertices, const std::vector<unsigned int>& indices)
+    {
+        MeshStats stats;
+        stats.vertexCount = vertices.size();
+        stats.indexCount = indices.size();
+        stats.acmr = computeACMR(indices, vertices.size());
+        stats.bytes = vertices.size() * sizeof(Vertex) + indices.size() * indexSize(vertices.size());
+        return stats;
+    }
+
+    // hashes and compares only the attributes we actually fill during import (the bone data is left uninitialized by processMesh).
+    // The hash must agree with VertexEqual, which compares with ==: -0 hashes as +0 (they are equal). A NaN is equal to
+    // nothing, not even itself, so vertices with one are never welded, whatever their hash
+    struct VertexHasher {
+        size_t operator()(const Vertex& v) const
+        {
+            const float* f = &v.Position.x;
+            size_t h = 14695981039346656037ull;
+            auto combine = [&h](const float* data, size_t n) {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    unsigned int bits = 0;
+                    if (data[i] != 0.0f) std::memcpy(&bits, &data[i], sizeof(bits));
+                    h ^= bits;
+                    h *= 1099511628211ull;
+                }
+            };
+            combine(f, 3);
+            combine(&v.Normal.x, 3);
+            combine(&v.TexCoords.x, 2);
+            return h;
+        }
+    };
+    struct VertexEqual {
+        bool operator()(const Vertex& a, const Vertex& b) const
+        {
+            return a.Position == b.Position && a.Normal == b.Normal && a.TexCoords == b.TexCoords
+                && a.Tangent == b.Tangent && a.Bitangent == b.Bitangent;
+        }
+    };
+
+    // merges vertices with identical attributes, rewriting the index buffer accordingly
+    inline void weldVertices(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices)
+    {
+        std::unordered_map<Vertex, unsigned int, VertexHasher, VertexEqual> unique;
+        unique.reserve(vertices.size());
+
+        std::vector<unsigned int> remap(vertices.size());
+        std::vector<Vertex> welded;
+        welded.reserve(vertices.size());
+        for (size_t i = 0; i < vertices.size(); ++i)
+        {
+            auto it = unique.find(vertices[i]);
+            if (it == unique.end())
+            {
+                remap[i] = static_cast<unsigned int>(welded.size());
+                unique.emplace(vertices[i], remap[i]);
+                welded.push_back(vertices[i]);
+            }
+            else remap[i] = it->second;
+        }
+        for (unsigned int& index : indices) index = remap[index];
+        vertices.swap(welded);
+    }
+
+    // Tom Forsyth's linear-speed vertex cache optimization: https://tomforsyth1000.github.io/papers/fast_vert_cache_opt.html
+    // Greedily emits the triangle with the highest score, where the score of a vertex depends on its position in a simulated
+    // LRU cache and on the number of triangles still using it.
+    inline void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount)
+    {
+        const size_t triangleCount = indices.size() / 3;
+        if (triangleCount == 0) return;
+
+        constexpr int cacheSize = 32;
+        auto vertexScore = [](int cachePosition, unsigned int liveTriangles) {
+            if (liveTriangles == 0) return -1.0f;   // no triangles need this vertex anymore
+            float score = 0.0f;
+            if (cachePosition >= 0)
+            {
+                if (cachePosition < 3) score = 0.75f;  // the last triangle's vertices get a fixed score, so that we don't just repeat it
+                else score = std::pow(1.0f - (cachePosition - 3) * (1.0f / (cacheSize - 3)), 1.5f);
+            }
+            score += 2.0f * std::pow(static_cast<float>(liveTriangles), -0.5f); // boost vertices with few triangles left, to get rid of them
+            return score;
+        };
+
+        // adjacency: for each vertex, the triangles which use it
+        std::vector<unsigned int> liveTriangles(vertexCount, 0);
+        for (unsigned int index : indices) ++liveTriangles[index];
+        std::vector<unsigned int> offsets(vertexCount + 1, 0);
+        for (size_t v = 0; v < vertexCount; ++v) offsets[v + 1] = offsets[v] + liveTriangles[v];
+        std::vector<unsigned int> adjacency(indices.size());
+        std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t t = 0; t < triangleCount; ++t)
+            for (int k = 0; k < 3; ++k) adjacency[fill[indices[3 * t + k]]++] = static_cast<unsigned int>(t);
+
+        std::vector<float> vScore(vertexCount);
+        for (size_t v = 0; v < vertexCount; ++v) vScore[v] = vertexScore(-1, liveTriangles[v]);
+
+        std::vector<float> tScore(triangleCount);
+        for (size_t t = 0; t < triangleCount; ++t)
+            tScore[t] = vScore[indices[3 * t]] + vScore[indices[3 * t + 1]] + vScore[indices[3 * t + 2]];
+
+        std::vector<bool> emitted(triangleCount, false);
+        std::vector<unsigned int> result;
+        result.reserve(indices.size());
+        std::vector<unsigned int> cache, newCache;
+        cache.reserve(cacheSize + 3);
+        newCache.reserve(cacheSize + 3);
+
+        size_t nextCandidate = 0;   // fallback scan position when the cache yields no candidate
+        long long best = -1;
+        for (size_t emittedCount = 0; emittedCount < triangleCount; ++emittedCount)
+        {
+            if (best < 0)
+            {
+                // no candidate in cache: take the next triangle not yet emitted (happens only at disconnected components)
+                while (emitted[nextCandidate]) ++nextCandidate;
+                best = static_cast<long long>(nextCandidate);
+            }
+
+            const unsigned int t = static_cast<unsigned int>(best);
+            emitted[t] = true;
+
+            // emit the triangle, and remove it from the adjacency of its vertices
+            newCache.clear();
+            for (int k = 0; k < 3; ++k)
+            {
+                unsigned int v = indices[3 * t + k];
+                result.push_back(v);
+                newCache.push_back(v);
+                unsigned int* begin = &adjacency[offsets[v]];
+                unsigned int* end = begin + liveTriangles[v];
+                std::iter_swap(std::find(begin, end, t), end - 1);
+                --liveTriangles[v];
+            }
+            // the emitted vertices go to the front of the LRU cache
+            for (unsigned int v : cache)
+                if (v != newCache[0] && v != newCache[1] && v != newCache[2]) newCache.push_back(v);
+            for (size_t i = cacheSize; i < newCache.size(); ++i)
+            {
+                // evicted vertices lose their cache bonus
+                unsigned int v = newCache[i];
+                float newScore = vertexScore(-1, liveTriangles[v]);
+                for (unsigned int a = offsets[v]; a < offsets[v] + liveTriangles[v]; ++a) tScore[adjacency[a]] += newScore - vScore[v];
+                vScore[v] = newScore;
+            }
+            if (newCache.size() > static_cast<size_t>(cacheSize)) newCache.resize(cacheSize);
+            cache.swap(newCache);
+
+            // update the scores of the vertices in cache and of their triangles, and look for the next best one
+            best = -1;
+            float bestScore = -1.0f;
+            for (size_t i = 0; i < cache.size(); ++i)
+            {
+                unsigned int v = cache[i];
+                float newScore = vertexScore(static_cast<int>(i), liveTriangles[v]);
+                float delta = newScore - vScore[v];
+                vScore[v] = newScore;
+                for (unsigned int a = offsets[v]; a < offsets[v] + liveTriangles[v]; ++a)
+                {
+                    unsigned int tri = adjacency[a];
+                    tScore[tri] += delta;
+                    if (tScore[tri] > bestScore) { bestScore = tScore[tri]; best = tri; }
+                }
+            }
+        }
+        indices.swap(result);
+    }
+
+    // Overdraw reordering after Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw".
+    // The cache optimized stream is split into clusters where the cache is "reset"; clusters are then sorted so that
+    // those facing away from the mesh center (likely occluders) are drawn first. The result is kept only if the ACMR does not
+    // degrade more than threshold times.
+    inline void optimizeOverdraw(std::vector<unsigned int>& indices, const std::vector<Vertex>& vertices, float threshold = 1.05f)
+    {
+        const size_t triangleCount = indices.size() / 3;
+        if (triangleCount < 2) return;
+
+        // cluster boundaries: a new cluster starts at every triangle with three cache misses
+        std::vector<size_t> clusters;
+        {
+            std::vector<unsigned int> timestamps(vertices.size(), 0);
+            unsigned int time = CACHE_SIZE + 1;
+            for (size_t t = 0; t < triangleCount; ++t)
+            {
+                int misses = 0;
+                for (int k = 0; k < 3; ++k)
+                {
+                    unsigned int v = indices[3 * t + k];
+                    if (time - timestamps[v] > CACHE_SIZE) { timestamps[v] = time++; ++misses; }
+                }
+                if (t == 0 || misses == 3) clusters.push_back(t);
+            }
+        }
+        if (clusters.size() < 2) return;
+
+        glm::vec3 meshCenter(0.0f);
+        for (const Vertex& v : vertices) meshCenter += v.Position;
+        meshCenter /= static_cast<float>(vertices.size());
+
+        // sort key: how much the cluster faces outwards
+        std::vector<std::pair<float, size_t>> keys;
+        keys.reserve(clusters.size());
+        for (size_t c = 0; c < clusters.size(); ++c)
+        {
+            size_t begin = clusters[c], end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+            glm::vec3 centroid(0.0f), normal(0.0f);
+            for (size_t t = begin; t < end; ++t)
+            {
+                const glm::vec3& p0 = vertices[indices[3 * t]].Position;
+                const glm::vec3& p1 = vertices[indices[3 * t + 1]].Position;
+                const glm::vec3& p2 = vertices[indices[3 * t + 2]].Position;
+                glm::vec3 n = glm::cross(p1 - p0, p2 - p0);     // area weighted
+                normal += n;
+                centroid += (p0 + p1 + p2) * glm::length(n);
+            }
+            float area = glm::length(normal);
+            float key = 0.0f;
+            if (area > 0.0f) key = glm::dot(centroid / area - meshCenter, normal / area);
+            keys.emplace_back(key, c);
+        }
+        std::stable_sort(keys.begin(), keys.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+
+        std::vector<unsigned int> result;
+        result.reserve(indices.size());
+        for (const auto& key : keys)
+        {
+            size_t begin = clusters[key.second], end = key.second + 1 < clusters.size() ? clusters[key.second + 1] : triangleCount;
+            result.insert(result.end(), indices.begin() + 3 * begin, indices.begin() + 3 * end);
+        }
+
+        if (computeACMR(result, vertices.size()) <= threshold * computeACMR(indices, vertices.size()))
+            indices.swap(result);
+    }
+
+    // reorders the vertex buffer in order of first use by the index buffer (also drops unreferenced vertices)
+    inline void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices)
+    {
+        constexpr unsigned int unused = ~0u;
+        std::vector<unsigned int> remap(vertices.size(), unused);
+        std::vector<Vertex> result;
+        result.reserve(vertices.size());
+        for (unsigned int& index : indices)
+        {
+            if (remap[index] == unused)
+            {
+                remap[index] = static_cast<unsigned int>(result.size());
+                result.push_back(vertices[index]);
+            }
+            index = remap[index];
+        }
+        vertices.swap(result);
+    }
+
+    // the full pipeline: weld, cache, overdraw, fetch. Returns the stats before and after
+    inline std::pair<MeshStats, MeshStats> optimizeMesh(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices)
+    {
+        MeshStats before = computeStats(vertices, indices);
+
+        weldVertices(vertices, indices);
+        optimizeVertexCache(indices, vertices.size());
+        optimizeOverdraw(indices, vertices);
+        optimizeVertexFetch(vertices, indices);
+
+        return { before, computeStats(vertices, indices) };
+    }
+
+    // adds the stats of a mesh to those of a model, the ACMR weighted by the triangles
+    inline void accumulate(MeshStats& total, const MeshStats& mesh)
+    {
+        size_t triangles = total.indexCount / 3, more = mesh.indexCount / 3;
+        if (triangles + more > 0) total.acmr = (total.acmr * triangles + mesh.acmr * more) / static_cast<float>(triangles + more);
+        total.vertexCount += mesh.vertexCount;
+        total.indexCount += mesh.indexCount;
+        total.bytes += mesh.bytes;
+    }
+
+    // one line per model (see accumulate), not one per mesh
+    inline void printStats(const MeshStats& before, const MeshStats& after, size_t meshes)
+    {
+        std::cout << meshes << " meshes optimized: " << before.vertexCount << " -> " << after.vertexCount << " vertices, "
+            << "ACMR " << before.acmr << " -> " << after.acmr << ", "
+            << before.bytes / 1024 << " KB -> " << after.bytes / 1024 << " KB" << std::endl;
+    }
+}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef MODEL_IMPORT_H
+#define MODEL_IMPORT_H
+
+#include <glm/glm.hpp>
+#include <stb_image.h>
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+#include <mesh.h>
+#include <mesh_optimizer.h>
+#include <stage_timers.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "conf.h"
+
+using namespace std;
+
+// The CPU side of a model, as imported from file: no GL object is created here, so that the import can run on any thread
+// (see AssetStreamer) and the upload (see Model) is a separate step.
+
+// a decoded image, in the stb_image buffer
+struct ImageData {
+    string path;    // as written in the material, relative to the model directory
+    int width{ 0 }, height{ 0 }, components{ 0 };
+    std::unique_ptr<unsigned char, void(*)(void*)> pixels{ nullptr, stbi_image_free };    // null if decoding failed
+};
+
+// a texture of a mesh: which image, and what it is for (texture_diffuse, texture_specular, ...)
+struct TextureRef {
+    unsigned int image;     // index in ModelData::images
+    string type;
+};
+
+struct MeshData {
+    vector<Vertex> vertices;
+    vector<unsigned int> indices;
+    vector<TextureRef> textures;
+};
+
+struct ModelData {
+    string path;
+    string directory;
+    vector<MeshData> meshes;
+    vector<ImageData> images;   // each image once, whatever the number of meshes using it
+    bool valid{ false };
+    std::shared_ptr<void> backing;  // what the pixels point into, if they are not owned (see AssetCache)
+};
+
+// decodes an image file (the flip setting of stb_image applies)
+inline ImageData loadImage(const char *path, const string &directory)
+{
+    ScopedStage stage(Stage::TextureDecode);
+    ImageData image;
+    image.path = path;
+    string filename = directory + '/' + string(path);
+    image.pixels.reset(stbi_load(filename.c_str(), &image.width, &image.height, &image.components, 0));
+    if (!image.pixels)
+        std::cout << "Texture failed to load at path: " << path << std::endl;
+    return image;
+}
+
+// Assimp import, mesh optimization and image decoding
+class ModelImporter
+{
+public:
+    // loads a model with supported ASSIMP extensions from file: its meshes, and its textures decoded. Not valid on errors
+    ModelData import(string const &path)
+    {
+        ScopedStage stage(Stage::Import);
+        ModelData data;
+        data.path = path;
+        // read file via ASSIMP
+        Assimp::Importer importer;
+        const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+        // check for errors
+        if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
+        {
+            cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << endl;
+            return data;
+        }
+        // retrieve the directory path of the filepath
+        data.directory = path.substr(0, path.find_last_of('/'));
+
+        // process ASSIMP's root node recursively
+        model = &data;
+        optimizedBefore = optimizedAfter = meshopt::MeshStats();
+        optimized = 0;
+        processNode(scene->mRootNode, scene);
+        if (optimized > 0) meshopt::printStats(optimizedBefore, optimizedAfter, optimized);
+        model = nullptr;
+        data.valid = true;
+        return data;
+    }
+
+private:
+    ModelData* model{ nullptr };    // the one being imported
+    meshopt::MeshStats optimizedBefore, optimizedAfter;     // of its meshes, summed
+    size_t optimized{ 0 };
+
+    // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
+    void processNode(aiNode *node, const aiScene *scene)
+    {
+        // process each mesh located at the current node
+        for(unsigned int i = 0; i < node->mNumMeshes; i++)
+        {
+            // the node object only contains indices to index the actual objects in the scene. 
+            // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
+            aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+            model->meshes.push_back(processMesh(mesh, scene));
+        }
+        // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
+        for(unsigned int i = 0; i < node->mNumChildren; i++)
+        {
+            processNode(node->mChildren[i], scene);
+        }
+
+    }
+
+    MeshData processMesh(aiMesh *mesh, const aiScene *scene)
+    {
+        // data to fill
+        vector<Vertex> vertices;
+        vector<unsigned int> indices;
+        vector<TextureRef> textures;
+        vertices.reserve(mesh->mNumVertices);
+        indices.reserve(static_cast<size_t>(mesh->mNumFaces) * 3);
+
+        // walk through each of the mesh's vertices
+        for(unsigned int i = 0; i < mesh->mNumVertices; i++)
+        {
+            Vertex vertex{};    // value initialized, so that unset attributes compare equal when welding
+            glm::vec3 vector; // we declare a placeholder vector since assimp uses its own vector class that doesn't directly convert to glm's vec3 class so we transfer the data to this placeholder glm::vec3 first.
+            // positions
+            vector.x = mesh->mVertices[i].x;
+            vector.y = mesh->mVertices[i].y;
+            vector.z = mesh->mVertices[i].z;
+            vertex.Position = vector;
+            // normals
+            if (mesh->HasNormals())
+            {
+                vector.x = mesh->mNormals[i].x;
+                vector.y = mesh->mNormals[i].y;
+                vector.z = mesh->mNormals[i].z;
+                vertex.Normal = vector;
+            }
+            // texture coordinates
+            if(mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
+            {
+                glm::vec2 vec;
+                // a vertex can contain up to 8 different texture coordinates. We thus make the assumption that we won't 
+                // use models where a vertex can have multiple texture coordinates so we always take the first set (0).
+                vec.x = mesh->mTextureCoords[0][i].x; 
+                vec.y = mesh->mTextureCoords[0][i].y;
+                vertex.TexCoords = vec;
+                // tangent
+                vector.x = mesh->mTangents[i].x;
+                vector.y = mesh->mTangents[i].y;
+                vector.z = mesh->mTangents[i].z;
+                vertex.Tangent = vector;
+                // bitangent
+                vector.x = mesh->mBitangents[i].x;
+                vector.y = mesh->mBitangents[i].y;
+                vector.z = mesh->mBitangents[i].z;
+                vertex.Bitangent = vector;
+            }
+            else
+                vertex.TexCoords = glm::vec2(0.0f, 0.0f);
+
+            vertices.push_back(vertex);
+        }
+        // now wak through each of the mesh's faces (a face is a mesh its triangle) and retrieve the corresponding vertex indices.
+        for(unsigned int i = 0; i < mesh->mNumFaces; i++)
+        {
+            aiFace face = mesh->mFaces[i];
+            // retrieve all indices of the face and store them in the indices vector
+            for(unsigned int j = 0; j < face.mNumIndices; j++)
+                indices.push_back(face.mIndices[j]);        
+        }
+        // weld, reorder for the post-transform cache and overdraw, reorder for vertex fetch
+        if (conf::optimize_meshes)
+        {
+            auto stats = meshopt::optimizeMesh(vertices, indices);
+            meshopt::accumulate(optimizedBefore, stats.first);
+            meshopt::accumulate(optimizedAfter, stats.second);
+            ++optimized;
+        }
+        // process materials
+        aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];    
+        // we assume a convention for sampler names in the shaders. Each diffuse texture should be named
+        // as 'texture_diffuseN' where N is a sequential number ranging from 1 to MAX_SAMPLER_NUMBER. 
+        // Same applies to other texture as the following list summarizes:
+        // diffuse: texture_diffuseN
+        // specular: texture_specularN
+        // normal: texture_normalN
+
+        // 1. diffuse maps
+        vector<TextureRef> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
+        textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
+        // 2. specular maps
+        vector<TextureRef> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
+        textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+        // 3. normal maps
+        vector<TextureRef> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
+        textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
+        // 4. height maps
+        vector<TextureRef> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
+        textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
+        
+        // return the extracted mesh data
+        return MeshData{ std::move(vertices), std::move(indices), std::move(textures) };
+    }
+
+    // checks all material textures of a given type and decodes the images if they're not decoded yet.
+    vector<TextureRef> loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
+    {
+        vector<TextureRef> textures;
+        for(unsigned int i = 0; i < mat->GetTextureCount(type); i++)
+        {
+            aiString str;
+            mat->GetTexture(type, i, &str);
+            // check if the image was decoded before: a texture is loaded once per model
+            unsigned int image = 0;
+            while (image < model->images.size() && model->images[image].path != str.C_Str()) ++image;
+            if (image == model->images.size())
+                model->images.push_back(loadImage(str.C_Str(), model->directory));
+            textures.push_back({ image, typeName });
+        }
+        return textures;
+    }
+};
+
+#endif
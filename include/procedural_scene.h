@@ -0,0 +1,409 @@
+#ifndef PROCEDURAL_SCENE_H
+#define PROCEDURAL_SCENE_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <model_import.h>
+#include <counter_rng.h>
+#include <stage_timers.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Scenes made in memory instead of imported, for the scaling benchmarks: from a thousand to a hundred million triangles,
+// without any model file. A scene is named by a path like a model file, so it goes wherever a model does (conf::models,
+// the model lines of a JobSpec, the benchmark scenarios), and is created by loadModelData as the ModelData an import
+// would give:
+//
+//     procedural:sphere?triangles=10M&layers=4&textures=8
+//
+// Shapes:
+//   sphere     UV spheres, one per layer, nested (the layers are concentric shells)
+//   grid       height fields, displaced by a few sine waves, one per layer, stacked along y
+//   clutter    small ellipsoids, scattered and rotated at random in a cube; the layers set their size
+// Keys (the counts take a K, M or G suffix):
+//   triangles = n          in total, approximately (the shapes round it to their own grid), up to 4G
+//   layers = n             depth complexity: the shells (sphere), height fields (grid) or ellipsoids (clutter, on
+//                          average) a ray through the middle of the scene goes through. A ray crosses a closed shell or
+//                          an ellipsoid twice, in and out: 2n surfaces, n of them facing it, for those two shapes
+//   textures = n           distinct images (procedural checkers), 0 for none; the meshes use them in turn
+//   texture_size = n       pixels per side
+//   meshes = n             at least this many meshes (by default one per layer or texture, whichever is more)
+//   instance_triangles = n of each ellipsoid of the clutter
+//   size = s               half the side of the cube the scene fits in, centered on the origin
+//   seed = s               of the displacements, the clutter and the textures
+// The other counts go up to 1M. A large scene is split in more meshes than asked for if needed: each one has at most
+// 256M triangles, so that its indices stay 32-bit. Past about 1.4G triangles a scene is too large for a MeshBatch, and its
+// meshes are drawn one by one (see Model).
+// The geometry is generated in cache-friendly order (row by row), so it is not run through the mesh optimizer: welding
+// and reordering a hundred million triangles would take longer than rendering them.
+
+enum class ProceduralShape { Sphere, Grid, Clutter };
+
+struct ProceduralScene {
+    ProceduralShape shape{ ProceduralShape::Sphere };
+    uint64_t triangles{ 100000 };
+    unsigned int layers{ 1 };
+    unsigned int textures{ 1 };
+    unsigned int textureSize{ 512 };
+    unsigned int meshes{ 0 };   // 0: one per layer or texture
+    unsigned int instanceTriangles{ 224 };
+    float size{ 1.0f };
+    uint64_t seed{ 0 };
+};
+
+inline bool isProceduralPath(const std::string& path)
+{
+    return path.compare(0, 11, "procedural:") == 0;
+}
+
+constexpr uint64_t MAX_PROCEDURAL_TRIANGLES{ 1ull << 32 };
+constexpr uint64_t MAX_PROCEDURAL_COUNT{ 1u << 20 };    // of the other counts: no sane scene has more
+
+// a count up to max, with an optional K, M or G suffix
+inline bool parseProceduralCount(const std::string& text, uint64_t max, uint64_t& count)
+{
+    char* end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || !std::isfinite(value) || value < 0.0) return false;
+    std::string suffix(end);
+    if (suffix == "K" || suffix == "k") value *= 1e3;
+    else if (suffix == "M" || suffix == "m") value *= 1e6;
+    else if (suffix == "G" || suffix == "g") value *= 1e9;
+    else if (!suffix.empty()) return false;
+    if (value > static_cast<double>(max)) return false;     // and llround of it is defined
+    count = static_cast<uint64_t>(std::llround(value));
+    return true;
+}
+
+// "procedural:shape?key=value&key=value", see above
+inline bool parseProceduralPath(const std::string& path, ProceduralScene& scene)
+{
+    if (!isProceduralPath(path)) return false;
+    std::string rest = path.substr(11);
+    size_t question = rest.find('?');
+    std::string shape = rest.substr(0, question);
+    if (shape == "sphere") scene.shape = ProceduralShape::Sphere;
+    else if (shape == "grid") scene.shape = ProceduralShape::Grid;
+    else if (shape == "clutter") scene.shape = ProceduralShape::Clutter;
+    else
+    {
+        std::cout << "ERROR::PROCEDURAL:: unknown shape " << shape << " in " << path << ", expected sphere, grid or clutter" << std::endl;
+        return false;
+    }
+    if (question == std::string::npos) return true;
+
+    std::stringstream pairs(rest.substr(question + 1));
+    std::string pair;
+    while (std::getline(pairs, pair, '&'))
+    {
+        size_t eq = pair.find('=');
+        std::string key = pair.substr(0, eq), value = eq == std::string::npos ? "" : pair.substr(eq + 1);
+        uint64_t count = 0;
+        bool ok = true;
+        if (key == "size") ok = (std::stringstream(value) >> scene.size) && scene.size > 0.0f;
+        else if (key == "seed") ok = static_cast<bool>(std::stringstream(value) >> scene.seed);
+        else if (key == "triangles" || key == "layers" || key == "textures" || key == "texture_size" || key == "meshes" || key == "instance_triangles")
+        {
+            ok = parseProceduralCount(value, key == "triangles" ? MAX_PROCEDURAL_TRIANGLES : MAX_PROCEDURAL_COUNT, count);
+            if (key == "triangles") scene.triangles = count;
+            else if (key == "layers") scene.layers = static_cast<unsigned int>(count);
+            else if (key == "textures") scene.textures = static_cast<unsigned int>(count);
+            else if (key == "texture_size") scene.textureSize = static_cast<unsigned int>(count);
+            else if (key == "meshes") scene.meshes = static_cast<unsigned int>(count);
+            else scene.instanceTriangles = static_cast<unsigned int>(count);
+        }
+        else std::cout << "Unknown procedural scene key " << key << ", ignored" << std::endl;
+        if (!ok)
+        {
+            std::cout << "ERROR::PROCEDURAL:: bad value " << value << " of " << key << " in " << path << std::endl;
+            return false;
+        }
+    }
+    if (scene.triangles == 0 || scene.layers == 0 || (scene.textures > 0 && scene.textureSize == 0) || scene.instanceTriangles == 0)
+    {
+        std::cout << "ERROR::PROCEDURAL:: " << path << " needs some triangles, at least one layer and non-empty textures" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+namespace procedural_detail {
+
+    constexpr double PI{ 3.14159265358979323846 };
+
+    inline Vertex vertex(const glm::vec3& position, const glm::vec3& normal, const glm::vec2& texCoords, const glm::vec3& tangent)
+    {
+        Vertex v{};
+        v.Position = position;
+        v.Normal = normal;
+        v.TexCoords = texCoords;
+        v.Tangent = tangent;
+        v.Bitangent = glm::cross(normal, tangent);
+        return v;
+    }
+
+    // rings (>= 2) of a UV sphere with twice as many segments, for about this many triangles
+    inline unsigned int sphereRings(uint64_t triangles)
+    {
+        // 2 * segments * (rings - 1) triangles: the quads at the poles have a single one
+        double rings = 0.5 + std::sqrt(0.25 + static_cast<double>(triangles) / 4.0);
+        return static_cast<unsigned int>(std::max(2.0, std::round(rings)));
+    }
+
+    // the rings [first, last) of a UV sphere of radius 1 (positions are normals), transformed by position and normal
+    // matrices, appended to a mesh. Outward faces are counter-clockwise
+    template<typename Transform>
+    void appendSphere(MeshData& mesh, unsigned int rings, unsigned int first, unsigned int last, Transform&& transform)
+    {
+        const unsigned int segments = 2 * rings;
+        const unsigned int base = static_cast<unsigned int>(mesh.vertices.size());
+        // the sines and cosines of the grid, once
+        std::vector<float> sinTheta(last - first + 1), cosTheta(last - first + 1), sinPhi(segments + 1), cosPhi(segments + 1);
+        for (unsigned int r = first; r <= last; ++r)
+        {
+            double theta = PI * r / rings;
+            sinTheta[r - first] = static_cast<float>(std::sin(theta));
+            cosTheta[r - first] = static_cast<float>(std::cos(theta));
+        }
+        for (unsigned int s = 0; s <= segments; ++s)
+        {
+            double phi = 2.0 * PI * s / segments;
+            sinPhi[s] = static_cast<float>(std::sin(phi));
+            cosPhi[s] = static_cast<float>(std::cos(phi));
+        }
+        for (unsigned int r = first; r <= last; ++r)
+            for (unsigned int s = 0; s <= segments; ++s)
+            {
+                glm::vec3 unit(sinTheta[r - first] * cosPhi[s], cosTheta[r - first], sinTheta[r - first] * sinPhi[s]);
+                glm::vec3 tangent(-sinPhi[s], 0.0f, cosPhi[s]);
+                glm::vec2 texCoords(static_cast<float>(s) / segments, 1.0f - static_cast<float>(r) / rings);
+                mesh.vertices.push_back(transform(unit, tangent, texCoords));
+            }
+        const unsigned int row = segments + 1;
+        for (unsigned int r = first; r < last; ++r)
+            for (unsigned int s = 0; s < segments; ++s)
+            {
+                unsigned int a = base + (r - first) * row + s, b = a + 1, c = a + row, d = c + 1;
+                if (r > 0) mesh.indices.insert(mesh.indices.end(), { a, b, d });    // at the north pole a and b are one point
+                if (r + 1 < rings) mesh.indices.insert(mesh.indices.end(), { a, d, c });    // at the south pole, c and d
+            }
+    }
+
+    // triangles of a mesh at most: its vertices stay well below 2^32, and its indices below 2^31 (a GLsizei count)
+    constexpr uint64_t MAX_MESH_TRIANGLES{ 1ull << 28 };
+
+    // meshes for this many triangles, at least
+    inline uint64_t meshesFor(uint64_t triangles)
+    {
+        return (triangles + MAX_MESH_TRIANGLES - 1) / MAX_MESH_TRIANGLES;
+    }
+
+    // layers x parts meshes (parts per layer, at least enough for the requested meshes and the size limit)
+    inline unsigned int partsPerLayer(const ProceduralScene& scene, unsigned int layers)
+    {
+        unsigned int meshes = scene.meshes > 0 ? scene.meshes : std::max(scene.textures, layers);
+        return static_cast<unsigned int>(std::max<uint64_t>({ 1, (meshes + layers - 1) / layers, meshesFor(scene.triangles / layers) }));
+    }
+
+    inline void sphere(const ProceduralScene& scene, ModelData& data)
+    {
+        const unsigned int rings = sphereRings(scene.triangles / scene.layers);
+        const unsigned int segments = 2 * rings;
+        const unsigned int parts = std::min(partsPerLayer(scene, scene.layers), rings);
+        for (unsigned int layer = 0; layer < scene.layers; ++layer)
+        {
+            const float radius = scene.size * static_cast<float>(scene.layers - layer) / scene.layers;
+            for (unsigned int part = 0; part < parts; ++part)
+            {
+                unsigned int first = rings * part / parts, last = rings * (part + 1) / parts;
+                MeshData mesh;
+                mesh.vertices.reserve(static_cast<size_t>(last - first + 1) * (segments + 1));
+                mesh.indices.reserve(static_cast<size_t>(last - first) * segments * 6);
+                appendSphere(mesh, rings, first, last, [&](const glm::vec3& unit, const glm::vec3& tangent, const glm::vec2& texCoords) {
+                    return vertex(radius * unit, unit, texCoords, tangent);
+                });
+                data.meshes.push_back(std::move(mesh));
+            }
+        }
+    }
+
+    inline void grid(const ProceduralScene& scene, ModelData& data)
+    {
+        const unsigned int n = static_cast<unsigned int>(std::max(1.0, std::round(std::sqrt(static_cast<double>(scene.triangles / scene.layers) / 2.0))));
+        const unsigned int parts = std::min(partsPerLayer(scene, scene.layers), n);
+        const float spacing = 2.0f * scene.size / scene.layers;
+        const float amplitude = std::min(0.2f * scene.size, 0.4f * spacing);     // the layers never touch
+        for (unsigned int layer = 0; layer < scene.layers; ++layer)
+        {
+            // a few waves per layer: h(x, z) = sum of a sin(k . (x, z) + phase)
+            CounterRng rng(scene.seed, layer);
+            struct Wave { float a, kx, kz, phase; };
+            Wave waves[4];
+            float weight = 0.0f;
+            for (int w = 0; w < 4; ++w)
+            {
+                float frequency = static_cast<float>(PI) * (1 << w) / scene.size, direction = rng.uniform(0.0f, 2.0f * static_cast<float>(PI));
+                waves[w] = { 1.0f / (1 << w), frequency * std::cos(direction), frequency * std::sin(direction), rng.uniform(0.0f, 2.0f * static_cast<float>(PI)) };
+                weight += waves[w].a;
+            }
+            for (Wave& wave : waves) wave.a *= amplitude / weight;
+            const float height = -scene.size + (layer + 0.5f) * spacing;
+
+            for (unsigned int part = 0; part < parts; ++part)
+            {
+                unsigned int first = n * part / parts, last = n * (part + 1) / parts;   // rows along z
+                MeshData mesh;
+                mesh.vertices.reserve(static_cast<size_t>(last - first + 1) * (n + 1));
+                mesh.indices.reserve(static_cast<size_t>(last - first) * n * 6);
+                for (unsigned int j = first; j <= last; ++j)
+                    for (unsigned int i = 0; i <= n; ++i)
+                    {
+                        float x = scene.size * (2.0f * i / n - 1.0f), z = scene.size * (2.0f * j / n - 1.0f);
+                        float y = height, dx = 0.0f, dz = 0.0f;
+                        for (const Wave& wave : waves)
+                        {
+                            float angle = wave.kx * x + wave.kz * z + wave.phase;
+                            y += wave.a * std::sin(angle);
+                            dx += wave.a * wave.kx * std::cos(angle);
+                            dz += wave.a * wave.kz * std::cos(angle);
+                        }
+                        glm::vec3 normal = glm::normalize(glm::vec3(-dx, 1.0f, -dz));
+                        glm::vec3 tangent = glm::normalize(glm::vec3(1.0f, dx, 0.0f));
+                        mesh.vertices.push_back(vertex(glm::vec3(x, y, z), normal, glm::vec2(static_cast<float>(i) / n, static_cast<float>(j) / n), tangent));
+                    }
+                // counter-clockwise seen from above
+                const unsigned int row = n + 1;
+                for (unsigned int j = first; j < last; ++j)
+                    for (unsigned int i = 0; i < n; ++i)
+                    {
+                        unsigned int a = (j - first) * row + i, b = a + 1, c = a + row, d = c + 1;
+                        mesh.indices.insert(mesh.indices.end(), { a, c, b, b, c, d });
+                    }
+                data.meshes.push_back(std::move(mesh));
+            }
+        }
+    }
+
+    inline void clutter(const ProceduralScene& scene, ModelData& data)
+    {
+        const unsigned int rings = sphereRings(scene.instanceTriangles);
+        const uint64_t perInstance = 4ull * rings * (rings - 1);
+        const uint64_t instances = std::max<uint64_t>(1, scene.triangles / perInstance);
+        // n ellipsoids of radius a in a cube of side L: a ray across the cube crosses n pi a^2 / L^2 of them on average
+        const double side = 2.0 * scene.size;
+        const float radius = static_cast<float>(std::min(side / 4.0, side * std::sqrt(scene.layers / (static_cast<double>(instances) * PI))));
+        const uint64_t meshes = std::max<uint64_t>({ 1, scene.meshes > 0 ? scene.meshes : scene.textures, meshesFor(instances * perInstance) });
+        const unsigned int parts = static_cast<unsigned int>(std::min<uint64_t>(instances, meshes));
+        const size_t vertices = static_cast<size_t>(rings + 1) * (2 * rings + 1);
+
+        for (unsigned int part = 0; part < parts; ++part)
+        {
+            uint64_t first = instances * part / parts, last = instances * (part + 1) / parts;
+            MeshData mesh;
+            mesh.vertices.reserve(static_cast<size_t>(last - first) * vertices);
+            mesh.indices.reserve(static_cast<size_t>((last - first) * perInstance * 3));
+            for (uint64_t instance = first; instance < last; ++instance)
+            {
+                // the same instance whatever the split into meshes
+                CounterRng rng(scene.seed, instance);
+                glm::vec3 center(rng.uniform(-1.0f, 1.0f), rng.uniform(-1.0f, 1.0f), rng.uniform(-1.0f, 1.0f));
+                glm::vec3 scale(rng.uniform(0.5f, 1.5f), rng.uniform(0.5f, 1.5f), rng.uniform(0.5f, 1.5f));
+                glm::vec3 axis(rng.uniform(-1.0f, 1.0f), rng.uniform(-1.0f, 1.0f), rng.uniform(-1.0f, 1.0f));
+                float angle = rng.uniform(0.0f, 2.0f * static_cast<float>(PI));
+                if (glm::dot(axis, axis) < 1e-6f) axis = glm::vec3(0.0f, 1.0f, 0.0f);
+                glm::mat3 rotation = glm::mat3(glm::rotate(glm::mat4(1.0f), angle, glm::normalize(axis)));
+                glm::mat3 shape = rotation * glm::mat3(glm::scale(glm::mat4(1.0f), radius * scale));
+                glm::mat3 normals = glm::transpose(glm::inverse(shape));
+                center *= scene.size - radius;
+                appendSphere(mesh, rings, 0, rings, [&](const glm::vec3& unit, const glm::vec3& tangent, const glm::vec2& texCoords) {
+                    return vertex(center + shape * unit, glm::normalize(normals * unit), texCoords, glm::normalize(shape * tangent));
+                });
+            }
+            data.meshes.push_back(std::move(mesh));
+        }
+    }
+
+    // a checkerboard of two random colors, shaded by a gradient, RGB
+    inline ImageData texture(const ProceduralScene& scene, unsigned int index)
+    {
+        ImageData image;
+        image.path = "procedural_texture_" + std::to_string(index);
+        image.width = image.height = static_cast<int>(scene.textureSize);
+        image.components = 3;
+        const size_t size = static_cast<size_t>(scene.textureSize) * scene.textureSize;
+        // freed like the decoded images (stbi_image_free is free())
+        image.pixels = std::unique_ptr<unsigned char, void(*)(void*)>(static_cast<unsigned char*>(std::malloc(size * 3)), std::free);
+        if (!image.pixels) return image;
+
+        CounterRng rng(scene.seed + 1, index);
+        glm::vec3 colors[2];
+        for (glm::vec3& color : colors) color = glm::vec3(rng.uniform(), rng.uniform(), rng.uniform());
+        const unsigned int cells = 4u << (rng.next() % 4);     // 4 to 32 per side
+        const unsigned int cell = std::max(1u, scene.textureSize / cells);
+        unsigned char* p = image.pixels.get();
+        for (unsigned int y = 0; y < scene.textureSize; ++y)
+            for (unsigned int x = 0; x < scene.textureSize; ++x)
+            {
+                glm::vec3 color = colors[((x / cell) + (y / cell)) & 1] * (0.6f + 0.4f * y / scene.textureSize);
+                for (int c = 0; c < 3; ++c) *p++ = static_cast<unsigned char>(std::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+        return image;
+    }
+}
+
+// the scene, as an import would give it. Not valid if the parameters are not
+inline ModelData generateProceduralScene(const ProceduralScene& scene, const std::string& path)
+{
+    ModelData data;
+    data.path = path;
+    switch (scene.shape)
+    {
+    case ProceduralShape::Sphere: procedural_detail::sphere(scene, data); break;
+    case ProceduralShape::Grid: procedural_detail::grid(scene, data); break;
+    case ProceduralShape::Clutter: procedural_detail::clutter(scene, data); break;
+    }
+
+    {
+        ScopedStage stage(Stage::TextureDecode);
+        for (unsigned int i = 0; i < scene.textures; ++i)
+        {
+            data.images.push_back(procedural_detail::texture(scene, i));
+            if (!data.images.back().pixels)
+            {
+                std::cout << "ERROR::PROCEDURAL:: out of memory for the textures of " << path << std::endl;
+                return data;
+            }
+        }
+    }
+    uint64_t triangles = 0;
+    for (size_t i = 0; i < data.meshes.size(); ++i)
+    {
+        if (scene.textures > 0) data.meshes[i].textures.push_back({ static_cast<unsigned int>(i % scene.textures), "texture_diffuse" });
+        triangles += data.meshes[i].indices.size() / 3;
+    }
+    std::cout << "Procedural scene " << path << ": " << triangles << " triangles in " << data.meshes.size() << " meshes, " << scene.textures << " textures" << std::endl;
+    data.valid = true;
+    return data;
+}
+
+inline ModelData generateProceduralScene(const std::string& path)
+{
+    ProceduralScene scene;
+    if (!parseProceduralPath(path, scene))
+    {
+        ModelData data;
+        data.path = path;
+        return data;
+    }
+    return generateProceduralScene(scene, path);
+}
+
+#endif
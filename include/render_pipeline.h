@@ -0,0 +1,119 @@
+#ifndef RENDER_PIPELINE_H
+#define RENDER_PIPELINE_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "conf.h"
+
+// Compile-time description of what a frame does. The frame loop and Model::Draw are templates on it, so every configuration
+// gets its own instantiation where the unused passes and the depth convention checks are compiled away.
+
+enum class DepthMode { Standard, Reverse };    // reverse: https://nlguillemot.wordpress.com/2016/12/07/reversed-z-in-opengl/
+enum class Preview { Color, DepthMap, HDR, Normals, None };    // what goes to the window (None: nothing, e.g. batch jobs)
+
+// outputs, as a bit mask
+constexpr unsigned int OUTPUT_DEPTH{ 1 };
+constexpr unsigned int OUTPUT_HDR{ 2 };
+constexpr unsigned int OUTPUT_NORMALS{ 4 };
+constexpr unsigned int OUTPUT_ALL{ OUTPUT_DEPTH | OUTPUT_HDR | OUTPUT_NORMALS };
+
+// What a frame does, known at runtime (from conf.h for now)
+struct PipelineConfig {
+    DepthMode depth{ DepthMode::Standard };
+    unsigned int outputs{ OUTPUT_ALL };
+    Preview preview{ Preview::Color };
+
+    // which passes the frame needs: the saved outputs, plus what the preview shows
+    constexpr bool depthPass() const { return (outputs & OUTPUT_DEPTH) || preview == Preview::DepthMap; }
+    constexpr bool HDRPass() const { return (outputs & OUTPUT_HDR) || preview == Preview::HDR; }
+    constexpr bool normalsPass() const { return (outputs & OUTPUT_NORMALS) || preview == Preview::Normals; }
+    // with both HDR and normals, a single pass can fill both (see ShaderOutput::GBuffer)
+    constexpr bool gBufferPass() const { return conf::gbuffer_pass && HDRPass() && normalsPass(); }
+
+    static PipelineConfig fromConf()
+    {
+        PipelineConfig config;
+        config.depth = conf::depth_mode == "reverse" ? DepthMode::Reverse : DepthMode::Standard;
+
+        if (conf::render_type == "depth_map") config.preview = Preview::DepthMap;
+        else if (conf::render_type == "HDR") config.preview = Preview::HDR;
+        else if (conf::render_type == "normals") config.preview = Preview::Normals;
+        else if (conf::render_type == "none") config.preview = Preview::None;
+        else config.preview = Preview::Color;
+
+        config.outputs = 0;
+        std::stringstream names(conf::outputs);
+        std::string name;
+        while (names >> name)
+        {
+            if (name == "depth_map") config.outputs |= OUTPUT_DEPTH;
+            else if (name == "HDR") config.outputs |= OUTPUT_HDR;
+            else if (name == "normals") config.outputs |= OUTPUT_NORMALS;
+            else std::cout << "Unknown output " << name << ", ignored" << std::endl;
+        }
+        return config;
+    }
+};
+
+// The same description at compile time, with the same passes
+template<DepthMode D, unsigned int O, Preview P>
+struct RenderPolicy {
+    static constexpr DepthMode depth = D;
+    static constexpr unsigned int outputs = O;
+    static constexpr Preview preview = P;
+
+    static constexpr bool reverse = D == DepthMode::Reverse;
+    static constexpr bool depthPass = PipelineConfig{ D, O, P }.depthPass();
+    static constexpr bool HDRPass = PipelineConfig{ D, O, P }.HDRPass();
+    static constexpr bool normalsPass = PipelineConfig{ D, O, P }.normalsPass();
+    static constexpr bool gBufferPass = PipelineConfig{ D, O, P }.gBufferPass();
+};
+
+// normals without HDR get a pass of their own, whatever conf::gbuffer_pass says (see Renderer::requiredOutputs)
+static_assert(RenderPolicy<DepthMode::Standard, OUTPUT_DEPTH | OUTPUT_NORMALS, Preview::None>::normalsPass
+    && !RenderPolicy<DepthMode::Standard, OUTPUT_DEPTH | OUTPUT_NORMALS, Preview::None>::gBufferPass, "depth and normals need the normals pass");
+
+// Calls f(RenderPolicy<...>{}) with the instantiation matching the runtime configuration: the only place where the
+// configuration is looked at, all the rest is resolved at compile time.
+namespace pipeline_detail {
+
+    template<DepthMode D, unsigned int O, typename F>
+    void dispatchPreview(Preview preview, F&& f)
+    {
+        switch (preview)
+        {
+        case Preview::Color:    f(RenderPolicy<D, O, Preview::Color>{}); break;
+        case Preview::DepthMap: f(RenderPolicy<D, O, Preview::DepthMap>{}); break;
+        case Preview::HDR:      f(RenderPolicy<D, O, Preview::HDR>{}); break;
+        case Preview::Normals:  f(RenderPolicy<D, O, Preview::Normals>{}); break;
+        case Preview::None:     f(RenderPolicy<D, O, Preview::None>{}); break;
+        }
+    }
+
+    template<DepthMode D, typename F>
+    void dispatchOutputs(unsigned int outputs, Preview preview, F&& f)
+    {
+        switch (outputs & OUTPUT_ALL)
+        {
+        case 0: dispatchPreview<D, 0>(preview, f); break;
+        case 1: dispatchPreview<D, 1>(preview, f); break;
+        case 2: dispatchPreview<D, 2>(preview, f); break;
+        case 3: dispatchPreview<D, 3>(preview, f); break;
+        case 4: dispatchPreview<D, 4>(preview, f); break;
+        case 5: dispatchPreview<D, 5>(preview, f); break;
+        case 6: dispatchPreview<D, 6>(preview, f); break;
+        case 7: dispatchPreview<D, 7>(preview, f); break;
+        }
+    }
+}
+
+template<typename F>
+void dispatchPipeline(const PipelineConfig& config, F&& f)
+{
+    if (config.depth == DepthMode::Reverse) pipeline_detail::dispatchOutputs<DepthMode::Reverse>(config.outputs, config.preview, f);
+    else pipeline_detail::dispatchOutputs<DepthMode::Standard>(config.outputs, config.preview, f);
+}
+
+#endif
@@ -0,0 +1,513 @@
+#ifndef RENDER_SERVICE_H
+#define RENDER_SERVICE_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <glm/glm.hpp>
+
+#include <model.h>
+#include <shader_variants.h>
+#include <render_pipeline.h>
+#include <uniform_blocks.h>
+#include <intrinsics.h>
+#include <renderer.h>
+#include <asset_streamer.h>
+#include <resident_models.h>
+#include <shared_memory.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "conf.h"
+
+// The generator as a long-lived local service: models, programs and framebuffers stay loaded from one request to the
+// next, so a client pays neither the process startup nor the model import. Clients connect to a Unix domain socket and
+// send render requests; the images come back through a shared memory block per connection, the socket only carries
+// the small messages below.
+//
+// Protocol (native endianness, no padding):
+//   request, client -> service:
+//     u32 magic "RRQ1"
+//     u32 outputs            bit mask: 1 depth, 2 HDR, 4 normals (OUTPUT_* in render_pipeline.h)
+//     u64 id                 echoed in the response
+//     f32 pose[16]           camera to world, row-major (as in camera_pose.txt)
+//     f32 light[3]           light direction
+//     f32 intrinsics[8]      width height near far fx fy cx cy (as in intrinsics.txt)
+//     u32 path length, then the model path (no terminating 0)
+//   response, service -> client:
+//     u32 magic "RRS1"
+//     i32 status             see Status
+//     u64 id
+//     u32 width, u32 height, u32 outputs
+//     u64 depth, HDR, normals offsets of the images in the shared memory block (layout of frame_ring.h), 0 if not asked
+//     u64 block size
+//     u32 name length, then the shared memory name (to map with shm_open)
+// A connection is served one request at a time (those sent meanwhile wait their turn): the images of a response stay in
+// the block until the next request of the connection. Clients wanting several rendered together open more connections.
+//
+// Requests arriving within conf::service_batch_window_us of each other are rendered as one batch, grouped by model and
+// light: each model of the batch is looked up (or imported) once, and the next ones import in the background while the
+// first renders. Each request is still a frame of its own; what the batch shares is the readback: the images of all its
+// requests are copied into pixel buffers as they render, and only read once the whole batch is submitted, so the GPU
+// does not wait for the CPU to collect each image before drawing the next one.
+namespace render_service {
+    constexpr uint32_t REQUEST_MAGIC{ 0x31515252 };   // "RRQ1"
+    constexpr uint32_t RESPONSE_MAGIC{ 0x31535252 };  // "RRS1"
+    constexpr size_t REQUEST_FIXED_BYTES{ 4 + 4 + 8 + 16 * 4 + 3 * 4 + 8 * 4 + 4 };
+    constexpr uint32_t MAX_PATH_BYTES{ 4096 };
+
+    enum Status : int32_t {
+        OK = 0,
+        BAD_REQUEST = 1,        // malformed intrinsics (e.g. a size out of [1, MAX_SENSOR_SIZE]), a non-finite or singular
+                                // pose, a non-finite light direction, or no output asked
+        MODEL_FAILED = 2,       // the model could not be imported
+        OUTPUT_UNAVAILABLE = 3, // an output which the service does not render (see conf::outputs)
+        NO_MEMORY = 4           // the shared memory block could not be created
+    };
+
+    // set by SIGINT / SIGTERM: the service stops cleanly, removing its socket and blocks
+    inline volatile std::sig_atomic_t& stopRequested()
+    {
+        static volatile std::sig_atomic_t stop = 0;
+        return stop;
+    }
+}
+
+struct RenderRequest {
+    int connection{ -1 };
+    uint64_t id{ 0 };
+    unsigned int outputs{ 0 };
+    glm::mat4 view{ 1.0f };     // world to camera
+    glm::vec3 lightDir{ 0.0f };
+    Intrinsics intrinsics;
+    std::string model;
+    bool wellFormed{ true };    // false: the pose or the light could not be used (they are left at their defaults)
+};
+
+#ifndef _WIN32
+// The socket side: connections, request parsing, batching and responses. Makes no GL call
+class RenderService {
+public:
+    explicit RenderService(const std::string& socketPath) : socketPath(socketPath)
+    {
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (listener < 0 || socketPath.size() >= sizeof(address.sun_path))
+        {
+            std::cout << "ERROR::RENDER_SERVICE:: cannot create the socket " << socketPath << std::endl;
+            return;
+        }
+        std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        unlink(socketPath.c_str());     // a previous run which did not stop cleanly
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0)
+        {
+            std::cout << "ERROR::RENDER_SERVICE:: cannot listen on " << socketPath << std::endl;
+            close(listener);
+            listener = -1;
+            return;
+        }
+        fcntl(listener, F_SETFL, O_NONBLOCK);
+        std::string base = socketPath.substr(socketPath.find_last_of('/') + 1);
+        blockPrefix = "render_service_" + base.substr(0, base.find('.')) + "_" + std::to_string(getpid());
+        std::cout << "Render service listening on " << socketPath << std::endl;
+    }
+
+    ~RenderService()
+    {
+        for (auto& entry : connections) close(entry.first);
+        if (listener >= 0)
+        {
+            close(listener);
+            unlink(socketPath.c_str());
+        }
+    }
+
+    RenderService(const RenderService&) = delete;
+    RenderService& operator=(const RenderService&) = delete;
+
+    bool listening() const { return listener >= 0; }
+
+    // the next batch of requests, grouped by model and light: waits up to timeoutMs for the first one, then gathers those
+    // which follow within the window (at most maxBatch). Empty if nothing came
+    std::vector<RenderRequest> nextBatch(int timeoutMs, long long windowUs = conf::service_batch_window_us, size_t maxBatch = conf::service_batch_max)
+    {
+        std::vector<RenderRequest> batch;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        gather(batch, deadline, 1);     // new clients or partial requests may come first
+        if (batch.empty()) return batch;
+        gather(batch, std::chrono::steady_clock::now() + std::chrono::microseconds(windowUs), maxBatch);
+        std::stable_sort(batch.begin(), batch.end(), [](const RenderRequest& a, const RenderRequest& b) {
+            if (a.model != b.model) return a.model < b.model;
+            return std::lexicographical_compare(&a.lightDir[0], &a.lightDir[0] + 3, &b.lightDir[0], &b.lightDir[0] + 3);
+        });
+        return batch;
+    }
+
+    // the shared memory of the connection, big enough for the images of the request (their offsets in it are set in
+    // offsets). Null if it cannot be had
+    unsigned char* results(const RenderRequest& request, uint64_t offsets[3])
+    {
+        auto found = connections.find(request.connection);
+        if (found == connections.end()) return nullptr;
+        Connection& connection = found->second;
+        const unsigned int bits[3] = { OUTPUT_DEPTH, OUTPUT_HDR, OUTPUT_NORMALS }, channels[3] = { 1, 4, 3 };
+        size_t bytes = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            offsets[k] = 0;
+            if (!(request.outputs & bits[k])) continue;
+            bytes = (bytes + 4095) / 4096 * 4096;
+            offsets[k] = bytes;
+            bytes += static_cast<size_t>(request.intrinsics.width) * request.intrinsics.height * channels[k] * sizeof(float);
+        }
+        if (connection.block.size() < bytes)
+        {
+            // a new name per size, so that a client never maps a block of the wrong size
+            connection.blockName = blockPrefix + "_" + std::to_string(request.connection) + "_" + std::to_string(++connection.generation);
+            connection.block = SharedMemory();
+            connection.block = SharedMemory::create(connection.blockName, std::max<size_t>(bytes, 4096));
+        }
+        return connection.block.data();
+    }
+
+    void respond(const RenderRequest& request, render_service::Status status, const uint64_t offsets[3] = nullptr)
+    {
+        auto found = connections.find(request.connection);
+        if (found == connections.end()) return;     // the client is gone
+        Connection& connection = found->second;
+        connection.pending = false;
+        bool ok = status == render_service::OK;
+        std::vector<unsigned char>& message = responseBuffer;
+        message.clear();
+        append<uint32_t>(message, render_service::RESPONSE_MAGIC);
+        append<int32_t>(message, status);
+        append<uint64_t>(message, request.id);
+        append<uint32_t>(message, request.intrinsics.width);
+        append<uint32_t>(message, request.intrinsics.height);
+        append<uint32_t>(message, ok ? request.outputs : 0);
+        for (int k = 0; k < 3; ++k) append<uint64_t>(message, ok ? offsets[k] : 0);
+        append<uint64_t>(message, ok ? connection.block.size() : 0);
+        const std::string name = ok ? connection.blockName : std::string();
+        append<uint32_t>(message, static_cast<uint32_t>(name.size()));
+        message.insert(message.end(), name.begin(), name.end());
+
+        size_t sent = 0;
+        while (sent < message.size())
+        {
+            ssize_t n = send(request.connection, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                pollfd out{ request.connection, POLLOUT, 0 };
+                poll(&out, 1, 100);
+                continue;
+            }
+            if (n <= 0) { drop(request.connection); return; }
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+private:
+    struct Connection {
+        std::vector<unsigned char> input;
+        SharedMemory block;
+        std::string blockName;
+        unsigned int generation{ 0 };
+        bool pending{ false };  // a request is being served: the next ones wait in input
+    };
+
+    std::string socketPath;
+    std::string blockPrefix;
+    int listener{ -1 };
+    std::map<int, Connection> connections;
+    std::vector<pollfd> fds;
+    std::vector<unsigned char> responseBuffer;
+
+    template<typename T> static void append(std::vector<unsigned char>& out, T value)
+    {
+        unsigned char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+    template<typename T> static T read(const unsigned char*& p)
+    {
+        T value;
+        std::memcpy(&value, p, sizeof(T));
+        p += sizeof(T);
+        return value;
+    }
+
+    void drop(int fd)
+    {
+        close(fd);
+        connections.erase(fd);
+    }
+
+    // receives until there are count requests or the deadline has passed
+    void gather(std::vector<RenderRequest>& requests, std::chrono::steady_clock::time_point deadline, size_t count)
+    {
+        while (requests.size() < count)
+        {
+            long long left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0) break;
+            receive(static_cast<int>((left + 999) / 1000), requests);
+        }
+    }
+
+    // accepts the new clients and reads what came, waiting up to timeoutMs for something to happen
+    void receive(int timeoutMs, std::vector<RenderRequest>& requests)
+    {
+        // the requests which arrived while the previous one of their connection was served
+        size_t before = requests.size();
+        for (auto it = connections.begin(); it != connections.end();)
+        {
+            int fd = (it++)->first;
+            Connection& connection = connections[fd];
+            if (!connection.pending && !connection.input.empty() && !parse(fd, connection, requests)) drop(fd);
+        }
+        if (requests.size() > before) timeoutMs = 0;
+
+        fds.clear();
+        fds.push_back({ listener, POLLIN, 0 });
+        for (auto& entry : connections) fds.push_back({ entry.first, POLLIN, 0 });
+        if (poll(fds.data(), fds.size(), timeoutMs) <= 0) return;
+
+        for (const pollfd& p : fds)
+        {
+            if (!(p.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            if (p.fd == listener)
+            {
+                int client;
+                while ((client = accept(listener, NULL, NULL)) >= 0)
+                {
+                    fcntl(client, F_SETFL, O_NONBLOCK);
+                    connections[client];
+                }
+                continue;
+            }
+            Connection& connection = connections[p.fd];
+            unsigned char chunk[4096];
+            ssize_t n;
+            while ((n = recv(p.fd, chunk, sizeof(chunk), 0)) > 0) connection.input.insert(connection.input.end(), chunk, chunk + n);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) { drop(p.fd); continue; }
+            if (!parse(p.fd, connection, requests)) drop(p.fd);
+        }
+    }
+
+    // the next complete request in the input of a connection, if none is pending. false if the client speaks something else
+    bool parse(int fd, Connection& connection, std::vector<RenderRequest>& requests)
+    {
+        size_t used = 0;
+        while (!connection.pending && connection.input.size() - used >= render_service::REQUEST_FIXED_BYTES)
+        {
+            const unsigned char* p = connection.input.data() + used;
+            if (read<uint32_t>(p) != render_service::REQUEST_MAGIC) return false;
+            RenderRequest request;
+            request.connection = fd;
+            request.outputs = read<uint32_t>(p);
+            request.id = read<uint64_t>(p);
+            glm::mat4 pose;
+            glm::vec3 lightDir;
+            for (int i = 0; i < 4; ++i) for (int j = 0; j < 4; ++j) pose[j][i] = read<float>(p);
+            for (int i = 0; i < 3; ++i) lightDir[i] = read<float>(p);
+            // NaNs would not sort (see nextBatch), a singular pose has no inverse: rejected when served (BAD_REQUEST)
+            bool finite = true;
+            for (int i = 0; i < 4; ++i) for (int j = 0; j < 4; ++j) finite = finite && std::isfinite(pose[j][i]);
+            for (int i = 0; i < 3; ++i) finite = finite && std::isfinite(lightDir[i]);
+            float determinant = finite ? glm::determinant(pose) : 0.0f;
+            request.wellFormed = finite && std::isfinite(determinant) && std::abs(determinant) > 1e-12f;
+            if (request.wellFormed)
+            {
+                request.view = glm::inverse(pose);
+                request.lightDir = lightDir;
+            }
+            float values[8];
+            for (float& value : values) value = read<float>(p);
+            // the size is checked before the conversion, which is undefined for NaN and out of range values. 0: rejected
+            // when served (BAD_REQUEST)
+            auto size = [](float value) { return std::isfinite(value) && value >= 1.0f && value <= MAX_SENSOR_SIZE ? static_cast<unsigned int>(value) : 0u; };
+            request.intrinsics.width = size(values[0]);
+            request.intrinsics.height = size(values[1]);
+            request.intrinsics.near = values[2];
+            request.intrinsics.far = values[3];
+            request.intrinsics.fx = values[4];
+            request.intrinsics.fy = values[5];
+            request.intrinsics.cx = values[6];
+            request.intrinsics.cy = values[7];
+            uint32_t pathBytes = read<uint32_t>(p);
+            if (pathBytes > render_service::MAX_PATH_BYTES) return false;
+            if (connection.input.size() - used < render_service::REQUEST_FIXED_BYTES + pathBytes) break;  // the rest is on its way
+            request.model.assign(reinterpret_cast<const char*>(p), pathBytes);
+            used += render_service::REQUEST_FIXED_BYTES + pathBytes;
+            requests.push_back(std::move(request));
+            connection.pending = true;
+        }
+        connection.input.erase(connection.input.begin(), connection.input.begin() + used);
+        return true;
+    }
+};
+
+// The GL side: renders the batches of the service with the objects of the current context until SIGINT / SIGTERM.
+// The last conf::service_models models used stay loaded.
+template<typename FramePolicy>
+void serveRequests(RenderService& service, Renderer& renderer, ShaderVariants& shaders, SharedUniforms& shared, AssetStreamer& streamer)
+{
+    // nothing to show: the window is hidden
+    using Policy = RenderPolicy<FramePolicy::depth, FramePolicy::outputs, Preview::None>;
+
+    std::signal(SIGINT, [](int) { render_service::stopRequested() = 1; });
+    std::signal(SIGTERM, [](int) { render_service::stopRequested() = 1; });
+
+    ResidentModels models(streamer, conf::service_models);
+
+    glm::mat4 model = glm::mat4(1.0f);
+    glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+    shaders.forEach([&](Shader& shader) {
+        shader.use();
+        shader.setMat4("model", model);
+        shader.setMat3("normalMatrix", normalMatrix);
+    });
+    shared.light.color = glm::vec3(10.0f, 10.0f, 10.0f);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+
+    // the readbacks of a batch, see the protocol comment: one pixel buffer per image, reused from batch to batch
+    struct Readback {
+        const RenderRequest* request;
+        unsigned char* block;
+        uint64_t offsets[3];
+        size_t buffers[3];      // into pixelBuffers
+        size_t bytes[3];
+    };
+    std::vector<Readback> readbacks;
+    std::vector<GLuint> pixelBuffers;
+    std::vector<size_t> capacities;
+    const unsigned int bits[3] = { OUTPUT_DEPTH, OUTPUT_HDR, OUTPUT_NORMALS };
+    const unsigned int channels[3] = { 1, 4, 3 };
+    const GLenum formats[3] = { GL_DEPTH_COMPONENT, GL_RGBA, GL_RGB };
+
+    while (!render_service::stopRequested())
+    {
+        std::vector<RenderRequest> batch = service.nextBatch(100);
+        glfwPollEvents();
+        if (batch.empty()) continue;     // the targets stay as they are while idle
+
+        // the models of the batch which are not loaded import in the background while the first ones render
+        for (const RenderRequest& request : batch) models.prefetch(request.model);
+
+        readbacks.clear();
+        size_t usedBuffers = 0;
+        for (size_t first = 0; first < batch.size();)
+        {
+            size_t last = first;
+            while (last < batch.size() && batch[last].model == batch[first].model) ++last;
+            Model* group = models.get(batch[first].model);
+            for (size_t i = first; i < last; ++i)
+            {
+                const RenderRequest& request = batch[i];
+                const Intrinsics& intrinsics = request.intrinsics;
+                if (group == nullptr) { service.respond(request, render_service::MODEL_FAILED); continue; }
+                if (!request.wellFormed || request.outputs == 0 || intrinsics.width == 0 || intrinsics.height == 0
+                    || !(intrinsics.near > 0.0f && intrinsics.far > intrinsics.near) || !(intrinsics.fx > 0.0f && intrinsics.fy > 0.0f))
+                {
+                    service.respond(request, render_service::BAD_REQUEST);
+                    continue;
+                }
+                if ((request.outputs & ~Policy::outputs) != 0) { service.respond(request, render_service::OUTPUT_UNAVAILABLE); continue; }
+
+                shared.frame.projection = intrinsics.projection(Policy::reverse);
+                shared.frame.Near = intrinsics.near;
+                shared.frame.Far = intrinsics.far;
+                shared.frame.view = request.view;
+                shared.frame.camPos = glm::vec3(glm::inverse(request.view)[3]);
+                shared.light.wDir = request.lightDir;   // the same within a run of the group, see nextBatch
+                shared.upload();
+                renderer.Draw<Policy>(*group, shaders, intrinsics);
+
+                // queued into pixel buffers: the copies run on the GPU after the frame, the CPU does not wait for them here
+                Readback readback{};
+                readback.request = &request;
+                readback.block = service.results(request, readback.offsets);
+                if (readback.block == nullptr) { service.respond(request, render_service::NO_MEMORY); continue; }
+                const RenderTargetPool::Targets& targets = renderer.currentTargets();
+                const GLuint textures[3] = { targets.depthMap, targets.HDRTex, targets.normalsTex };
+                glPixelStorei(GL_PACK_ALIGNMENT, 4);
+                for (int k = 0; k < 3; ++k)
+                {
+                    if (!(request.outputs & bits[k])) continue;
+                    readback.bytes[k] = static_cast<size_t>(intrinsics.width) * intrinsics.height * channels[k] * sizeof(float);
+                    readback.buffers[k] = usedBuffers++;
+                    if (pixelBuffers.size() < usedBuffers)
+                    {
+                        pixelBuffers.push_back(0);
+                        glGenBuffers(1, &pixelBuffers.back());
+                        capacities.push_back(0);
+                    }
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[readback.buffers[k]]);
+                    if (capacities[readback.buffers[k]] < readback.bytes[k])
+                    {
+                        glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(readback.bytes[k]), NULL, GL_STREAM_READ);
+                        capacities[readback.buffers[k]] = readback.bytes[k];
+                    }
+                    glBindTexture(GL_TEXTURE_2D, textures[k]);
+                    glGetTexImage(GL_TEXTURE_2D, 0, formats[k], GL_FLOAT, (void*)0);
+                }
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                readbacks.push_back(readback);
+                renderer.targetPool.nextFrame();
+            }
+            first = last;
+        }
+
+        // the whole batch is submitted: into the shared memory of the clients
+        for (const Readback& readback : readbacks)
+        {
+            bool mapped = true;
+            for (int k = 0; k < 3; ++k)
+            {
+                if (!(readback.request->outputs & bits[k])) continue;
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[readback.buffers[k]]);
+                const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, static_cast<GLsizeiptr>(readback.bytes[k]), GL_MAP_READ_BIT);
+                if (pixels == nullptr) { mapped = false; continue; }
+                std::memcpy(readback.block + readback.offsets[k], pixels, readback.bytes[k]);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            if (mapped) service.respond(*readback.request, render_service::OK, readback.offsets);
+            else service.respond(*readback.request, render_service::NO_MEMORY);
+        }
+    }
+    if (!pixelBuffers.empty()) glDeleteBuffers(static_cast<GLsizei>(pixelBuffers.size()), pixelBuffers.data());
+    std::cout << "Render service stopping" << std::endl;
+}
+#else
+// Unix domain sockets and POSIX shared memory: not on Windows
+class RenderService {
+public:
+    explicit RenderService(const std::string&) { std::cout << "ERROR::RENDER_SERVICE:: the render service needs a POSIX system" << std::endl; }
+    bool listening() const { return false; }
+};
+
+template<typename FramePolicy>
+void serveRequests(RenderService&, Renderer&, ShaderVariants&, SharedUniforms&, AssetStreamer&) {}
+#endif
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef RENDER_TARGETS_H
+#define RENDER_TARGETS_H
+
+#include <glad/glad.h>
+
+#include <iostream>
+#include <map>
+#include <utility>
+
+#include "conf.h"
+
+// What a framebuffer of the pool is for
+enum class RenderPass {
+    Depth,      // depth map texture only
+    HDR,        // HDR color texture + depth renderbuffer
+    Normals,    // normals texture + depth renderbuffer
+    GBuffer     // HDR color and normals textures at once + depth renderbuffer
+};
+
+// Framebuffers and their attachments, shared by all the models and keyed by resolution.
+//
+// Nothing is allocated up front: a texture or a framebuffer is created the first time a pass asks for it, so a job which
+// never writes normals never allocates them. Each resolution has a single depth renderbuffer, shared by its color passes.
+// Call nextFrame() once per frame: the resolutions not used for conf::render_target_idle_frames frames (after a resize,
+// after the model which used them is gone, ...) are deleted, and so are the least recently used ones while the pool takes
+// more than conf::render_target_budget_mb. The ones used in the current frame are never deleted.
+class RenderTargetPool {
+public:
+    // the targets of one resolution. The names 0 are those not created (yet)
+    struct Targets {
+        unsigned int width{ 0 }, height{ 0 };
+        GLuint depthMap{ 0 };   // depth texture of RenderPass::Depth
+        GLuint HDRTex{ 0 };
+        GLuint normalsTex{ 0 };
+        GLuint depthRBO{ 0 };   // depth of the color passes
+        GLuint FBOs[4]{ 0, 0, 0, 0 };   // one per RenderPass
+        size_t bytes{ 0 };
+        unsigned long long lastUse{ 0 };
+    };
+
+    RenderTargetPool(size_t budget = static_cast<size_t>(conf::render_target_budget_mb) << 20, unsigned int idleFrames = conf::render_target_idle_frames)
+        : budget(budget), idleFrames(idleFrames) {}
+    ~RenderTargetPool() { clear(); }
+
+    RenderTargetPool(const RenderTargetPool&) = delete;
+    RenderTargetPool& operator=(const RenderTargetPool&) = delete;
+
+    // the targets of a resolution, marked as used in this frame (nothing is allocated here)
+    Targets& get(unsigned int width, unsigned int height)
+    {
+        Targets& targets = pool[{ width, height }];
+        targets.width = width;
+        targets.height = height;
+        targets.lastUse = frame;
+        return targets;
+    }
+
+    // the framebuffer of a pass, creating it and its attachments on first use
+    GLuint framebuffer(RenderPass pass, Targets& targets)
+    {
+        GLuint& FBO = targets.FBOs[static_cast<int>(pass)];
+        if (FBO != 0) return FBO;
+
+        glGenFramebuffers(1, &FBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        switch (pass)
+        {
+        case RenderPass::Depth:
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture(targets), 0);
+            glDrawBuffer(GL_NONE);  // i.e. explicitly tell we want no color data
+            glReadBuffer(GL_NONE);
+            break;
+        case RenderPass::HDR:
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture(targets, targets.HDRTex, GL_RGBA16F, GL_RGBA, 8), 0);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRenderbuffer(targets));
+            break;
+        case RenderPass::Normals:
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture(targets, targets.normalsTex, GL_RGB16F, GL_RGB, 8), 0);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRenderbuffer(targets));
+            break;
+        case RenderPass::GBuffer:
+        {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture(targets, targets.HDRTex, GL_RGBA16F, GL_RGBA, 8), 0);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, colorTexture(targets, targets.normalsTex, GL_RGB16F, GL_RGB, 8), 0);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRenderbuffer(targets));
+            unsigned int attachments[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+            glDrawBuffers(2, attachments);
+            break;
+        }
+        }
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::RENDER_TARGETS:: framebuffer " << static_cast<int>(pass) << " at " << targets.width << "x" << targets.height << " not complete" << std::endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return FBO;
+    }
+
+    // ends the frame, and reclaims what went idle or does not fit the budget
+    void nextFrame()
+    {
+        for (auto it = pool.begin(); it != pool.end();)
+        {
+            if (frame - it->second.lastUse >= idleFrames) { destroy(it->second); it = pool.erase(it); }
+            else ++it;
+        }
+        while (bytes() > budget)
+        {
+            auto oldest = pool.end();
+            for (auto it = pool.begin(); it != pool.end(); ++it)
+                if (it->second.lastUse != frame && (oldest == pool.end() || it->second.lastUse < oldest->second.lastUse)) oldest = it;
+            if (oldest == pool.end()) break;    // everything left is in use
+            destroy(oldest->second);
+            pool.erase(oldest);
+        }
+        ++frame;
+    }
+
+    // deletes the targets of a resolution, e.g. the old window size after a resize
+    void release(unsigned int width, unsigned int height)
+    {
+        auto found = pool.find({ width, height });
+        if (found == pool.end()) return;
+        destroy(found->second);
+        pool.erase(found);
+    }
+
+    // deletes everything, e.g. before the context goes away
+    void clear()
+    {
+        for (auto& entry : pool) destroy(entry.second);
+        pool.clear();
+    }
+
+    // GPU memory held by the pool (estimated from the formats)
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (const auto& entry : pool) total += entry.second.bytes;
+        return total;
+    }
+
+private:
+    std::map<std::pair<unsigned int, unsigned int>, Targets> pool;
+    size_t budget;
+    unsigned int idleFrames;
+    unsigned long long frame{ 0 };
+
+    static size_t pixels(const Targets& targets) { return static_cast<size_t>(targets.width) * targets.height; }
+
+    GLuint depthTexture(Targets& targets)
+    {
+        if (targets.depthMap != 0) return targets.depthMap;
+        glGenTextures(1, &targets.depthMap);
+        glBindTexture(GL_TEXTURE_2D, targets.depthMap);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, targets.width, targets.height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        targets.bytes += pixels(targets) * 4;
+        return targets.depthMap;
+    }
+
+    // floating point color texture (bytesPerPixel as the driver most likely stores it: RGB16F is padded to RGBA16F)
+    GLuint colorTexture(Targets& targets, GLuint& texture, GLint internalFormat, GLenum format, size_t bytesPerPixel)
+    {
+        if (texture != 0) return texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, targets.width, targets.height, 0, format, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        targets.bytes += pixels(targets) * bytesPerPixel;
+        return texture;
+    }
+
+    GLuint depthRenderbuffer(Targets& targets)
+    {
+        if (targets.depthRBO != 0) return targets.depthRBO;
+        glGenRenderbuffers(1, &targets.depthRBO);
+        glBindRenderbuffer(GL_RENDERBUFFER, targets.depthRBO);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, targets.width, targets.height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        targets.bytes += pixels(targets) * 4;
+        return targets.depthRBO;
+    }
+
+    static void destroy(Targets& targets)
+    {
+        glDeleteFramebuffers(4, targets.FBOs);  // 0 names are silently ignored
+        GLuint textures[3] = { targets.depthMap, targets.HDRTex, targets.normalsTex };
+        glDeleteTextures(3, textures);
+        glDeleteRenderbuffers(1, &targets.depthRBO);
+        targets = Targets();
+    }
+};
+
+#endif
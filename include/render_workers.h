@@ -0,0 +1,247 @@
+#ifndef RENDER_WORKERS_H
+#define RENDER_WORKERS_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <glm/glm.hpp>
+
+#include <model.h>
+#include <shader_variants.h>
+#include <render_pipeline.h>
+#include <uniform_blocks.h>
+#include <intrinsics.h>
+#include <renderer.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "conf.h"
+
+// One snapshot, as the frame loop saw it when it was asked for
+struct FrameJob {
+    int index{ 0 };     // snapshot number, in the names of the output files
+    Intrinsics intrinsics;
+    glm::mat4 view{ 1.0f };
+    glm::vec3 camPos{ 0.0f };
+    glm::vec3 lightDir{ 0.0f };
+    glm::vec3 lightColor{ 10.0f };
+    glm::mat4 model{ 1.0f };
+};
+
+// What a worker thread owns in its context: its own programs (uniform values are per program, and programs are shared
+// between contexts, so the workers must not set them on the same ones), its framebuffers, its uniform buffer and the
+// vertex arrays of the models it draws. Created and deleted on the worker thread, with its context current.
+class RenderWorker {
+public:
+    ShaderVariants shaders = ShaderVariants("../Data/shaders/standard.vert", "../Data/shaders/standard.frag", Renderer::requiredOutputs(workerPipeline()));
+    Renderer renderer;
+    SharedUniforms shared;
+
+    // renders the passes of the snapshot and saves its outputs (the frame loop saves the rest: light, pose, intrinsics)
+    template<typename Policy>
+    void render(Model& model, const FrameJob& job)
+    {
+        shared.frame.projection = job.intrinsics.projection(Policy::reverse);
+        shared.frame.Near = job.intrinsics.near;
+        shared.frame.Far = job.intrinsics.far;
+        shared.frame.view = job.view;
+        shared.frame.camPos = job.camPos;
+        shared.light.color = job.lightColor;
+        shared.light.wDir = job.lightDir;
+        shared.upload();
+
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(job.model)));
+        shaders.forEach([&](Shader& shader) {
+            shader.use();
+            shader.setMat4("model", job.model);
+            shader.setMat3("normalMatrix", normalMatrix);
+        });
+
+        // no window to show anything in
+        renderer.save_to_txt = true;
+        renderer.nSnapshots = job.index;
+        renderer.snapshot_view = job.view;
+        renderer.snapshot_light = job.lightDir;
+        renderer.Draw<RenderPolicy<Policy::depth, Policy::outputs, Preview::None>>(model, shaders, job.intrinsics, &context(model));
+        renderer.targetPool.nextFrame();
+    }
+
+    // waits for the files of the rendered snapshots (the readbacks only progress while the worker renders or flushes)
+    void flush() { renderer.exports.flush(); }
+
+    // drops the vertex arrays of a model
+    void forget(const Model* model) { contexts.erase(model); }
+
+private:
+    std::map<const Model*, DrawContext> contexts;
+
+    DrawContext& context(const Model& model)
+    {
+        auto found = contexts.find(&model);
+        if (found == contexts.end()) found = contexts.emplace(&model, model.createContext()).first;
+        return found->second;
+    }
+
+    // the workers draw the outputs of the configuration, never a preview (see render)
+    static PipelineConfig workerPipeline()
+    {
+        PipelineConfig config = PipelineConfig::fromConf();
+        config.preview = Preview::None;
+        return config;
+    }
+};
+
+// Threads rendering snapshots in parallel with the frame loop, one GL context each, all sharing the objects of the main
+// context: the geometry and the textures of the models are uploaded once and read by every worker, while each one keeps
+// its own vertex arrays, framebuffers and programs. The workers pull from a single job queue, so a slow frame never holds
+// the others back.
+//
+// The contexts are hidden GLFW windows created with the main window as share, on the main thread (as GLFW wants); each
+// worker makes its own current for its whole life. With a software rasterizer (llvmpipe, ...) this scales with the cores
+// like one process per core would, but with a single copy of the models.
+class RenderWorkerPool {
+public:
+    RenderWorkerPool(GLFWwindow* share, unsigned int count = conf::render_workers)
+    {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            GLFWwindow* context = glfwCreateWindow(1, 1, "", NULL, share);
+            if (context == NULL)
+            {
+                std::cout << "ERROR::RENDER_WORKERS:: cannot create a shared context, " << workers.size() << " workers only" << std::endl;
+                break;
+            }
+            workers.push_back(std::make_unique<Worker>());
+            workers.back()->context = context;
+        }
+        glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+        for (auto& worker : workers)
+        {
+            Worker* w = worker.get();
+            w->thread = std::thread([this, w] { work(*w); });
+        }
+    }
+
+    // renders what is queued, then deletes the contexts (on the main thread, as GLFW wants)
+    ~RenderWorkerPool()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers)
+        {
+            worker->thread.join();
+            glfwDestroyWindow(worker->context);
+        }
+    }
+
+    RenderWorkerPool(const RenderWorkerPool&) = delete;
+    RenderWorkerPool& operator=(const RenderWorkerPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    // queues a snapshot of the model. The model must stay until release(model)
+    template<typename Policy>
+    void submit(Model& model, const FrameJob& job)
+    {
+        // what the main context uploaded is only guaranteed visible to the others once it has completed
+        if (uploaded.insert(&model).second) glFinish();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back([&model, job](RenderWorker& worker) { worker.render<Policy>(model, job); });
+        }
+        wake.notify_one();
+    }
+
+    // waits for all the queued snapshots
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return jobs.empty() && busy == 0; });
+    }
+
+    // waits for the snapshots, then has every worker drop its objects for the model: call it before deleting the model
+    void release(const Model& model)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return jobs.empty() && busy == 0; });
+        for (auto& worker : workers) worker->forget.push_back(&model);
+        uploaded.erase(&model);
+        wake.notify_all();
+        done.wait(lock, [this] {
+            for (auto& worker : workers) if (!worker->forget.empty()) return false;
+            return true;
+        });
+    }
+
+private:
+    struct Worker {
+        GLFWwindow* context{ NULL };
+        std::thread thread;
+        std::vector<const Model*> forget;  // models whose objects must go, see release
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex mutex;
+    std::condition_variable wake;   // a job, something to forget, or stopping
+    std::condition_variable done;   // a job is over, or something was forgotten
+    std::deque<std::function<void(RenderWorker&)>> jobs;
+    unsigned int busy{ 0 };         // jobs being rendered
+    bool stopping{ false };
+    std::set<const Model*> uploaded;    // models already synchronized with the workers (main thread only)
+
+    void work(Worker& worker)
+    {
+        glfwMakeContextCurrent(worker.context);
+        // the per-context state which the main context has too, see main()
+        if (PipelineConfig::fromConf().depth == DepthMode::Reverse) glClipControl(GL_LOWER_LEFT, GL_ZERO_TO_ONE);
+        {
+            RenderWorker state;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                wake.wait(lock, [&] { return stopping || !jobs.empty() || !worker.forget.empty(); });
+                if (!worker.forget.empty())
+                {
+                    for (const Model* model : worker.forget) state.forget(model);
+                    worker.forget.clear();
+                    done.notify_all();
+                }
+                if (stopping) break;
+                if (jobs.empty()) continue;
+
+                std::function<void(RenderWorker&)> job = std::move(jobs.front());
+                jobs.pop_front();
+                ++busy;
+                lock.unlock();
+                job(state);
+                lock.lock();
+                if (jobs.empty())
+                {
+                    // nothing else to render: finish the writing, so that wait() means the files are there
+                    lock.unlock();
+                    state.flush();
+                    lock.lock();
+                }
+                --busy;
+                done.notify_all();
+            }
+        }
+        glfwMakeContextCurrent(NULL);
+    }
+};
+
+#endif
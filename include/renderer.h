@@ -0,0 +1,296 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <glad/glad.h>
+
+#include <model.h>
+#include <shaderClass.h>
+#include <shader_variants.h>
+#include <render_pipeline.h>
+#include <render_targets.h>
+#include <frame_pipeline.h>
+#include <stage_timers.h>
+#include <intrinsics.h>
+
+#include <cstdint>
+#include <string>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include "conf.h"
+
+// What stays while the models come and go: the screen shaders, the screen quad and the framebuffers (see RenderTargetPool).
+// Everything here is created once; a Model only holds its own geometry and textures, so models can be loaded, drawn and
+// deleted one after the other without anything piling up on the GPU.
+class Renderer
+{
+public:
+    // framebuffers, shared by all the models and created when a pass first needs them
+    RenderTargetPool targetPool;
+
+    // readback and writing of the snapshots, behind the frames
+    FramePipeline exports;
+
+    // GPU time of the passes, when the stage timers are on (see StageTimers)
+    GpuStageTimer passTimers;
+
+    // save to files
+    std::string out_folder{ conf::out_folder };
+    bool save_to_txt{ false };
+    int nSnapshots{ 0 };
+    glm::mat4 snapshot_view{ 1.0f };      // the camera and the light of the snapshot, which go with its images
+    glm::vec3 snapshot_light{ 0.0f };
+    uint64_t snapshot_augmentation{ 0 };    // of a job frame, see FrameDescriptor
+    uint64_t snapshot_seed{ 0 };
+    bool snapshot_job{ false };             // the seed (and the augmentation, if snapshot_augmented) go to files too
+    bool snapshot_augmented{ false };
+
+    Renderer()
+    {
+        // The all-purpose rendering "quad", on which to render framebuffers content
+        createPlaneObject();
+
+        // Configure x-toScreenShader s
+        if (PipelineConfig::fromConf().depth == DepthMode::Reverse) 
+        { 
+            depthToScreenShader.use();
+            depthToScreenShader.setInt("reverse", 1);  // Set a different conversion back to the eye space depth
+            glDepthFunc(GL_GREATER); // https://nlguillemot.wordpress.com/2016/12/07/reversed-z-in-opengl/
+        }     
+        else
+        {
+            depthToScreenShader.use();
+            depthToScreenShader.setInt("reverse", 0);
+        }
+        depthToScreenShader.setInt("depthMap", 0);
+        HDRToScreenShader.use();
+        HDRToScreenShader.setInt("HDRTexture", 0);
+        normalsToScreenShader.use();
+        normalsToScreenShader.setInt("normalsTexture", 0);
+
+        glEnable(GL_DEPTH_TEST);
+    }
+
+    ~Renderer()
+    {
+        glDeleteVertexArrays(1, &plVAO);
+        glDeleteBuffers(1, &plVBO);
+    }
+
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    // the framebuffers of the last Draw, to read its outputs directly
+    const RenderTargetPool::Targets& currentTargets() const { return *targets; }
+
+    // the shader variants Draw needs for the configuration: one per pass, plus HDR for the color preview
+    static std::vector<ShaderOutput> requiredOutputs(const PipelineConfig& config)
+    {
+        std::vector<ShaderOutput> outputs;
+        if (config.depthPass()) outputs.push_back(ShaderOutput::DepthOnly);
+        if (config.gBufferPass()) outputs.push_back(ShaderOutput::GBuffer);
+        else
+        {
+            if (config.HDRPass()) outputs.push_back(ShaderOutput::HDR);
+            if (config.normalsPass()) outputs.push_back(ShaderOutput::Normals);
+        }
+        if (config.preview == Preview::Color && (config.gBufferPass() || !config.HDRPass())) outputs.push_back(ShaderOutput::HDR);
+        return outputs;
+    }
+
+    // draws the model, and thus all its meshes (to different framebuffers), each pass with its own shader variant.
+    // Policy is a RenderPolicy: the passes and the depth convention are fixed at compile time, see render_pipeline.h.
+    // The framebuffers have the resolution of the intrinsics (whose projection is already in the Frame block).
+    // context: the model's objects for the current context, when it is not the one which loaded the model (see RenderWorker)
+    template<typename Policy>
+    void Draw(Model &model, ShaderVariants &shaders, const Intrinsics& intrinsics = Intrinsics(), DrawContext* context = nullptr)
+    {
+        exports.poll();     // hands the finished readbacks of the previous snapshots to the encoder
+        passTimers.collect(false);
+        targets = &targetPool.get(intrinsics.width, intrinsics.height);
+        GLint window[4];    // the window viewport, for the preview
+        glGetIntegerv(GL_VIEWPORT, window);
+        glViewport(0, 0, targets->width, targets->height);
+
+        // Save depth map to appropriate framebuffer
+        // Save HDR color and normals information to appropriate framebuffers
+        if constexpr (Policy::depthPass) scene_to_FB<Policy>(model, shaders.get(ShaderOutput::DepthOnly), targetPool.framebuffer(RenderPass::Depth, *targets), context, Stage::DepthPass);
+        if constexpr (Policy::gBufferPass) scene_to_FB<Policy>(model, shaders.get(ShaderOutput::GBuffer), targetPool.framebuffer(RenderPass::GBuffer, *targets), context, Stage::GBufferPass);
+        else
+        {
+            if constexpr (Policy::HDRPass) scene_to_FB<Policy>(model, shaders.get(ShaderOutput::HDR), targetPool.framebuffer(RenderPass::HDR, *targets), context, Stage::HDRPass);
+            if constexpr (Policy::normalsPass) scene_to_FB<Policy>(model, shaders.get(ShaderOutput::Normals), targetPool.framebuffer(RenderPass::Normals, *targets), context, Stage::NormalsPass);
+        }
+
+        // Save outputs to file: the copies are queued here, the files are written later (see FramePipeline)
+        if (save_to_txt)
+        {
+            prefix.assign(out_folder);   // reuses its capacity
+            prefix += std::to_string(nSnapshots);
+            prefix += '_';
+            FrameMetadata metadata;
+            metadata.index = nSnapshots;
+            metadata.pose = glm::inverse(snapshot_view);    // C->W !
+            metadata.lightDir = snapshot_light;
+            metadata.augmentation = snapshot_augmentation;
+            metadata.seed = snapshot_seed;
+            metadata.seedFile = snapshot_job;
+            metadata.augmentationFile = snapshot_job && snapshot_augmented;
+            const float values[8] = { static_cast<float>(intrinsics.width), static_cast<float>(intrinsics.height), intrinsics.near, intrinsics.far, intrinsics.fx, intrinsics.fy, intrinsics.cx, intrinsics.cy };
+            std::copy(values, values + 8, metadata.intrinsics);
+            FramePipeline::Output outputs[3];
+            size_t count = 0;
+            // depth map; HDR RGB data, to be able to recover then the true intensity; normals (n -> n/2 + 1/2)
+            if constexpr ((Policy::outputs & OUTPUT_DEPTH) != 0)
+                outputs[count++] = { OUTPUT_DEPTH, targets->depthMap, GL_DEPTH_COMPONENT, 1, Policy::reverse ? "depth_map_reverse.txt" : "depth_map_standard.txt", "Depth map" };
+            if constexpr ((Policy::outputs & OUTPUT_HDR) != 0)
+                outputs[count++] = { OUTPUT_HDR, targets->HDRTex, GL_RGBA, 4, "HDR.txt", "HDR color" };
+            if constexpr ((Policy::outputs & OUTPUT_NORMALS) != 0)
+                outputs[count++] = { OUTPUT_NORMALS, targets->normalsTex, GL_RGB, 3, "normals.txt", "Normals" };
+            if (count > 0) exports.capture(targets->width, targets->height, prefix, metadata, outputs, count);
+            save_to_txt = false;
+        }
+
+        // Print something to screen
+        glViewport(window[0], window[1], window[2], window[3]);
+        if constexpr (Policy::preview == Preview::DepthMap) view_depth_FBO<Policy>(); // visualize the depth map to screen
+        else if constexpr (Policy::preview == Preview::HDR) view_HDR_FBO<Policy>(); // visualize HDR texture to screen
+        else if constexpr (Policy::preview == Preview::Normals) view_normals_FBO<Policy>(); // visualize normals
+        else if constexpr (Policy::preview == Preview::Color) scene_to_FB<Policy>(model, shaders.get(ShaderOutput::HDR), 0, context); // the RGB image to screen
+    }
+
+private:
+    // plane on which to render framebuffer textures
+    unsigned int plVAO{ 0 };
+    unsigned int plVBO{ 0 };
+
+    // shaders drawing the framebuffers to screen
+    Shader depthToScreenShader = Shader("../Data/shaders/depthToScreenShader.vert", "../Data/shaders/depthToScreenShader.frag");
+    Shader HDRToScreenShader = Shader("../Data/shaders/HDRToScreenShader.vert", "../Data/shaders/HDRToScreenShader.frag");
+    Shader normalsToScreenShader = Shader("../Data/shaders/normalsToScreenShader.vert", "../Data/shaders/normalsToScreenShader.frag");
+
+    RenderTargetPool::Targets* targets{ nullptr };  // the ones of the frame being drawn
+    std::string prefix;     // of the snapshot files
+
+    // clear stuff
+    template<typename Policy>
+    void clear_buffers()
+    {
+        if constexpr (Policy::reverse) { glClearDepth(0.0f); }      // https://nlguillemot.wordpress.com/2016/12/07/reversed-z-in-opengl/
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // Render the scene to the specified framebuffer, using the specified shader. stage: the pass, for the GPU timers
+    template<typename Policy>
+    void scene_to_FB(Model &model, Shader &shader, unsigned int FBId, DrawContext* context = nullptr, Stage stage = Stage::Count)
+    {
+        shader.use();
+        glBindFramebuffer(GL_FRAMEBUFFER, FBId);
+        if (stage != Stage::Count) passTimers.begin(stage);
+        clear_buffers<Policy>();
+        model.render_scene(shader, context);
+        passTimers.end();
+    }
+
+    // render depth map on default framebuffer
+    template<typename Policy>
+    void view_depth_FBO()
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        if constexpr (Policy::reverse) { glDepthFunc(GL_LESS); }     // Do I have to keep this? https://nlguillemot.wordpress.com/2016/12/07/reversed-z-in-opengl/
+        glDisable(GL_DEPTH_TEST); // disable depth test so screen-space quad isn't discarded due to depth test.
+
+        glClearColor(1.0f, 1.0f, 1.0f, 1.0f); // set clear color to white (not really necessary actually, since we won't be able to see behind the quad anyways)
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        // Draw the depth map (near and far planes come from the Frame uniform block)
+        depthToScreenShader.use();
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, targets->depthMap);	// take the depth map texture, bind it as the current 0-th texture (which is okay, since we have set the uniform sampler to 0 in the screen shaders, see createDepthFB)
+        glBindVertexArray(plVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+
+        glEnable(GL_DEPTH_TEST); // re-enable for future renderings in the first pass
+        if constexpr (Policy::reverse) { glDepthFunc(GL_GREATER); }     // https://nlguillemot.wordpress.com/2016/12/07/reversed-z-in-opengl/
+
+    }
+
+    // render HDR color to screen
+    template<typename Policy>
+    void view_HDR_FBO()
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        glDisable(GL_DEPTH_TEST); // disable depth test so screen-space quad isn't discarded due to depth test.
+
+        glClearColor(1.0f, 1.0f, 1.0f, 1.0f); // set clear color to white (not really necessary actually, since we won't be able to see behind the quad anyways)
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // Draw HDR texture
+        HDRToScreenShader.use();
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, targets->HDRTex);
+        glBindVertexArray(plVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+
+        glEnable(GL_DEPTH_TEST); // re-enable for future renderings in the first pass
+        if constexpr (Policy::reverse) { glDepthFunc(GL_GREATER); }     // https://nlguillemot.wordpress.com/2016/12/07/reversed-z-in-opengl/
+
+    }
+
+    // render normals map to screen
+    template<typename Policy>
+    void view_normals_FBO()
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        glDisable(GL_DEPTH_TEST); // disable depth test so screen-space quad isn't discarded due to depth test.
+
+        glClearColor(1.0f, 1.0f, 1.0f, 1.0f); // set clear color to white (not really necessary actually, since we won't be able to see behind the quad anyways)
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // Draw HDR texture
+        normalsToScreenShader.use();
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, targets->normalsTex);
+        glBindVertexArray(plVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+
+        glEnable(GL_DEPTH_TEST); // re-enable for future renderings in the first pass
+        if constexpr (Policy::reverse) { glDepthFunc(GL_GREATER); }     // https://nlguillemot.wordpress.com/2016/12/07/reversed-z-in-opengl/
+
+    }
+
+    // Create a rectangle which covers the screen, to which render depth maps
+    void createPlaneObject()
+    {
+        float vertices[] = {
+            // positions         // texCoords
+            -1.0f,  1.0f, 0.0f,  0.0f, 1.0f,
+            -1.0f, -1.0f, 0.0f,  0.0f, 0.0f,
+             1.0f, -1.0f, 0.0f,  1.0f, 0.0f,
+
+            -1.0f,  1.0f, 0.0f,  0.0f, 1.0f,
+             1.0f, -1.0f, 0.0f,  1.0f, 0.0f,
+             1.0f,  1.0f, 0.0f,  1.0f, 1.0f
+        };
+
+        glGenVertexArrays(1, &plVAO);
+        glBindVertexArray(plVAO);
+
+        glGenBuffers(1, &plVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, plVBO);
+
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), &vertices, GL_STATIC_DRAW);
+
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+
+    }
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef RESIDENT_MODELS_H
+#define RESIDENT_MODELS_H
+
+#include <model.h>
+#include <asset_streamer.h>
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+
+// The last models used, kept on the GPU of the current context; the least recently used one goes when one more is needed.
+// The models come from an AssetStreamer: prefetch() the next ones, get() uploads them. For the callers which serve
+// requests naming models by path (RenderService, FrameRenderer).
+class ResidentModels {
+public:
+    ResidentModels(AssetStreamer& streamer, unsigned int capacity) : streamer(streamer), capacity(std::max(1u, capacity)) {}
+
+    ResidentModels(const ResidentModels&) = delete;
+    ResidentModels& operator=(const ResidentModels&) = delete;
+
+    // the model, loaded if needed. Null if it cannot be imported
+    Model* get(const std::string& path)
+    {
+        for (auto it = models.begin(); it != models.end(); ++it)
+            if (it->first == path)
+            {
+                models.splice(models.begin(), models, it);
+                return models.front().second.get();
+            }
+        ModelData data = streamer.take(path);
+        if (!data.valid) return nullptr;
+        while (models.size() >= capacity) models.pop_back();  // before the upload: never more than capacity on the GPU
+        models.emplace_front(path, std::make_unique<Model>(std::move(data)));
+        return models.front().second.get();
+    }
+
+    // starts importing the model in the background, unless it is loaded
+    void prefetch(const std::string& path)
+    {
+        for (const auto& entry : models) if (entry.first == path) return;
+        streamer.prefetch(path);
+    }
+
+private:
+    AssetStreamer& streamer;
+    unsigned int capacity;
+    std::list<std::pair<std::string, std::unique_ptr<Model>>> models;   // most recently used first
+};
+
+#endif
@@ -4,18 +4,41 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include <algorithm>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <utility>
+#include <cstdio>
+#include <atomic>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 class Shader
 {
 public:
-    unsigned int ID;
+    unsigned int ID{ 0 };
+
+    // binding points of the uniform blocks shared by all the programs, see uniform_blocks.h
+    static constexpr GLuint FRAME_BLOCK_BINDING{ 0 };
+    static constexpr GLuint LIGHT_BLOCK_BINDING{ 1 };
+
     // constructor generates the shader on the fly
     // ------------------------------------------------------------------------
     Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr)
+        : Shader(vertexPath, fragmentPath, std::vector<std::string>(), geometryPath)
+    {
+    }
+    // same, with a #define injected in every stage for each of the given names (e.g. "OUTPUT_NORMALS" or "SAMPLES 4")
+    // ------------------------------------------------------------------------
+    Shader(const char* vertexPath, const char* fragmentPath, const std::vector<std::string>& defines, const char* geometryPath = nullptr)
     {
         // 1. retrieve the vertex/fragment source code from filePath
         std::string vertexCode;
@@ -57,111 +80,439 @@ public:
         {
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ: " << e.what() << std::endl;
         }
-        const char* vShaderCode = vertexCode.c_str();
-        const char* fShaderCode = fragmentCode.c_str();
-        // 2. compile shaders
-        unsigned int vertex, fragment;
-        // vertex shader
-        vertex = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertex, 1, &vShaderCode, NULL);
-        glCompileShader(vertex);
-        checkCompileErrors(vertex, "VERTEX");
-        // fragment Shader
-        fragment = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragment, 1, &fShaderCode, NULL);
-        glCompileShader(fragment);
-        checkCompileErrors(fragment, "FRAGMENT");
-        // if geometry shader is given, compile geometry shader
-        unsigned int geometry;
-        if (geometryPath != nullptr)
+        // 2. specialize the sources
+        vertexCode = injectDefines(vertexCode, defines);
+        fragmentCode = injectDefines(fragmentCode, defines);
+        if (!geometryCode.empty()) geometryCode = injectDefines(geometryCode, defines);
+        // 3. load the program from the binary cache, or compile it (the link is checked lazily, see ensureLinked)
+        build(vertexCode, fragmentCode, geometryCode);
+    }
+    // the program (and the shaders of a compilation never checked) are deleted with the object: move it, don't copy it
+    // ------------------------------------------------------------------------
+    ~Shader()
+    {
+        for (const auto& stage : stages) glDeleteShader(stage.first);
+        if (ID != 0) glDeleteProgram(ID);
+    }
+    Shader(const Shader&) = delete;
+    Shader& operator=(const Shader&) = delete;
+    Shader(Shader&& other) noexcept
+        : ID(other.ID), uniformLocations(std::move(other.uniformLocations)), pending(other.pending), stages(std::move(other.stages)), cacheKey(std::move(other.cacheKey))
+    {
+        other.ID = 0;
+        other.pending = false;
+        other.stages.clear();
+    }
+    Shader& operator=(Shader&& other) noexcept
+    {
+        if (this != &other)
         {
-            const char* gShaderCode = geometryCode.c_str();
-            geometry = glCreateShader(GL_GEOMETRY_SHADER);
-            glShaderSource(geometry, 1, &gShaderCode, NULL);
-            glCompileShader(geometry);
-            checkCompileErrors(geometry, "GEOMETRY");
+            std::swap(ID, other.ID);
+            std::swap(uniformLocations, other.uniformLocations);
+            std::swap(pending, other.pending);
+            std::swap(stages, other.stages);
+            std::swap(cacheKey, other.cacheKey);
         }
-        // shader Program
-        ID = glCreateProgram();
-        glAttachShader(ID, vertex);
-        glAttachShader(ID, fragment);
-        if (geometryPath != nullptr)
-            glAttachShader(ID, geometry);
-        glLinkProgram(ID);
-        checkCompileErrors(ID, "PROGRAM");
-        // delete the shaders as they're linked into our program now and no longer necessery
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
-        if (geometryPath != nullptr)
-            glDeleteShader(geometry);
-
+        return *this;   // what we had is deleted with other
+    }
+    // folder where linked program binaries are stored (keyed by source hash and driver), empty to disable the cache
+    // ------------------------------------------------------------------------
+    static void setBinaryCache(const std::string& folder)
+    {
+        binaryCacheFolder() = folder;
+    }
+    // asks the driver to compile on its own threads, if GL_KHR_parallel_shader_compile is there. Programs compile in
+    // parallel anyway as long as nobody queries their status, which is why the link status is checked only at first use
+    // ------------------------------------------------------------------------
+    static void enableParallelCompile(GLADloadproc load)
+    {
+        if (!hasParallelCompile()) return;
+        typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+        PFNGLMAXSHADERCOMPILERTHREADSKHRPROC maxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)load("glMaxShaderCompilerThreadsKHR");
+        if (maxShaderCompilerThreads) maxShaderCompilerThreads(0xFFFFFFFFu);    // i.e. as many threads as the driver wants
+    }
+    // true if the program is linked, or if using it will not block (without the extension we cannot tell, so we say true)
+    // ------------------------------------------------------------------------
+    bool ready() const
+    {
+        if (!pending || !hasParallelCompile()) return true;
+        GLint done = GL_FALSE;
+        glGetProgramiv(ID, COMPLETION_STATUS_KHR, &done);
+        return done == GL_TRUE;
     }
     // activate the shader
     // ------------------------------------------------------------------------
     void use()
     {
+        ensureLinked();
         glUseProgram(ID);
     }
+    // location of an active uniform, from the table built at link time (-1 if the uniform is not active). Waits for the
+    // link if it is still running, so setting a uniform before the first use() is not lost. Looked up without building a
+    // string, so setting a uniform from a literal allocates nothing
+    // ------------------------------------------------------------------------
+    GLint location(const char* name)
+    {
+        ensureLinked();
+        auto it = std::lower_bound(uniformLocations.begin(), uniformLocations.end(), name,
+            [](const std::pair<std::string, GLint>& entry, const char* key) { return entry.first.compare(key) < 0; });
+        return it != uniformLocations.end() && it->first.compare(name) == 0 ? it->second : -1;
+    }
+    GLint location(const std::string& name)
+    {
+        return location(name.c_str());
+    }
     // utility uniform functions
     // ------------------------------------------------------------------------
-    void setBool(const std::string& name, bool value) const
+    void setBool(const char* name, bool value)
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+        glUniform1i(location(name), (int)value);
+    }
+    void setBool(const std::string& name, bool value)
+    {
+        setBool(name.c_str(), value);
     }
     // ------------------------------------------------------------------------
-    void setInt(const std::string& name, int value) const
+    void setInt(const char* name, int value)
+    {
+        glUniform1i(location(name), value);
+    }
+    void setInt(const std::string& name, int value)
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        setInt(name.c_str(), value);
     }
     // ------------------------------------------------------------------------
-    void setFloat(const std::string& name, float value) const
+    void setFloat(const char* name, float value)
+    {
+        glUniform1f(location(name), value);
+    }
+    void setFloat(const std::string& name, float value)
     {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+        setFloat(name.c_str(), value);
     }
     // ------------------------------------------------------------------------
-    void setVec2(const std::string& name, const glm::vec2& value) const
+    void setVec2(const char* name, const glm::vec2& value)
+    {
+        glUniform2fv(location(name), 1, &value[0]);
+    }
+    void setVec2(const std::string& name, const glm::vec2& value)
+    {
+        setVec2(name.c_str(), value);
+    }
+    void setVec2(const char* name, float x, float y)
     {
-        glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform2f(location(name), x, y);
     }
-    void setVec2(const std::string& name, float x, float y) const
+    void setVec2(const std::string& name, float x, float y)
     {
-        glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+        setVec2(name.c_str(), x, y);
     }
     // ------------------------------------------------------------------------
-    void setVec3(const std::string& name, const glm::vec3& value) const
+    void setVec3(const char* name, const glm::vec3& value)
+    {
+        glUniform3fv(location(name), 1, &value[0]);
+    }
+    void setVec3(const std::string& name, const glm::vec3& value)
+    {
+        setVec3(name.c_str(), value);
+    }
+    void setVec3(const char* name, float x, float y, float z)
     {
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform3f(location(name), x, y, z);
     }
-    void setVec3(const std::string& name, float x, float y, float z) const
+    void setVec3(const std::string& name, float x, float y, float z)
     {
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+        setVec3(name.c_str(), x, y, z);
     }
     // ------------------------------------------------------------------------
-    void setVec4(const std::string& name, const glm::vec4& value) const
+    void setVec4(const char* name, const glm::vec4& value)
+    {
+        glUniform4fv(location(name), 1, &value[0]);
+    }
+    void setVec4(const std::string& name, const glm::vec4& value)
+    {
+        setVec4(name.c_str(), value);
+    }
+    void setVec4(const char* name, float x, float y, float z, float w)
     {
-        glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform4f(location(name), x, y, z, w);
     }
     void setVec4(const std::string& name, float x, float y, float z, float w)
     {
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+        setVec4(name.c_str(), x, y, z, w);
     }
     // ------------------------------------------------------------------------
-    void setMat2(const std::string& name, const glm::mat2& mat) const
+    void setMat2(const char* name, const glm::mat2& mat)
+    {
+        glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
+    }
+    void setMat2(const std::string& name, const glm::mat2& mat)
     {
-        glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        setMat2(name.c_str(), mat);
     }
     // ------------------------------------------------------------------------
-    void setMat3(const std::string& name, const glm::mat3& mat) const
+    void setMat3(const char* name, const glm::mat3& mat)
+    {
+        glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
+    }
+    void setMat3(const std::string& name, const glm::mat3& mat)
     {
-        glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        setMat3(name.c_str(), mat);
     }
     // ------------------------------------------------------------------------
-    void setMat4(const std::string& name, const glm::mat4& mat) const
+    void setMat4(const char* name, const glm::mat4& mat)
+    {
+        glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
+    }
+    void setMat4(const std::string& name, const glm::mat4& mat)
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        setMat4(name.c_str(), mat);
     }
 
 private:
+    std::vector<std::pair<std::string, GLint>> uniformLocations;   // sorted by name
+
+    // compilation state: shaders submitted to the driver but not checked yet
+    bool pending{ false };
+    std::vector<std::pair<unsigned int, std::string>> stages;   // shader object, type for the error messages
+    std::string cacheKey;
+
+    static constexpr GLenum COMPLETION_STATUS_KHR{ 0x91B1 };  // from GL_KHR_parallel_shader_compile, not in our glad
+
+    static std::string& binaryCacheFolder()
+    {
+        static std::string folder;
+        return folder;
+    }
+
+    static bool hasExtension(const char* name)
+    {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; ++i)
+            if (std::string(reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i))) == name) return true;
+        return false;
+    }
+    static bool hasParallelCompile()
+    {
+        static bool available = hasExtension("GL_KHR_parallel_shader_compile") || hasExtension("GL_ARB_parallel_shader_compile");
+        return available;
+    }
+    static bool hasProgramBinary()
+    {
+        static bool available = [] {
+            GLint formats = 0;
+            if (GLAD_GL_VERSION_4_1) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+            return formats > 0;
+        }();
+        return available;
+    }
+
+    // adds the defines right after the #version line (which must stay the first one)
+    static std::string injectDefines(const std::string& code, const std::vector<std::string>& defines)
+    {
+        if (defines.empty()) return code;
+        size_t version = code.find("#version");
+        size_t lineEnd = version == std::string::npos ? 0 : code.find('\n', version);
+        lineEnd = lineEnd == std::string::npos ? code.size() : lineEnd + 1;
+        std::string header;
+        for (const std::string& define : defines) header += "#define " + define + "\n";
+        header += "#line 2\n";     // keep the line numbers of the compilation errors those of the file
+        return code.substr(0, lineEnd) + header + code.substr(lineEnd);
+    }
+
+    // FNV-1a, good enough to tell sources apart
+    static unsigned long long hash(const std::string& data, unsigned long long h = 14695981039346656037ull)
+    {
+        for (unsigned char c : data)
+        {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // the binary of a program is valid only for the same sources and the same driver
+    static std::string makeCacheKey(const std::string& vertexCode, const std::string& fragmentCode, const std::string& geometryCode)
+    {
+        std::string driver;
+        for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+        {
+            const GLubyte* value = glGetString(name);
+            if (value) driver += reinterpret_cast<const char*>(value);
+            driver += '\n';
+        }
+        unsigned long long h = hash(driver);
+        h = hash(vertexCode, h);
+        h = hash(std::string(1, '\0') + fragmentCode, h);
+        h = hash(std::string(1, '\0') + geometryCode, h);
+        std::stringstream key;
+        key << std::hex << h;
+        return key.str();
+    }
+
+    std::string binaryPath() const
+    {
+        return binaryCacheFolder() + "/" + cacheKey + ".bin";
+    }
+
+    // creates the program from a cached binary. False if there is no usable binary
+    bool loadBinary()
+    {
+        std::ifstream in(binaryPath(), std::ios::binary);
+        if (!in) return false;
+        GLenum format;
+        GLint length;
+        in.read(reinterpret_cast<char*>(&format), sizeof(format));
+        in.read(reinterpret_cast<char*>(&length), sizeof(length));
+        if (!in || length <= 0) return false;
+        std::vector<char> binary(length);
+        in.read(binary.data(), length);
+        if (!in) return false;
+
+        ID = glCreateProgram();
+        glProgramBinary(ID, format, binary.data(), length);
+        GLint success = GL_FALSE;
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        if (success) return true;
+        // e.g. the driver was updated without changing its version string: compile from sources
+        glDeleteProgram(ID);
+        return false;
+    }
+
+    static long processId()
+    {
+#ifdef _WIN32
+        return static_cast<long>(_getpid());
+#else
+        return static_cast<long>(getpid());
+#endif
+    }
+
+    void saveBinary() const
+    {
+        GLint length = 0;
+        glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+        std::vector<char> binary(length);
+        GLenum format;
+        glGetProgramBinary(ID, length, NULL, &format, binary.data());
+
+#ifdef _WIN32
+        _mkdir(binaryCacheFolder().c_str());
+#else
+        mkdir(binaryCacheFolder().c_str(), 0755);
+#endif
+        // write to a temporary file and rename it, so that other processes never read half a binary. The name is unique to
+        // this process and write: program names are not, every process (and every context) counts them from 1
+        static std::atomic<unsigned int> writes{ 0 };
+        std::string tmp = binaryPath() + "." + std::to_string(processId()) + "." + std::to_string(writes.fetch_add(1)) + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(&format), sizeof(format));
+            out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+            out.write(binary.data(), length);
+            if (!out) return;
+        }
+        if (std::rename(tmp.c_str(), binaryPath().c_str()) != 0) std::remove(tmp.c_str());  // someone else cached it first
+    }
+
+    // submits the compilation and link of the program, without waiting for them
+    void build(const std::string& vertexCode, const std::string& fragmentCode, const std::string& geometryCode)
+    {
+        const bool useCache = !binaryCacheFolder().empty() && hasProgramBinary();
+        if (useCache)
+        {
+            cacheKey = makeCacheKey(vertexCode, fragmentCode, geometryCode);
+            if (loadBinary())
+            {
+                reflect();
+                return;     // warm start: no compilation at all
+            }
+        }
+
+        auto submit = [this](GLenum type, const std::string& code, const char* name) {
+            const char* source = code.c_str();
+            unsigned int shader = glCreateShader(type);
+            glShaderSource(shader, 1, &source, NULL);
+            glCompileShader(shader);
+            stages.emplace_back(shader, name);
+        };
+        submit(GL_VERTEX_SHADER, vertexCode, "VERTEX");
+        submit(GL_FRAGMENT_SHADER, fragmentCode, "FRAGMENT");
+        if (!geometryCode.empty()) submit(GL_GEOMETRY_SHADER, geometryCode, "GEOMETRY");
+
+        // shader Program
+        ID = glCreateProgram();
+        for (const auto& stage : stages) glAttachShader(ID, stage.first);
+        if (useCache) glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(ID);
+        pending = true;
+    }
+
+    // waits for the compilation and link submitted by build: checks the errors, reflects the program and caches its binary
+    void ensureLinked()
+    {
+        if (!pending) return;
+        pending = false;
+        for (const auto& stage : stages) checkCompileErrors(stage.first, stage.second);
+        checkCompileErrors(ID, "PROGRAM");
+        reflect();
+        GLint success = GL_FALSE;
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        if (success && !cacheKey.empty()) saveBinary();
+        // delete the shaders as they're linked into our program now and no longer necessery
+        for (const auto& stage : stages)
+        {
+            glDetachShader(ID, stage.first);
+            glDeleteShader(stage.first);
+        }
+        stages.clear();
+    }
+
+    // binding point of a uniform block: the shared ones have a fixed binding, the others get the following ones
+    static GLuint blockBinding(const std::string& name, GLuint blockIndex)
+    {
+        if (name == "Frame") return FRAME_BLOCK_BINDING;
+        if (name == "Light") return LIGHT_BLOCK_BINDING;
+        return LIGHT_BLOCK_BINDING + 1 + blockIndex;
+    }
+
+    // queries the active uniforms and blocks of the linked program: fills the locations table and binds the blocks
+    // ------------------------------------------------------------------------
+    void reflect()
+    {
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::string name(maxLength > 0 ? maxLength : 1, '\0');
+        for (GLint i = 0; i < count; ++i)
+        {
+            GLsizei length = 0;
+            GLint size = 0;
+            GLenum type;
+            glGetActiveUniform(ID, static_cast<GLuint>(i), maxLength, &length, &size, &type, &name[0]);
+            std::string uniform = name.substr(0, length);
+            GLint loc = glGetUniformLocation(ID, uniform.c_str());
+            if (loc == -1) continue;    // member of a uniform block
+            uniformLocations.emplace_back(uniform, loc);
+            // arrays are reported as "name[0]": make them reachable as "name" too
+            if (uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0)
+                uniformLocations.emplace_back(uniform.substr(0, uniform.size() - 3), loc);
+        }
+        std::sort(uniformLocations.begin(), uniformLocations.end());
+
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+        name.assign(maxLength > 0 ? maxLength : 1, '\0');
+        for (GLint i = 0; i < count; ++i)
+        {
+            GLsizei length = 0;
+            glGetActiveUniformBlockName(ID, static_cast<GLuint>(i), maxLength, &length, &name[0]);
+            glUniformBlockBinding(ID, static_cast<GLuint>(i), blockBinding(name.substr(0, length), static_cast<GLuint>(i)));
+        }
+    }
+
     // utility function for checking shader compilation/linking errors.
     // ------------------------------------------------------------------------
     void checkCompileErrors(GLuint shader, std::string type)
@@ -0,0 +1,56 @@
+#ifndef SHADER_VARIANTS_H
+#define SHADER_VARIANTS_H
+
+#include <shaderClass.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// What a pass writes. Each output is a compile-time specialization (a #define) of the same shader sources
+enum class ShaderOutput {
+    DepthOnly,  // nothing but the depth buffer: empty fragment shader
+    Normals,    // world space normals, remapped to [0,1]
+    HDR,        // shaded color, not clamped
+    GBuffer     // HDR color in attachment 0 and normals in attachment 1, in one pass
+};
+
+inline const char* outputDefine(ShaderOutput output)
+{
+    switch (output)
+    {
+    case ShaderOutput::DepthOnly: return "OUTPUT_DEPTH_ONLY";
+    case ShaderOutput::Normals:   return "OUTPUT_NORMALS";
+    case ShaderOutput::HDR:       return "OUTPUT_HDR";
+    case ShaderOutput::GBuffer:   return "OUTPUT_GBUFFER";
+    }
+    return "";
+}
+
+// The permutations of a vertex/fragment pair, one program per output type. All the requested variants are submitted at
+// construction, so that the driver can compile them in parallel; each one is compiled once (and then cached, see Shader)
+class ShaderVariants {
+public:
+    ShaderVariants(const char* vertexPath, const char* fragmentPath, const std::vector<ShaderOutput>& outputs)
+    {
+        for (ShaderOutput output : outputs)
+            variants.emplace(output, Shader(vertexPath, fragmentPath, std::vector<std::string>{ outputDefine(output) }));
+    }
+
+    Shader& get(ShaderOutput output)
+    {
+        return variants.at(output);
+    }
+
+    // to set the uniforms which all the variants share, e.g. the model and normal matrices
+    template<typename F>
+    void forEach(F f)
+    {
+        for (auto& variant : variants) f(variant.second);
+    }
+
+private:
+    std::map<ShaderOutput, Shader> variants;
+};
+
+#endif
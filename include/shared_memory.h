@@ -0,0 +1,122 @@
+#ifndef SHARED_MEMORY_H
+#define SHARED_MEMORY_H
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#undef near     // windows.h defines these as empty macros, which would break conf::near and conf::far
+#undef far
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A named block of memory mapped read-write by several processes of the node: POSIX shared memory (shm_open, the name
+// gets a leading '/') or a Windows named file mapping. The creator removes the name when it goes, the processes which
+// still map the block keep it until they unmap it.
+class SharedMemory {
+public:
+    SharedMemory() = default;
+
+    // creates (or recreates) the block
+    static SharedMemory create(const std::string& name, size_t size) { return SharedMemory(name, size, true); }
+    // maps a block created by another process, whatever its size. quiet: no error if there is none (yet)
+    static SharedMemory open(const std::string& name, bool quiet = false) { return SharedMemory(name, 0, false, quiet); }
+
+    ~SharedMemory() { release(); }
+
+    SharedMemory(SharedMemory&& other) noexcept { *this = std::move(other); }
+    SharedMemory& operator=(SharedMemory&& other) noexcept
+    {
+        if (this == &other) return *this;
+        release();
+        bytes = other.bytes;
+        length = other.length;
+        owner = other.owner;
+        path = other.path;
+#ifdef _WIN32
+        mapping = other.mapping;
+        other.mapping = NULL;
+#endif
+        other.bytes = nullptr;
+        other.length = 0;
+        other.owner = false;
+        return *this;
+    }
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    unsigned char* data() const { return bytes; }     // null if the block could not be created or mapped
+    size_t size() const { return length; }
+
+private:
+    unsigned char* bytes{ nullptr };
+    size_t length{ 0 };
+    bool owner{ false };
+    std::string path;
+#ifdef _WIN32
+    HANDLE mapping{ NULL };
+#endif
+
+    SharedMemory(const std::string& name, size_t size, bool create, bool quiet = false) : owner(create)
+    {
+#ifdef _WIN32
+        path = "Local\\" + name;
+        if (create)
+        {
+            unsigned long long size64 = size;
+            mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, static_cast<DWORD>(size64 >> 32), static_cast<DWORD>(size64 & 0xFFFFFFFFull), path.c_str());
+        }
+        else mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, path.c_str());
+        if (mapping == NULL)
+        {
+            if (!quiet) std::cout << "ERROR::SHARED_MEMORY:: cannot " << (create ? "create " : "open ") << name << std::endl;
+            return;
+        }
+        bytes = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+        if (bytes == nullptr) return;
+        MEMORY_BASIC_INFORMATION info;
+        length = VirtualQuery(bytes, &info, sizeof(info)) ? (create ? size : info.RegionSize) : 0;
+#else
+        path = name[0] == '/' ? name : "/" + name;
+        int fd = create ? shm_open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600) : shm_open(path.c_str(), O_RDWR, 0);
+        if (fd < 0)
+        {
+            if (!quiet) std::cout << "ERROR::SHARED_MEMORY:: cannot " << (create ? "create " : "open ") << name << std::endl;
+            return;
+        }
+        struct stat info;
+        if (create && ftruncate(fd, static_cast<off_t>(size)) != 0) { close(fd); return; }
+        if (!create) size = fstat(fd, &info) == 0 ? static_cast<size_t>(info.st_size) : 0;
+        void* address = size > 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);  // the mapping keeps the block
+        if (address == MAP_FAILED) return;
+        bytes = static_cast<unsigned char*>(address);
+        length = size;
+#endif
+    }
+
+    void release()
+    {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping != NULL) CloseHandle(mapping);
+        mapping = NULL;
+#else
+        if (bytes) munmap(bytes, length);
+        if (owner && !path.empty()) shm_unlink(path.c_str());
+#endif
+        bytes = nullptr;
+        length = 0;
+        owner = false;
+    }
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue between exactly one producer thread and one consumer thread. push and pop never block: they
+// fail when the queue is full or empty, and the caller decides how to wait (that is where the backpressure goes).
+// The two indices sit on their own cache lines, so that the threads do not fight over one.
+template<typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity + 1) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // producer side
+    bool push(T value)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % slots.size();
+        if (next == head.load(std::memory_order_acquire)) return false;    // full
+        slots[t] = std::move(value);
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side
+    bool pop(T& value)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;       // empty
+        value = std::move(slots[h]);
+        head.store((h + 1) % slots.size(), std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+    size_t capacity() const { return slots.size() - 1; }
+
+private:
+    std::vector<T> slots;   // one more than the capacity: head == tail means empty
+    alignas(64) std::atomic<size_t> head{ 0 };  // next to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail{ 0 };  // next to push, written by the producer
+};
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef STAGE_TIMERS_H
+#define STAGE_TIMERS_H
+
+#include <glad/glad.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Where the time of a frame goes, stage by stage, summed over a run (see the benchmark). Off unless enabled: a disabled
+// stage costs one relaxed load.
+//
+// The CPU stages are timed by ScopedStage on whichever thread runs them (the import in the streaming threads, the encoding
+// in the encoder thread), the GPU ones (the passes, the copies into the readback buffers) by GpuStageTimer queries. A stage
+// started inside another one on the same thread is not counted in the outer one: the import does not include the decoding
+// of its textures, the encoding does not include the hand-over of its chunks to the writer.
+
+enum class Stage {
+    Import,         // model file (or asset cache) to ModelData, textures excluded
+    TextureDecode,  // image files to pixels
+    Upload,         // ModelData to GL buffers and textures (the CPU side of the GL calls)
+    DepthPass,      // GPU
+    HDRPass,        // GPU
+    NormalsPass,    // GPU
+    GBufferPass,    // GPU, HDR and normals at once
+    Readback,       // GPU, framebuffers to pixel buffers
+    Encode,         // mapped pixels to text, or to the frame ring
+    Write,          // the encoder handing its chunks to the writer, waits on a full queue included
+    Count
+};
+
+inline const char* stageName(Stage stage)
+{
+    static const char* names[] = { "import", "texture_decode", "upload", "depth_pass", "HDR_pass", "normals_pass", "gbuffer_pass", "readback", "encode", "write" };
+    return names[static_cast<int>(stage)];
+}
+
+class StageTimers {
+public:
+    static constexpr int STAGES{ static_cast<int>(Stage::Count) };
+
+    struct Total {
+        uint64_t ns{ 0 };
+        uint64_t count{ 0 };    // times the stage ran
+
+        double milliseconds() const { return ns / 1e6; }
+    };
+
+    // all the stages at once, to subtract the totals of two moments
+    struct Totals {
+        Total stages[STAGES];
+
+        const Total& operator[](Stage stage) const { return stages[static_cast<int>(stage)]; }
+        Totals operator-(const Totals& before) const
+        {
+            Totals difference;
+            for (int i = 0; i < STAGES; ++i)
+            {
+                difference.stages[i].ns = stages[i].ns - before.stages[i].ns;
+                difference.stages[i].count = stages[i].count - before.stages[i].count;
+            }
+            return difference;
+        }
+    };
+
+    static StageTimers& global()
+    {
+        static StageTimers timers;
+        return timers;
+    }
+
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+    void enable(bool enable = true) { on.store(enable, std::memory_order_relaxed); }
+
+    void add(Stage stage, uint64_t ns, uint64_t count = 1)
+    {
+        totals[static_cast<int>(stage)].ns.fetch_add(ns, std::memory_order_relaxed);
+        totals[static_cast<int>(stage)].count.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    // the totals so far. The stages still running, and the GPU queries not collected yet, are not in there
+    Totals snapshot() const
+    {
+        Totals result;
+        for (int i = 0; i < STAGES; ++i)
+        {
+            result.stages[i].ns = totals[i].ns.load(std::memory_order_relaxed);
+            result.stages[i].count = totals[i].count.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+private:
+    struct Counter {
+        std::atomic<uint64_t> ns{ 0 };
+        std::atomic<uint64_t> count{ 0 };
+    };
+
+    std::atomic<bool> on{ false };
+    Counter totals[STAGES];
+};
+
+// times its scope as the stage, minus the stages nested in it on the same thread
+class ScopedStage {
+public:
+    explicit ScopedStage(Stage stage) : stage(stage), timed(StageTimers::global().enabled())
+    {
+        if (!timed) return;
+        parent = current();
+        current() = this;
+        start = std::chrono::steady_clock::now();
+    }
+
+    ~ScopedStage()
+    {
+        if (!timed) return;
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        StageTimers::global().add(stage, ns > nested ? ns - nested : 0);
+        if (parent) parent->nested += ns;
+        current() = parent;
+    }
+
+    ScopedStage(const ScopedStage&) = delete;
+    ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+    Stage stage;
+    bool timed;
+    ScopedStage* parent{ nullptr };
+    uint64_t nested{ 0 };
+    std::chrono::steady_clock::time_point start;
+
+    static ScopedStage*& current()
+    {
+        thread_local ScopedStage* stage = nullptr;
+        return stage;
+    }
+};
+
+// GPU stages, timed by GL_TIME_ELAPSED queries: begin() and end() around the commands of a stage, one stage at a time.
+// The results are collected later, without waiting for the GPU (collect(false), e.g. once per frame) or waiting for all
+// of them (collect(true), e.g. after a flush). The queries belong to the current context, which must still be there when
+// the timer is deleted.
+class GpuStageTimer {
+public:
+    GpuStageTimer() = default;
+    ~GpuStageTimer()
+    {
+        if (!queries.empty()) glDeleteQueries(static_cast<GLsizei>(queries.size()), queries.data());
+    }
+
+    GpuStageTimer(const GpuStageTimer&) = delete;
+    GpuStageTimer& operator=(const GpuStageTimer&) = delete;
+
+    void begin(Stage stage)
+    {
+        if (!StageTimers::global().enabled()) return;
+        GLuint query;
+        if (idle.empty())
+        {
+            glGenQueries(1, &query);
+            queries.push_back(query);
+        }
+        else
+        {
+            query = idle.back();
+            idle.pop_back();
+        }
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        pending.push_back({ query, stage });
+        active = true;
+    }
+
+    void end()
+    {
+        if (!active) return;
+        glEndQuery(GL_TIME_ELAPSED);
+        active = false;
+    }
+
+    // adds the results of the finished queries to the totals (in order: the first one not finished stops the others)
+    void collect(bool wait)
+    {
+        while (!pending.empty() && !(active && pending.size() == 1))
+        {
+            Pending& oldest = pending.front();
+            if (!wait)
+            {
+                GLint available = 0;
+                glGetQueryObjectiv(oldest.query, GL_QUERY_RESULT_AVAILABLE, &available);
+                if (!available) return;
+            }
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(oldest.query, GL_QUERY_RESULT, &ns);
+            StageTimers::global().add(oldest.stage, static_cast<uint64_t>(ns));
+            idle.push_back(oldest.query);
+            pending.pop_front();
+        }
+    }
+
+private:
+    struct Pending {
+        GLuint query;
+        Stage stage;
+    };
+
+    std::vector<GLuint> queries;    // all of them, to delete
+    std::vector<GLuint> idle;
+    std::deque<Pending> pending;    // in the order of the stages
+    bool active{ false };
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef UNIFORM_BLOCKS_H
+#define UNIFORM_BLOCKS_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <shaderClass.h>
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// Per-frame data shared by all the programs. Mirrors the std140 block
+//  layout (std140) uniform Frame { mat4 projection; mat4 view; vec3 camPos; float Near; float Far; };
+// (a vec3 followed by a float packs in 16 bytes in std140, like glm::vec3 followed by a float does in C++)
+struct FrameBlock {
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::vec3 camPos;
+    float Near;
+    float Far;
+    float pad[3];
+};
+static_assert(offsetof(FrameBlock, view) == 64, "FrameBlock does not match the std140 layout");
+static_assert(offsetof(FrameBlock, camPos) == 128, "FrameBlock does not match the std140 layout");
+static_assert(offsetof(FrameBlock, Near) == 140, "FrameBlock does not match the std140 layout");
+static_assert(offsetof(FrameBlock, Far) == 144, "FrameBlock does not match the std140 layout");
+
+// Light data, mirrors
+//  layout (std140) uniform Light { vec3 color; vec3 wDir; } light;
+struct LightBlock {
+    glm::vec3 color;
+    float pad0;
+    glm::vec3 wDir;
+    float pad1;
+};
+static_assert(offsetof(LightBlock, wDir) == 16, "LightBlock does not match the std140 layout");
+
+// One uniform buffer holding all the shared blocks, each bound to its binding point (see Shader::reflect).
+// Fill frame and light, then upload(): one buffer write per frame, whatever the number of programs.
+class SharedUniforms {
+public:
+    FrameBlock frame{};
+    LightBlock light{};
+
+    SharedUniforms()
+    {
+        // every block must start at a multiple of the uniform buffer offset alignment
+        GLint alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        lightOffset = align(sizeof(FrameBlock), alignment);
+        size = lightOffset + align(sizeof(LightBlock), alignment);
+        staging.resize(size);
+
+        glGenBuffers(1, &UBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+        glBindBufferRange(GL_UNIFORM_BUFFER, Shader::FRAME_BLOCK_BINDING, UBO, 0, sizeof(FrameBlock));
+        glBindBufferRange(GL_UNIFORM_BUFFER, Shader::LIGHT_BLOCK_BINDING, UBO, lightOffset, sizeof(LightBlock));
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    ~SharedUniforms()
+    {
+        glDeleteBuffers(1, &UBO);
+    }
+    SharedUniforms(const SharedUniforms&) = delete;
+    SharedUniforms& operator=(const SharedUniforms&) = delete;
+
+    // writes both blocks to the GPU
+    void upload()
+    {
+        std::memcpy(&staging[0], &frame, sizeof(FrameBlock));
+        std::memcpy(&staging[lightOffset], &light, sizeof(LightBlock));
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, size, staging.data());
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+private:
+    unsigned int UBO{ 0 };
+    GLsizeiptr size{ 0 };
+    GLintptr lightOffset{ 0 };
+    std::vector<unsigned char> staging;
+
+    static GLsizeiptr align(size_t bytes, GLint alignment)
+    {
+        return static_cast<GLsizeiptr>((bytes + alignment - 1) / alignment * alignment);
+    }
+};
+
+#endif
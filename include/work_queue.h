@@ -0,0 +1,353 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <shared_memory.h>
+#include <job_spec.h>
+#include <render_pipeline.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include "conf.h"
+
+// The frames of a job shared by the worker processes of a node, each pulling chunks as it goes, so that they all finish
+// together however uneven the frames are (a scan of millions of triangles next to a cube).
+//
+// The queue is a block of shared memory (see SharedMemory) created by worker 0, which splits the frames in one range per
+// worker, of equal estimated cost. A worker takes chunks from the front of its range; once it is empty, it steals the
+// back half (by cost) of the range with the most work left. A range is a single 64-bit word (first and end frame, 32 bits
+// each), so taking and stealing are each one compare-and-swap, and no lock is ever held across processes.
+//
+// The cost of a frame of a model is estimated from its triangles, the resolution and the render passes. The workers
+// publish the triangle counts of the models they load (before that, the size of the model file stands for them) and the
+// time they spend per frame of each model: measured times replace the estimates as they come, and calibrate those of the
+// models not rendered yet.
+//
+// Layout:
+//   0                  header: magic, version, workers, frames [first, end), models, creator pid
+//   256                one 64-byte slot per worker: range (atomic)
+//   256 + 64 workers   one 32-byte entry per model: file bytes, triangles, frames measured, nanoseconds measured
+namespace work_queue {
+    constexpr uint64_t MAGIC{ 0x3155455551575244ull };    // "DRWQUEU1"
+    constexpr uint32_t VERSION{ 1 };
+    constexpr size_t HEADER_BYTES{ 256 };
+    constexpr size_t SLOT_BYTES{ 64 };
+    constexpr size_t MODEL_BYTES{ 32 };
+
+    // relative costs of the estimate, before the measures calibrate it
+    constexpr double TRIANGLE_COST{ 1.0 };
+    constexpr double PIXEL_COST{ 0.25 };        // per pixel and pass
+    constexpr double FILE_BYTES_PER_TRIANGLE{ 64.0 };   // the guess until a worker has loaded the model
+
+    // the passes of a frame rendering these outputs (see RenderPolicy)
+    inline unsigned int renderPasses(unsigned int outputs)
+    {
+        bool HDR = (outputs & OUTPUT_HDR) != 0, normals = (outputs & OUTPUT_NORMALS) != 0;
+        return ((outputs & OUTPUT_DEPTH) ? 1 : 0) + (HDR && normals && conf::gbuffer_pass ? 1 : (HDR ? 1 : 0) + (normals ? 1 : 0));
+    }
+
+    inline uint64_t pack(uint64_t first, uint64_t end) { return first | (end << 32); }
+    inline uint64_t first(uint64_t range) { return range & 0xFFFFFFFFull; }
+    inline uint64_t end(uint64_t range) { return range >> 32; }
+
+    struct Header {
+        std::atomic<uint64_t> magic;    // set last by the creator: the rest is ready
+        uint32_t version;
+        uint32_t workers;
+        uint64_t first, end;
+        uint64_t models;
+        int64_t creator;    // pid, to tell a live queue from the leftover of a crashed run
+    };
+
+    struct Slot {
+        std::atomic<uint64_t> range;
+    };
+
+    struct ModelCost {
+        uint64_t fileBytes;
+        std::atomic<uint64_t> triangles;
+        std::atomic<uint64_t> frames;
+        std::atomic<uint64_t> nanoseconds;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "the queue needs lock-free 64-bit atomics: they are shared between processes");
+    static_assert(sizeof(Header) <= HEADER_BYTES && sizeof(Slot) <= SLOT_BYTES && sizeof(ModelCost) <= MODEL_BYTES, "work queue layout");
+}
+
+class WorkQueue {
+public:
+    // the frames [first, end) of the job, shared by the worker processes of the node. Worker 0 creates the queue, the
+    // others wait for it (up to conf::work_queue_wait_s)
+    WorkQueue(const std::string& name, const JobSpec& spec, uint64_t first, uint64_t end, const Shard& worker, unsigned int outputs)
+        : spec(spec), worker(worker.index), framesPerModel(spec.size() / spec.models.size())
+    {
+        pixelCost = work_queue::PIXEL_COST * static_cast<double>(spec.sensor.width) * spec.sensor.height * work_queue::renderPasses(outputs);
+        if (end > 0xFFFFFFFFull)
+        {
+            std::cout << "ERROR::WORK_QUEUE:: frames beyond 2^32 cannot be queued" << std::endl;
+            return;
+        }
+        const size_t bytes = work_queue::HEADER_BYTES + worker.count * work_queue::SLOT_BYTES + spec.models.size() * work_queue::MODEL_BYTES;
+        if (worker.index == 0) create(name, bytes, first, end, worker.count);
+        else attach(name, bytes, first, end, worker.count);
+    }
+
+    WorkQueue(const WorkQueue&) = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+
+    bool valid() const { return header != nullptr; }
+
+    // the next chunk of this worker, [begin, end): from its own range, or stolen from another one. false once every frame
+    // of the node is taken
+    bool next(uint64_t& begin, uint64_t& end)
+    {
+        if (!valid()) return false;
+        while (true)
+        {
+            if (take(begin, end)) return true;
+            if (!steal()) return false;
+        }
+    }
+
+    uint64_t end() const { return valid() ? header->end : 0; }
+
+    // the triangles of a model, now that it is loaded
+    void loaded(size_t model, uint64_t triangles)
+    {
+        if (valid()) costs[model].triangles.store(triangles, std::memory_order_relaxed);
+    }
+
+    // frames of a model rendered in so many seconds
+    void rendered(size_t model, uint64_t frames, double seconds)
+    {
+        if (!valid()) return;
+        costs[model].frames.fetch_add(frames, std::memory_order_relaxed);
+        costs[model].nanoseconds.fetch_add(static_cast<uint64_t>(seconds * 1e9), std::memory_order_relaxed);
+    }
+
+private:
+    SharedMemory memory;
+    const JobSpec& spec;
+    uint64_t worker;
+    uint64_t framesPerModel;
+    double pixelCost{ 0.0 };
+    work_queue::Header* header{ nullptr };
+    work_queue::ModelCost* costs{ nullptr };
+
+    work_queue::Slot& slot(uint64_t w) const
+    {
+        return *reinterpret_cast<work_queue::Slot*>(memory.data() + work_queue::HEADER_BYTES + w * work_queue::SLOT_BYTES);
+    }
+
+    void map()
+    {
+        header = reinterpret_cast<work_queue::Header*>(memory.data());
+        costs = reinterpret_cast<work_queue::ModelCost*>(memory.data() + work_queue::HEADER_BYTES + header->workers * work_queue::SLOT_BYTES);
+    }
+
+    void create(const std::string& name, size_t bytes, uint64_t first, uint64_t end, uint64_t workers)
+    {
+        memory = SharedMemory::create(name, bytes);     // zeroed: every atomic starts at 0
+        if (!memory.data()) return;
+        header = reinterpret_cast<work_queue::Header*>(memory.data());
+        header->version = work_queue::VERSION;
+        header->workers = static_cast<uint32_t>(workers);
+        header->first = first;
+        header->end = end;
+        header->models = spec.models.size();
+#ifdef _WIN32
+        header->creator = _getpid();
+#else
+        header->creator = getpid();
+#endif
+        map();
+        for (size_t m = 0; m < spec.models.size(); ++m)
+        {
+            std::ifstream file(spec.models[m], std::ios::binary | std::ios::ate);
+            costs[m].fileBytes = file ? static_cast<uint64_t>(file.tellg()) : 0;
+        }
+
+        // one range per worker, of equal estimated cost
+        const double scale = calibration();
+        const double total = cost(first, end, scale);
+        uint64_t begin = first;
+        for (uint64_t w = 0; w < workers; ++w)
+        {
+            uint64_t last = w + 1 == workers ? end : split(begin, end, total / workers, scale);
+            slot(w).range.store(work_queue::pack(begin, last), std::memory_order_relaxed);
+            begin = last;
+        }
+        header->magic.store(work_queue::MAGIC, std::memory_order_release);
+        std::cout << "Work queue " << name << ": frames " << first << " to " << end - 1 << " for " << workers << " workers\n";
+    }
+
+    void attach(const std::string& name, size_t bytes, uint64_t first, uint64_t end, uint64_t workers)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(conf::work_queue_wait_s);
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            memory = SharedMemory::open(name, true);
+            if (memory.data() && memory.size() >= work_queue::HEADER_BYTES)
+            {
+                header = reinterpret_cast<work_queue::Header*>(memory.data());
+                if (header->magic.load(std::memory_order_acquire) == work_queue::MAGIC && alive(header->creator))
+                {
+                    if (header->version != work_queue::VERSION || header->workers != workers || header->first != first || header->end != end
+                        || header->models != spec.models.size() || memory.size() < bytes)
+                    {
+                        std::cout << "ERROR::WORK_QUEUE:: " << name << " belongs to another job" << std::endl;
+                        header = nullptr;
+                        return;
+                    }
+                    map();
+                    return;
+                }
+                header = nullptr;
+            }
+            memory = SharedMemory();
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        std::cout << "ERROR::WORK_QUEUE:: worker 0 did not create " << name << " in time" << std::endl;
+    }
+
+    // a stale queue of a crashed run stays until its name is reused: only the one of a running worker 0 is joined
+    static bool alive(int64_t pid)
+    {
+#ifdef _WIN32
+        return pid != 0;    // the named mappings go with the last process mapping them
+#else
+        return pid > 0 && (kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM);
+#endif
+    }
+
+    // estimated time of a frame of the model (in the units of the measures once there are some), scale being calibration()
+    double frameCost(size_t model, double scale) const
+    {
+        const work_queue::ModelCost& entry = costs[model];
+        uint64_t frames = entry.frames.load(std::memory_order_relaxed);
+        if (frames > 0) return static_cast<double>(entry.nanoseconds.load(std::memory_order_relaxed)) / frames;
+        return estimate(model) * scale;
+    }
+
+    double estimate(size_t model) const
+    {
+        uint64_t triangles = costs[model].triangles.load(std::memory_order_relaxed);
+        double guess = triangles > 0 ? static_cast<double>(triangles) : costs[model].fileBytes / work_queue::FILE_BYTES_PER_TRIANGLE;
+        return work_queue::TRIANGLE_COST * guess + pixelCost;
+    }
+
+    // nanoseconds per unit of estimate, over the models measured so far (1 before any measure). A pass over all the
+    // models: taken once per take() or steal(), not per frame cost
+    double calibration() const
+    {
+        double measured = 0.0, estimated = 0.0;
+        for (size_t m = 0; m < header->models; ++m)
+        {
+            uint64_t frames = costs[m].frames.load(std::memory_order_relaxed);
+            if (frames == 0) continue;
+            measured += static_cast<double>(costs[m].nanoseconds.load(std::memory_order_relaxed));
+            estimated += estimate(m) * frames;
+        }
+        return estimated > 0.0 ? measured / estimated : 1.0;
+    }
+
+    // estimated cost of the frames [begin, end): they come in runs of one model
+    double cost(uint64_t begin, uint64_t end, double scale) const
+    {
+        double total = 0.0;
+        while (begin < end)
+        {
+            size_t model = static_cast<size_t>(begin / framesPerModel);
+            uint64_t last = std::min(end, (model + 1) * framesPerModel);
+            total += frameCost(model, scale) * (last - begin);
+            begin = last;
+        }
+        return total;
+    }
+
+    // the frame after which [begin, ...) has cost about budget, within [begin, end]
+    uint64_t split(uint64_t begin, uint64_t end, double budget, double scale) const
+    {
+        while (begin < end)
+        {
+            size_t model = static_cast<size_t>(begin / framesPerModel);
+            uint64_t last = std::min(end, (model + 1) * framesPerModel);
+            double perFrame = std::max(frameCost(model, scale), 1e-9), run = perFrame * (last - begin);
+            if (run >= budget) return begin + static_cast<uint64_t>(std::min(static_cast<double>(last - begin), std::ceil(budget / perFrame)));
+            budget -= run;
+            begin = last;
+        }
+        return end;
+    }
+
+    // a chunk from the front of the own range: a quarter of its remaining cost (guided scheduling: the chunks shrink as
+    // the range does, so the last ones are short), within one model
+    bool take(uint64_t& begin, uint64_t& end)
+    {
+        std::atomic<uint64_t>& range = slot(worker).range;
+        uint64_t current = range.load(std::memory_order_acquire);
+        const double scale = calibration();
+        while (true)
+        {
+            uint64_t first = work_queue::first(current), last = work_queue::end(current);
+            if (first >= last) return false;
+            uint64_t modelEnd = std::min(last, (first / framesPerModel + 1) * framesPerModel);
+            uint64_t chunkEnd = std::clamp<uint64_t>(split(first, last, cost(first, last, scale) / 4.0, scale), first + 1, modelEnd);
+            if (range.compare_exchange_weak(current, work_queue::pack(chunkEnd, last), std::memory_order_acq_rel))
+            {
+                begin = first;
+                end = chunkEnd;
+                return true;
+            }
+        }
+    }
+
+    // the back half (by cost) of the range with the most work left, into the own (empty) range. false if there is none
+    bool steal()
+    {
+        const double scale = calibration();
+        while (true)
+        {
+            uint64_t victim = header->workers;
+            double most = 0.0;
+            for (uint64_t w = 0; w < header->workers; ++w)
+            {
+                if (w == worker) continue;
+                uint64_t range = slot(w).range.load(std::memory_order_acquire);
+                if (work_queue::end(range) - std::min(work_queue::first(range), work_queue::end(range)) < 2) continue;
+                double left = cost(work_queue::first(range), work_queue::end(range), scale);
+                if (left > most) { most = left; victim = w; }
+            }
+            if (victim == header->workers) return false;
+
+            std::atomic<uint64_t>& range = slot(victim).range;
+            uint64_t current = range.load(std::memory_order_acquire);
+            uint64_t first = work_queue::first(current), last = work_queue::end(current);
+            if (last < first + 2) continue;     // taken meanwhile: look again
+            uint64_t middle = std::clamp<uint64_t>(split(first, last, cost(first, last, scale) / 2.0, scale), first + 1, last - 1);
+            if (range.compare_exchange_strong(current, work_queue::pack(first, middle), std::memory_order_acq_rel))
+            {
+                slot(worker).range.store(work_queue::pack(middle, last), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+};
+
+#endif